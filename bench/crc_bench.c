@@ -0,0 +1,96 @@
+/* CRC-CCITT microbenchmark: MB/s of each engine in crc_ccitt.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../crc_ccitt.h"
+
+#define BUF_SIZE	(8 * 1024 * 1024)
+#define MIN_TIME	0.5	/* seconds per measurement */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const struct {
+	const char *name;
+	uint16_t (*fn)(uint16_t, const void *, size_t);
+} engines[] = {
+	{ "bytewise", crc_ccitt_bytewise },
+	{ "slice8", crc_ccitt_slice8 },
+	{ "clmul", crc_ccitt_clmul },
+	{ "crc_ccitt", crc_ccitt },
+};
+
+static double measure(uint16_t (*fn)(uint16_t, const void *, size_t),
+		      const uint8_t *buf, size_t len, uint16_t *crc)
+{
+	double t0 = now(), t;
+	size_t bytes = 0;
+
+	do {
+		*crc = fn(0xffff, buf, len);
+		bytes += len;
+		t = now() - t0;
+	} while (t < MIN_TIME);
+
+	return bytes / t / 1e6;
+}
+
+int main(void)
+{
+	static const size_t sizes[] = { 40, 4096, BUF_SIZE };
+	uint16_t ref, crc, a, b;
+	uint8_t *buf;
+	size_t i, s, split;
+	int e, status = 0;
+
+	buf = malloc(BUF_SIZE);
+	if (!buf)
+		return 1;
+	srand(1);
+	for (i = 0; i < BUF_SIZE; i++)
+		buf[i] = rand();
+
+	/* cross-check every engine on awkward lengths and alignments */
+	for (s = 0; s < 300; s++) {
+		ref = crc_ccitt_bytewise(0x1234, buf + (s & 7), s);
+		for (e = 0; e < 4; e++)
+			if (engines[e].fn(0x1234, buf + (s & 7), s) != ref) {
+				printf("MISMATCH %s len=%zu\n", engines[e].name, s);
+				status = 1;
+			}
+	}
+
+	ref = crc_ccitt_bytewise(0xffff, buf, BUF_SIZE);
+	for (split = 0; split <= BUF_SIZE; split += BUF_SIZE / 7) {
+		a = crc_ccitt(0xffff, buf, split);
+		b = crc_ccitt(0, buf + split, BUF_SIZE - split);
+		if (crc_ccitt_combine(a, b, BUF_SIZE - split) != ref) {
+			printf("MISMATCH combine split=%zu\n", split);
+			status = 1;
+		}
+	}
+
+	printf("# crc_ccitt clmul=%s\n", crc_ccitt_have_clmul() ? "yes" : "no");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		ref = crc_ccitt_bytewise(0xffff, buf, sizes[s]);
+		for (e = 0; e < 4; e++) {
+			double mbs = measure(engines[e].fn, buf, sizes[s], &crc);
+
+			printf("crc %-9s len=%-8zu %10.1f MB/s%s\n", engines[e].name,
+			       sizes[s], mbs, crc == ref ? "" : " MISMATCH");
+			if (crc != ref)
+				status = 1;
+		}
+	}
+
+	free(buf);
+	return status;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Memory footprint of a load: builds gobi_loader-static for every ring
+# size in RINGS, loads the emulator with each and with the regular
+# gobi_loader, and reports peak RSS and throughput per transfer mode.
+#
+# Tunables (environment):
+#   RINGS       ring sizes in bytes to build   (4096 16384 65536 262144)
+#   MODES       -transfer modes to run         (sendfile buffered pipeline)
+#   RUNS        loads per build and mode       (3)
+# and those of run_bench.sh, e.g. BANDWIDTH to see what a small ring costs
+# on a link of a given speed.
+
+RINGS=${RINGS:-4096 16384 65536 262144}
+MODES=${MODES:-sendfile buffered pipeline}
+RUNS=${RUNS:-3}
+
+work=$(mktemp -d /tmp/gobi_footprint.XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+for ring in $RINGS; do
+	make -s gobi_loader-static RING=$ring || exit 1
+	cp gobi_loader-static "$work/gobi_loader-$ring"
+done
+cp gobi_loader "$work/gobi_loader-heap"
+make -s gobi_loader-static || exit 1	# back to the default RING
+
+printf "%-8s %-9s %8s %14s\n" build transfer rss_kb "B/s"
+status=0
+for build in heap $RINGS; do
+	for mode in $MODES; do
+		rm -f "$work/metrics"
+		if ! RUNS=$RUNS LOADER="$work/gobi_loader-$build" \
+		     LOADER_ARGS="-transfer $mode -metrics $work/metrics" \
+		     sh bench/run_bench.sh > "$work/out"; then
+			cat "$work/out"
+			status=1
+			continue
+		fi
+		rss=$(sed -n 's/.*"peak_rss_kb":\([0-9]*\).*/\1/p' "$work/metrics" |
+		      sort -n | tail -1)
+		rate=$(awk '$3 == "total" { s += $8; n++ }
+			    END { printf "%.0f", n ? s / n : 0 }' "$work/out")
+		printf "%-8s %-9s %8s %14s\n" $build $mode "$rss" "$rate"
+	done
+done
+
+exit $status
@@ -0,0 +1,151 @@
+/*
+ * Loader hot path microbenchmarks: CRC-CCITT, command frame encoding as
+ * qdl_server_send_request() does it, and response parsing as
+ * qdl_server_wait_response() does it, whole and byte by byte.
+ *
+ * Output is one "name<TAB>value<TAB>unit" line per measurement, for
+ * bench/suite.sh to check against bench/thresholds. Exits 1 if an encoded
+ * or decoded frame comes out wrong.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../crc_ccitt.h"
+#include "../hdlc.h"
+
+#define MIN_TIME	0.3	/* seconds per measurement */
+#define BATCH		1024	/* calls between clock reads */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint16_t sink;
+static int status;
+
+/* open request for a 9MB amss image, as qdl_open_request() builds it */
+static const uint8_t open_req[] = { 0x25, 0x05, 0x38, 0x54, 0x89, 0x00,
+				    0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t hello_req[] = { 0x01, 'Q', 'C', 'O', 'M', ' ', 'h',
+	'i', 'g', 'h', ' ', 's', 'p', 'e', 'e', 'd', ' ', 'p', 'r', 'o',
+	't', 'o', 'c', 'o', 'l', ' ', 'h', 's', 't', 0x00, 0x00, 0x00, 0x00,
+	0x05, 0x05, 0x30 };
+static const uint8_t hello_resp[] = { 0x02, 'Q', 'C', 'O', 'M', ' ', 'h',
+	'i', 'g', 'h', ' ', 's', 'p', 'e', 'e', 'd', ' ', 'p', 'r', 'o',
+	't', 'o', 'c', 'o', 'l', ' ', 'd', 'e', 'v', 0x04, 0x04 };
+static const uint8_t done_resp[] = { 0x28, 0x00, 0x00 };
+
+static void result(const char *name, double value, const char *unit)
+{
+	printf("%s\t%.1f\t%s\n", name, value, unit);
+}
+
+static void bench_crc(const char *name, const uint8_t *buf, size_t len)
+{
+	double t0 = now(), t;
+	size_t bytes = 0;
+	int i;
+
+	do {
+		for (i = 0; i < BATCH; i++) {
+			sink = crc_ccitt(0xffff, buf, len);
+			bytes += len;
+		}
+		t = now() - t0;
+	} while (t < MIN_TIME);
+	result(name, bytes / t / 1e6, "MB/s");
+}
+
+static void bench_encode(const char *name, const uint8_t *data, size_t len)
+{
+	uint8_t out[HDLC_ENCODED_MAX(256)];
+	uint8_t frame[256];
+	struct hdlc_decoder dec;
+	double t0 = now(), t;
+	unsigned long calls = 0;
+	size_t n = 0, used;
+	int i;
+
+	do {
+		for (i = 0; i < BATCH; i++)
+			n = hdlc_encode(out, sizeof(out), data, len);
+		calls += BATCH;
+		t = now() - t0;
+	} while (t < MIN_TIME);
+	result(name, t / calls * 1e9, "ns");
+
+	hdlc_decoder_init(&dec, frame, sizeof(frame));
+	if (hdlc_decode(&dec, out + 1, n - 1, &used) != HDLC_FRAME ||
+	    dec.len != len || memcmp(frame, data, len)) {
+		fprintf(stderr, "MISMATCH %s\n", name);
+		status = 1;
+	}
+}
+
+/* one response frame fed in pieces of step bytes, like short tty reads */
+static void bench_decode(const char *name, const uint8_t *data, size_t len,
+			 size_t step)
+{
+	uint8_t wire[HDLC_ENCODED_MAX(64)];
+	uint8_t frame[64];
+	struct hdlc_decoder dec;
+	double t0 = now(), t;
+	unsigned long calls = 0;
+	size_t n, off, used, chunk;
+	int i, ret = HDLC_MORE;
+
+	n = hdlc_encode(wire, sizeof(wire), data, len);
+	do {
+		for (i = 0; i < BATCH; i++) {
+			hdlc_decoder_init(&dec, frame, sizeof(frame));
+			for (off = 0; off < n; off += used) {
+				chunk = n - off < step ? n - off : step;
+				ret = hdlc_decode(&dec, wire + off, chunk, &used);
+				if (ret != HDLC_MORE)
+					break;
+			}
+		}
+		calls += BATCH;
+		t = now() - t0;
+	} while (t < MIN_TIME);
+	result(name, t / calls * 1e9, "ns");
+
+	if (ret != HDLC_FRAME || frame[0] != data[0]) {
+		fprintf(stderr, "MISMATCH %s\n", name);
+		status = 1;
+	}
+}
+
+int main(void)
+{
+	static uint8_t buf[256 * 1024];
+	uint8_t escapes[64];
+	size_t i;
+
+	srand(1);
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = rand();
+	memset(escapes, HDLC_FLAG, sizeof(escapes));
+
+	bench_crc("crc_ccitt_13", buf, 13);
+	bench_crc("crc_ccitt_4k", buf, 4096);
+	bench_crc("crc_ccitt_256k", buf, sizeof(buf));
+
+	bench_encode("encode_open", open_req, sizeof(open_req));
+	bench_encode("encode_hello", hello_req, sizeof(hello_req));
+	bench_encode("encode_escapes_64", escapes, sizeof(escapes));
+
+	bench_decode("decode_ack", done_resp, sizeof(done_resp), 64);
+	bench_decode("decode_ack_bytewise", done_resp, sizeof(done_resp), 1);
+	bench_decode("decode_hello", hello_resp, sizeof(hello_resp), 64);
+	bench_decode("decode_hello_bytewise", hello_resp, sizeof(hello_resp), 1);
+
+	return status;
+}
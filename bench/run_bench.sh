@@ -0,0 +1,151 @@
+#!/bin/sh
+# End-to-end load benchmark: runs the real gobi_loader against the QDL
+# device emulator on a pty and reports wall-clock time and bytes/s per image.
+#
+# Tunables (environment):
+#   LOADER      loader binary                  (./gobi_loader)
+#   EMU         emulator binary                (./tools/qdl_emu)
+#   FIRMWARE    directory with apps.mbn/UQCN.mbn (firmware/panasonic/cf-f9)
+#   AMSS_SIZE   size of the synthetic amss.mbn in bytes (9000000, GSM sized)
+#   BANDWIDTH   emulated link bandwidth in bytes/s, 0 = unlimited (0)
+#   LATENCY     emulated per-transfer latency in usec (0)
+#   ACK_DELAY   emulated response delay in usec (0)
+#   RUNS        number of loads to average (3)
+#   LOADER_ARGS extra gobi_loader options, e.g. "-transfer buffered"
+#   EMU_ARGS    extra qdl_emu options, e.g. "-s" to split responses
+#   BUNDLE      1 = "gobi_loader pack" the firmware and load the bundle (0)
+#   TRANSPORT   tty, socket or usbfs: the loader's link to the emulator;
+#               usbfs runs through tools/usbfs_mock.so (tty)
+#   COMPRESS    xz or lz4: store amss.mbn and apps.mbn compressed, with
+#               COMPRESS_ARGS for the compressor, and report how often the
+#               link waited for the decoder ("")
+#   VERIFY      1 = write a SHA256SUMS manifest, so every image is hashed
+#               while it streams (0)
+
+LOADER=${LOADER:-./gobi_loader}
+EMU=${EMU:-./tools/qdl_emu}
+FIRMWARE=${FIRMWARE:-firmware/panasonic/cf-f9}
+AMSS_SIZE=${AMSS_SIZE:-9000000}
+BANDWIDTH=${BANDWIDTH:-0}
+LATENCY=${LATENCY:-0}
+ACK_DELAY=${ACK_DELAY:-0}
+RUNS=${RUNS:-3}
+LOADER_ARGS=${LOADER_ARGS:-}
+EMU_ARGS=${EMU_ARGS:-}
+BUNDLE=${BUNDLE:-0}
+TRANSPORT=${TRANSPORT:-tty}
+MOCK=${MOCK:-./tools/usbfs_mock.so}
+COMPRESS=${COMPRESS:-}
+COMPRESS_ARGS=${COMPRESS_ARGS:-}
+VERIFY=${VERIFY:-0}
+
+work=$(mktemp -d /tmp/gobi_bench.XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# Only apps and UQCN images ship in firmware/, so synthesise an amss image;
+# random data doesn't compress, so build a compressed one from apps.mbn
+if [ -n "$COMPRESS" ]; then
+	n=$((AMSS_SIZE / $(wc -c < "$FIRMWARE/apps.mbn") + 1))
+	while [ $n -gt 0 ]; do cat "$FIRMWARE/apps.mbn"; n=$((n - 1)); done |
+		head -c "$AMSS_SIZE" > "$work/amss.mbn"
+else
+	head -c "$AMSS_SIZE" /dev/urandom > "$work/amss.mbn"
+fi
+ln -s "$(cd "$FIRMWARE" && pwd)/apps.mbn" "$work/apps.mbn"
+for f in UQCN.mbn uqcn.mbn; do
+	[ -e "$FIRMWARE/$f" ] && ln -s "$(cd "$FIRMWARE" && pwd)/$f" "$work/UQCN.mbn"
+done
+
+case "$COMPRESS" in
+"") ;;
+xz)
+	for f in amss apps; do
+		xz -c $COMPRESS_ARGS "$work/$f.mbn" > "$work/$f.mbn.xz" || exit 1
+		rm "$work/$f.mbn"
+	done ;;
+lz4)
+	for f in amss apps; do
+		lz4 -q -c --content-size $COMPRESS_ARGS "$work/$f.mbn" > "$work/$f.mbn.lz4" || exit 1
+		rm "$work/$f.mbn"
+	done ;;
+*)
+	echo "COMPRESS must be xz or lz4" >&2
+	exit 1 ;;
+esac
+
+if [ "$VERIFY" = 1 ]; then
+	"$LOADER" -2000 manifest "$work" || exit 1
+fi
+
+fw="$work"
+if [ "$BUNDLE" = 1 ]; then
+	"$LOADER" -2000 pack "$work" "$work/fw.gbl" || exit 1
+	fw="$work/fw.gbl"
+fi
+
+# socket and usbfs links need the emulator on a unix socket instead of a pty
+link="$work/tty"
+emu_link=
+preload=
+case "$TRANSPORT" in
+tty) ;;
+socket)
+	emu_link=-u ;;
+usbfs)
+	emu_link=-u
+	link=/dev/bus/usb/001/001
+	export USBFS_MOCK_SOCKET="$work/tty" USBFS_MOCK_DEVICE="$link"
+	preload="$(cd "$(dirname "$MOCK")" && pwd)/$(basename "$MOCK")" ;;
+*)
+	echo "TRANSPORT must be tty, socket or usbfs" >&2
+	exit 1 ;;
+esac
+
+now() {
+	date +%s.%N
+}
+
+echo "# link bandwidth=$BANDWIDTH latency=${LATENCY}us ack_delay=${ACK_DELAY}us loader_args=$LOADER_ARGS emu_args=$EMU_ARGS bundle=$BUNDLE transport=$TRANSPORT compress=$COMPRESS $COMPRESS_ARGS verify=$VERIFY"
+run=1
+status=0
+while [ $run -le "$RUNS" ]; do
+	"$EMU" -b "$BANDWIDTH" -l "$LATENCY" -a "$ACK_DELAY" $emu_link \
+		$EMU_ARGS "$work/tty" > "$work/emu.out" &
+	emu=$!
+	while [ ! -e "$work/tty" ]; do sleep 0.01; done
+
+	t0=$(now)
+	LD_PRELOAD=$preload "$LOADER" -2000 -transport "$TRANSPORT" $LOADER_ARGS "$link" "$fw" \
+		> "$work/loader.out" 2>&1
+	rc=$?
+	t1=$(now)
+	wait $emu
+
+	if [ $rc -ne 0 ] || ! grep -q "QDL success" "$work/loader.out"; then
+		echo "run $run: loader failed (rc=$rc)"
+		cat "$work/loader.out"
+		status=1
+	fi
+
+	awk -v run=$run -v t0="$t0" -v t1="$t1" '
+		/^image / {
+			split($4, b, "="); split($5, t, "="); split($6, r, "=")
+			printf "run %d %-9s %10d bytes %9.3f s %12.0f B/s\n",
+				run, $2, b[2], t[2], r[2]
+			total += b[2]
+		}
+		/^session / && $4 != "crc_errors=0" {
+			printf "run %d %s\n", run, $4
+		}
+		END {
+			wall = t1 - t0
+			printf "run %d %-9s %10d bytes %9.3f s %12.0f B/s\n",
+				run, "total", total, wall, (wall > 0 ? total / wall : 0)
+		}' "$work/emu.out"
+	[ -n "$COMPRESS" ] && sed -n "s/^QDL pipeline: /run $run pipeline: /p" "$work/loader.out"
+
+	rm -f "$work/tty"
+	run=$((run + 1))
+done
+
+exit $status
@@ -0,0 +1,85 @@
+#!/bin/sh
+# Benchmark suite: the loader's hot paths (bench/qdl_bench) and full loads
+# of the firmware/ sample images through the emulator on a pty. Results go
+# to OUT as "name<TAB>value<TAB>unit" lines and are checked against the
+# floors in THRESHOLDS; with BASELINE set, also against an earlier OUT
+# from the same machine. Exits 1 on any failed check.
+#
+# Tunables (environment):
+#   OUT         results file                     (bench/results.tsv)
+#   THRESHOLDS  "name >=|<= limit" lines          (bench/thresholds)
+#   BASELINE    earlier results to compare with  ("")
+#   TOLERANCE   percent a result may be worse than BASELINE (20)
+#   SAVE        1 = copy OUT to BASELINE if all checks passed (0)
+#   RUNS        loads per end-to-end measurement (3)
+
+OUT=${OUT:-bench/results.tsv}
+THRESHOLDS=${THRESHOLDS:-bench/thresholds}
+BASELINE=${BASELINE:-}
+TOLERANCE=${TOLERANCE:-20}
+SAVE=${SAVE:-0}
+RUNS=${RUNS:-3}
+
+status=0
+
+# average of the "run N total" lines of run_bench.sh, in B/s
+stream() {
+	RUNS=$RUNS sh bench/run_bench.sh > "$OUT.run" || status=1
+	awk '$3 == "total" { sum += $(NF - 1); n++ }
+		END { printf "%.1f\n", n ? sum / n : 0 }' "$OUT.run"
+}
+
+bench/qdl_bench > "$OUT" || status=1
+
+for m in sendfile pipeline; do
+	printf "stream_%s\t%s\tB/s\n" $m \
+		"$(LOADER_ARGS="-transfer $m" stream)" >> "$OUT"
+done
+
+# share of a 4MB/s link the protocol leaves to image data
+rate=$(BANDWIDTH=4000000 stream)
+printf "link_efficiency_4m\t%s\t%%\n" \
+	"$(awk -v r="$rate" 'BEGIN { printf "%.1f", r / 4000000 * 100 }')" >> "$OUT"
+rm -f "$OUT.run"
+
+cat "$OUT"
+
+awk -F '\t' -v out="$OUT" '
+	FILENAME == out { v[$1] = $2; next }
+	/^#/ || NF == 0 { next }
+	{
+		split($0, f, " ")
+		name = f[1]; op = f[2]; lim = f[3]
+		if (!(name in v)) {
+			printf "FAIL %s missing\n", name; bad = 1; next
+		}
+		ok = op == ">=" ? v[name] >= lim : v[name] <= lim
+		if (!ok) {
+			printf "FAIL %s %s, limit %s %s\n", name, v[name], op, lim
+			bad = 1
+		}
+	}
+	END { exit bad }' "$OUT" "$THRESHOLDS" || status=1
+
+# times (ns) must not grow, everything else must not shrink
+if [ -n "$BASELINE" ] && [ -f "$BASELINE" ]; then
+	awk -F '\t' -v tol="$TOLERANCE" '
+		FILENAME == ARGV[1] { base[$1] = $2; next }
+		($1 in base) && base[$1] > 0 {
+			worse = $3 == "ns" ? ($2 - base[$1]) / base[$1] \
+					   : (base[$1] - $2) / base[$1]
+			if (worse * 100 > tol) {
+				printf "FAIL %s %s, baseline %s (%.0f%% worse)\n",
+					$1, $2, base[$1], worse * 100
+				bad = 1
+			}
+		}
+		END { exit bad }' "$BASELINE" "$OUT" || status=1
+fi
+
+# a regressed run must not become the new reference
+if [ $status = 0 ]; then
+	echo "bench: all checks passed"
+	[ "$SAVE" = 1 ] && [ -n "$BASELINE" ] && cp "$OUT" "$BASELINE"
+fi
+exit $status
@@ -0,0 +1,146 @@
+/*
+ * Decompression microbenchmark: MB/s at which unpack.c hands out each
+ * compressed image, read chunk by chunk the way the pipeline reader does,
+ * against the rate of the serial link. Exits 1 if any image unpacks slower
+ * than the link, i.e. the link would sit idle waiting for the decoder.
+ *
+ * Run it on the target, or pinned to one core ("taskset -c 0") to get an
+ * idea of a low-end board. -d writes the unpacked image to stdout instead.
+ * Recipes from "gobi_loader import" are measured too, with -s naming the
+ * store.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../unpack.h"
+#include "../metrics.h"
+#include "../store.h"
+
+#define MIN_TIME	0.5	/* seconds per measurement */
+
+struct io_counters qdl_io;	/* unpack.c counts its reads here */
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one pass over the whole image; 0, or -1 with errno set */
+static int unpack_all(struct unpack *z, char *buf, size_t chunk, uint64_t size,
+		      int out)
+{
+	uint64_t off = 0;
+	ssize_t n;
+
+	while (off < size) {
+		n = unpack_pread(z, buf, chunk, off);
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			return -1;
+		}
+		if (out != -1 && write(out, buf, n) != n)
+			return -1;
+		off += n;
+	}
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-c chunk] [-l link B/s] [-s store] [-d] "
+		"image...\n", argv0);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t chunk = 256 * 1024;	/* the pipeline's default slot */
+	double link = 1e6, t, rate;
+	struct unpack *z;
+	struct stat st;
+	uint64_t size;
+	int opt, fd, codec, passes, dump = 0, status = 0;
+	const char *name;
+	char *buf;
+
+	while ((opt = getopt(argc, argv, "c:l:s:d")) != -1) {
+		switch (opt) {
+		case 'c': chunk = atol(optarg); break;
+		case 'l': link = atof(optarg); break;
+		case 's': store_init(optarg); break;
+		case 'd': dump = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind == argc || !chunk)
+		usage(argv[0]);
+
+	buf = malloc(chunk);
+	if (!buf)
+		return 1;
+
+	if (!dump)
+		printf("%-24s %-4s %10s %10s %9s %9s\n", "image", "type",
+		       "stored", "size", "MB/s", "x link");
+
+	for (; optind < argc; optind++) {
+		fd = open(argv[optind], O_RDONLY);
+		codec = -1;
+		if (fd != -1 && !fstat(fd, &st))
+			codec = unpack_detect(fd, 0, st.st_size, &size);
+		z = codec > 0 ? unpack_open(fd, 0, st.st_size, codec) : NULL;
+		if (!z) {
+			fprintf(stderr, "%s: %s\n", argv[optind], codec ?
+				strerror(errno) : "not compressed");
+			status = 1;
+			goto next;
+		}
+
+		if (dump) {
+			if (unpack_all(z, buf, chunk, size, 1)) {
+				perror(argv[optind]);
+				status = 1;
+			}
+			goto next;
+		}
+
+		passes = 0;
+		t = now();
+		do {
+			if (unpack_all(z, buf, chunk, size, -1)) {
+				perror(argv[optind]);
+				status = 1;
+				goto next;
+			}
+			passes++;
+		} while (now() - t < MIN_TIME);
+		t = now() - t;
+
+		rate = size * passes / t;
+		name = strrchr(argv[optind], '/');
+		printf("%-24s %-4s %10llu %10llu %9.1f %9.1f%s\n",
+		       name ? name + 1 : argv[optind],
+		       unpack_names[codec], (unsigned long long)st.st_size,
+		       (unsigned long long)size, rate / 1e6, rate / link,
+		       rate < link ? "  behind the link" : "");
+		if (rate < link)
+			status = 1;
+next:
+		unpack_close(z);
+		if (fd != -1)
+			close(fd);
+	}
+	free(buf);
+	return status;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Does unpacking keep ahead of the serial link? Compresses a firmware-like
+# amss image a few ways, measures the decoder alone pinned to one core, then
+# loads each way through the emulator at LINK bytes/s and prints how often
+# the pipeline found its ring empty ("link idle").
+#
+# Tunables (environment):
+#   LINK        emulated link bandwidth in bytes/s (1000000)
+#   CPU         core to pin to, "" to not pin (0)
+#   AMSS_SIZE   size of the synthetic amss.mbn in bytes (9000000)
+#   FIRMWARE    directory with apps.mbn (firmware/panasonic/cf-f9)
+#   RUNS        loads per setting (1)
+
+LINK=${LINK:-1000000}
+CPU=${CPU-0}
+AMSS_SIZE=${AMSS_SIZE:-9000000}
+FIRMWARE=${FIRMWARE:-firmware/panasonic/cf-f9}
+RUNS=${RUNS:-1}
+
+pin=
+[ -n "$CPU" ] && command -v taskset > /dev/null && pin="taskset -c $CPU"
+
+work=$(mktemp -d /tmp/gobi_unpack.XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+n=$((AMSS_SIZE / $(wc -c < "$FIRMWARE/apps.mbn") + 1))
+while [ $n -gt 0 ]; do cat "$FIRMWARE/apps.mbn"; n=$((n - 1)); done |
+	head -c "$AMSS_SIZE" > "$work/amss.mbn"
+xz -c -2 "$work/amss.mbn" > "$work/amss-xz2.mbn.xz" || exit 1
+xz -c -6 "$work/amss.mbn" > "$work/amss-xz6.mbn.xz" || exit 1
+lz4 -q -c -B4 --content-size "$work/amss.mbn" > "$work/amss-lz4.mbn.lz4" || exit 1
+lz4 -q -c -9 -B4 --content-size "$work/amss.mbn" > "$work/amss-lz4hc.mbn.lz4" || exit 1
+
+echo "# decoder alone, link=$LINK B/s, cpu=${CPU:-any}"
+status=0
+$pin bench/unpack_bench -l "$LINK" "$work"/amss-*.mbn.* || status=1
+
+for c in "xz -2" "xz -6" "lz4 -B4" "lz4 -9 -B4"; do
+	set -- $c
+	codec=$1
+	shift
+	COMPRESS=$codec COMPRESS_ARGS="$*" BANDWIDTH=$LINK RUNS=$RUNS \
+		AMSS_SIZE=$AMSS_SIZE FIRMWARE=$FIRMWARE \
+		LOADER_ARGS="-transfer pipeline" $pin sh bench/run_bench.sh || status=1
+done
+
+exit $status
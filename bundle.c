@@ -0,0 +1,369 @@
+/* Firmware bundles for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "gobi_loader pack firmware_dir file" turns a firmware directory into a
+ * single bundle file:
+ *
+ *   struct bundle_header   magic, variant, and for every image its offset,
+ *                          size and the encoded open command and raw header
+ *                          with their CRCs; the hello and reset frames
+ *   image data             one image per BUNDLE_ALIGN boundary, already
+ *                          trimmed to the bytes the device gets; compressed
+ *                          images are copied as they are and unpacked
+ *                          while loading
+ *
+ * Loading a bundle is one open and one header read. The frames go to the
+ * device as they are and the image ranges can be handed straight to
+ * sendfile or mmap. A firmware directory is loaded through the same
+ * header, built in memory by bundle_build() with every image at offset 0
+ * of its own file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+#include "fwcache.h"
+#include "unpack.h"
+#include "variant.h"
+
+/* little endian <-> host, the same operation both ways */
+static void bundle_swap(struct bundle_header *h)
+{
+	unsigned i;
+
+	h->version = SWAPL32(h->version);
+	h->variant = SWAPL32(h->variant);
+	h->nimages = SWAPL32(h->nimages);
+	for (i = 0; i < QDL_MAX_IMAGES; i++) {
+		h->img[i].offset = SWAPL64(h->img[i].offset);
+		h->img[i].size = SWAPL64(h->img[i].size);
+		h->img[i].stored = SWAPL64(h->img[i].stored);
+	}
+}
+
+/* version 1, from before images could be stored compressed */
+struct bundle_image_v1 {
+	uint64_t offset;
+	uint64_t size;
+	char name[16];
+	uint8_t open_len;
+	uint8_t open[HDLC_ENCODED_MAX(13)];
+	uint8_t header[QDL_HEADER_LEN];
+} __attribute__((packed));
+
+struct bundle_header_v1 {
+	char magic[8];
+	uint32_t version;
+	uint32_t variant;
+	uint32_t nimages;
+	uint8_t hello_len;
+	uint8_t reset_len;
+	uint8_t hello[HDLC_ENCODED_MAX(36)];
+	uint8_t reset[HDLC_ENCODED_MAX(1)];
+	struct bundle_image_v1 img[QDL_MAX_IMAGES];
+} __attribute__((packed));
+
+/* read a version 1 header into h as version 2, with every image raw */
+static int bundle_read_v1(int fd, struct bundle_header *h)
+{
+	struct bundle_header_v1 old;
+	struct bundle_image *img;
+	unsigned i;
+
+	if (pread(fd, &old, sizeof(old), 0) != sizeof(old))
+		return -1;
+	memset(h, 0, sizeof(*h));
+	memcpy(h, &old, offsetof(struct bundle_header_v1, img));
+	h->version = SWAPL32(BUNDLE_VERSION);
+	for (i = 0; i < QDL_MAX_IMAGES; i++) {
+		img = &h->img[i];
+		img->offset = old.img[i].offset;
+		img->size = img->stored = old.img[i].size;
+		img->codec = UNPACK_RAW;
+		memcpy(img->name, old.img[i].name, sizeof(img->name));
+		img->open_len = old.img[i].open_len;
+		memcpy(img->open, old.img[i].open, sizeof(img->open));
+		memcpy(img->header, old.img[i].header, sizeof(img->header));
+	}
+	return 0;
+}
+
+static void close_fds(int fds[QDL_MAX_IMAGES], int n)
+{
+	while (n--)
+		close(fds[n]);
+}
+
+/**
+ *	bundle_open_image - open the image of a stage in a firmware directory
+ *	@fwdir: firmware directory
+ *	@stage: stage whose image is wanted
+ *	@name: set to the file name that was found
+ *	@len: size of name
+ *
+ *	Tries each name the stage lists, plain and then compressed, through
+ *	the firmware cache. Returns the open image, or -1 with errno set.
+ */
+int bundle_open_image(const char *fwdir, const struct qdl_stage *stage,
+		      char *name, size_t len)
+{
+	const char *const *n, **suffix;
+	int fd = -1;
+
+	errno = ENOENT;
+	for (n = stage->names; *n; n++)
+		for (suffix = unpack_suffixes; *suffix; suffix++) {
+			snprintf(name, len, "%s%s", *n, *suffix);
+			fd = fwcache_open(fwdir, name);
+			if (fd != -1 || errno != ENOENT)
+				return fd;
+		}
+	return -1;
+}
+
+/**
+ *	bundle_build - prepare a firmware directory for loading
+ *	@fwdir: directory holding the images of the variant
+ *	@variant: index into qdl_variants[]
+ *	@h: header to fill in, in host byte order, image offsets 0
+ *	@fds: set to the open images
+ *
+ *	Images are opened with bundle_open_image(); the size of a compressed
+ *	one comes from its container. Returns 0, or -1 with errno set after
+ *	printing which image is missing, truncated or unreadable.
+ */
+int bundle_build(const char *fwdir, int variant, struct bundle_header *h,
+		 int fds[QDL_MAX_IMAGES])
+{
+	const struct qdl_variant *v = &qdl_variants[variant];
+	const struct qdl_stage *stage;
+	struct bundle_image *img;
+	struct stat st;
+	uint64_t size = 0;
+	int i, codec, err;
+
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, BUNDLE_MAGIC, sizeof(h->magic));
+	h->version = BUNDLE_VERSION;
+	h->variant = variant;
+	h->nimages = v->nstages;
+
+	for (i = 0; i < h->nimages; i++) {
+		stage = &v->stages[i];
+		img = &h->img[i];
+		fds[i] = bundle_open_image(fwdir, stage, img->name,
+					   sizeof(img->name));
+		codec = -1;
+		if (fds[i] != -1 && !fstat(fds[i], &st))
+			codec = unpack_detect(fds[i], 0, st.st_size, &size);
+		if (codec < 0 || size < stage->trim || size > UINT32_MAX) {
+			err = codec < 0 ? errno : EINVAL;
+			fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n", fwdir,
+				fds[i] == -1 ? stage->names[0] : img->name,
+				err == EINVAL ? "truncated or damaged" :
+				strerror(err));
+			close_fds(fds, fds[i] == -1 ? i : i + 1);
+			errno = err;
+			return -1;
+		}
+		img->codec = codec;
+		img->stored = st.st_size;
+		img->size = size - stage->trim;
+		img->open_len = qdl_open_request(img->open, sizeof(img->open),
+						 stage->type, img->size);
+		qdl_image_header(img->header, sizeof(img->header), img->size);
+	}
+
+	h->hello_len = v->hello_len;
+	memcpy(h->hello, v->hello, v->hello_len);
+	h->reset_len = QDL_RESET_LEN;
+	memcpy(h->reset, qdl_reset_frame, QDL_RESET_LEN);
+	return 0;
+}
+
+/* write the image behind a recipe at img->offset of fd, as a plain one */
+static int copy_unpacked(int fd, int srcfd, struct bundle_image *img)
+{
+	struct unpack *z;
+	char buf[64 * 1024];
+	off_t off = 0;
+	ssize_t n = 0;
+
+	z = unpack_open(srcfd, 0, img->stored, img->codec);
+	if (!z)
+		return -1;
+	while (off < img->size) {
+		n = unpack_pread(z, buf, sizeof(buf) < img->size - off ?
+				 sizeof(buf) : img->size - off, off);
+		if (n <= 0 || pwrite(fd, buf, n, img->offset + off) != n)
+			break;
+		off += n;
+	}
+	unpack_close(z);
+	if (off < img->size) {
+		if (!n)
+			errno = EIO;
+		return -1;
+	}
+	img->codec = UNPACK_RAW;
+	img->stored = img->size;
+	return 0;
+}
+
+/**
+ *	bundle_pack - write a firmware directory out as a bundle
+ *	@fwdir: firmware directory
+ *	@variant: variant the bundle is for
+ *	@path: bundle file, replaced atomically
+ *
+ *	Returns 0, or -1 with errno set.
+ */
+int bundle_pack(const char *fwdir, int variant, const char *path)
+{
+	struct bundle_header h;
+	int fds[QDL_MAX_IMAGES];
+	char tmp[PATH_MAX];
+	uint64_t pos = BUNDLE_ALIGN;
+	off_t off;
+	ssize_t n;
+	int i, fd, n_images, err = 0;
+
+	if (bundle_build(fwdir, variant, &h, fds))
+		return -1;
+	n_images = h.nimages;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		close_fds(fds, n_images);
+		return -1;
+	}
+
+	for (i = 0; i < n_images && !err; i++) {
+		/*
+		 * a plain image loses its trailer, a compressed one is kept;
+		 * one from the store is put together, the bundle stands alone
+		 */
+		if (h.img[i].codec == UNPACK_CHUNKS) {
+			h.img[i].offset = pos;
+			pos += (h.img[i].size + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+			if (copy_unpacked(fd, fds[i], &h.img[i]))
+				err = errno;
+			continue;
+		}
+		if (h.img[i].codec == UNPACK_RAW)
+			h.img[i].stored = h.img[i].size;
+		h.img[i].offset = pos;
+		pos += (h.img[i].stored + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+
+		if (lseek(fd, h.img[i].offset, SEEK_SET) == -1) {
+			err = errno;
+			break;
+		}
+		off = 0;
+		while (off < h.img[i].stored) {
+			n = sendfile(fd, fds[i], &off, h.img[i].stored - off);
+			if (n <= 0) {
+				err = n ? errno : EIO;	/* image shrank */
+				break;
+			}
+		}
+	}
+	close_fds(fds, n_images);
+
+	bundle_swap(&h);
+	if (!err && (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+		     ftruncate(fd, pos) || fchmod(fd, 0644) || fsync(fd)))
+		err = errno;
+	if (close(fd) && !err)
+		err = errno;
+	if (!err && rename(tmp, path))
+		err = errno;
+	if (err) {
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ *	bundle_open - open a bundle and read its header
+ *	@path: bundle file
+ *	@h: filled in, in host byte order
+ *
+ *	Version 1 bundles are read as well, as holding raw images only.
+ *	Returns the open bundle, or -1 with errno set; EINVAL if the file is
+ *	not a bundle this loader understands.
+ */
+int bundle_open(const char *path, struct bundle_header *h)
+{
+	struct bundle_image *img;
+	struct stat st;
+	ssize_t n;
+	int fd;
+	unsigned i;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st))
+		goto invalid;
+	n = pread(fd, h, sizeof(*h), 0);
+	if (n < (ssize_t)offsetof(struct bundle_header, img))
+		goto invalid;
+	if (SWAPL32(h->version) == 1) {
+		if (bundle_read_v1(fd, h))
+			goto invalid;
+	} else if (n != sizeof(*h)) {
+		goto invalid;
+	}
+	bundle_swap(h);
+
+	if (memcmp(h->magic, BUNDLE_MAGIC, sizeof(h->magic)) ||
+	    h->version != BUNDLE_VERSION || h->variant >= QDL_VARIANTS ||
+	    h->nimages != qdl_variants[h->variant].nstages ||
+	    h->hello_len > sizeof(h->hello) || h->reset_len > sizeof(h->reset))
+		goto invalid;
+
+	for (i = 0; i < h->nimages; i++) {
+		img = &h->img[i];
+		if (img->open_len > sizeof(img->open) ||
+		    img->offset % BUNDLE_ALIGN || img->size > UINT32_MAX ||
+		    img->codec >= UNPACK_CODECS || img->codec == UNPACK_CHUNKS ||
+		    (img->codec == UNPACK_RAW && img->stored != img->size) ||
+		    img->stored > (uint64_t)st.st_size ||
+		    img->offset > (uint64_t)st.st_size - img->stored)
+			goto invalid;
+		img->name[sizeof(img->name) - 1] = '\0';
+	}
+	return fd;
+
+invalid:
+	close(fd);
+	errno = EINVAL;
+	return -1;
+}
@@ -0,0 +1,47 @@
+/* Single file firmware bundles with pre-encoded QDL command frames */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+
+#include "gobi_loader.h"
+#include "hdlc.h"
+#include "variant.h"
+
+#define BUNDLE_MAGIC	"GOBIQDL\n"
+#define BUNDLE_VERSION	2
+#define BUNDLE_ALIGN	4096	/* image data starts on a page boundary */
+
+/* on disk all integers are little endian; bundle_open() converts them */
+struct bundle_image {
+	uint64_t offset;	/* image data in the bundle, 0 for a directory */
+	uint64_t size;		/* bytes sent to the device */
+	uint64_t stored;	/* bytes at offset, compressed or not */
+	uint8_t codec;		/* UNPACK_*, how the bytes at offset are stored */
+	char name[16];
+	uint8_t open_len;
+	uint8_t open[HDLC_ENCODED_MAX(13)];
+	uint8_t header[QDL_HEADER_LEN];
+} __attribute__((packed));
+
+struct bundle_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t variant;	/* index into qdl_variants[] */
+	uint32_t nimages;
+	uint8_t hello_len;
+	uint8_t reset_len;
+	uint8_t hello[HDLC_ENCODED_MAX(36)];
+	uint8_t reset[HDLC_ENCODED_MAX(1)];
+	struct bundle_image img[QDL_MAX_IMAGES];
+} __attribute__((packed));
+
+int bundle_open_image(const char *fwdir, const struct qdl_stage *stage,
+		      char *name, size_t len);
+int bundle_build(const char *fwdir, int variant, struct bundle_header *h,
+		 int fds[QDL_MAX_IMAGES]);
+int bundle_pack(const char *fwdir, int variant, const char *path);
+int bundle_open(const char *path, struct bundle_header *h);
+
+#endif
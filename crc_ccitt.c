@@ -0,0 +1,393 @@
+/* CRC-CCITT engines for gobi_loader */
+
+/* crc-ccitt code derived from the Linux kernel, lib/crc-ccitt.c
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "crc_ccitt.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_CLMUL_X86
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES))
+#define HAVE_CLMUL_ARM
+#include <arm_neon.h>
+#endif
+
+/*
+ * This mysterious table is just the CRC of each possible byte. It can be
+ * computed using the standard bit-at-a-time methods. The polynomial can
+ * be seen in entry 128, 0x8408. This corresponds to x^0 + x^5 + x^12.
+ * Add the implicit x^16, and you have the standard CRC-CCITT.
+ */
+
+uint16_t const crc_ccitt_table[256] = {
+	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+/* crc_ccitt_table[] advanced by 1..7 further zero bytes, for slice-by-8 */
+static uint16_t crc_ccitt_slice[7][256];
+
+/* fold constants for the carry-less multiply kernel, see crc_ccitt_clmul() */
+static uint64_t k_fold128[2], k_fold512[2];
+static int have_clmul;
+
+static uint16_t (*crc_ccitt_impl)(uint16_t, const void *, size_t) = crc_ccitt_slice8;
+
+uint16_t crc_ccitt_byte(uint16_t crc, const char c)
+{
+        return (crc >> 8) ^ crc_ccitt_table[(crc ^ c) & 0xff];
+}
+
+/**
+ *	crc_ccitt_bytewise - recompute the CRC one byte at a time
+ *	@crc: previous CRC value
+ *	@buffer: data pointer
+ *	@len: number of bytes in the buffer
+ */
+uint16_t crc_ccitt_bytewise(uint16_t crc, const void *buffer, size_t len)
+{
+	const uint8_t *p = buffer;
+
+	while (len--)
+		crc = (crc >> 8) ^ crc_ccitt_table[(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+/**
+ *	crc_ccitt_slice8 - recompute the CRC eight bytes at a time
+ *	@crc: previous CRC value
+ *	@buffer: data pointer
+ *	@len: number of bytes in the buffer
+ *
+ *	Portable table driven variant; one lookup per byte but no serial
+ *	dependency between the lookups of a block.
+ */
+uint16_t crc_ccitt_slice8(uint16_t crc, const void *buffer, size_t len)
+{
+	const uint8_t *p = buffer;
+
+	while (len >= 8) {
+		crc = crc_ccitt_slice[6][(crc ^ p[0]) & 0xff] ^
+			crc_ccitt_slice[5][(crc >> 8) ^ p[1]] ^
+			crc_ccitt_slice[4][p[2]] ^
+			crc_ccitt_slice[3][p[3]] ^
+			crc_ccitt_slice[2][p[4]] ^
+			crc_ccitt_slice[1][p[5]] ^
+			crc_ccitt_slice[0][p[6]] ^
+			crc_ccitt_table[p[7]];
+		p += 8;
+		len -= 8;
+	}
+	return crc_ccitt_bytewise(crc, p, len);
+}
+
+/*
+ * Carry-less multiply kernel.
+ *
+ * The CRC of a message only depends on the message modulo P(x), so a
+ * 16 byte block A followed by data B at distance D bits can be replaced by
+ * (A * x^D mod P) xor B. A is split into the 64-bit halves that a single
+ * CLMUL/PMULL takes; with the bit-reflected layout the low (earlier) half
+ * carries x^(D+64) and the high half x^D. The constants are x^(n-1) mod P,
+ * the missing x coming from the one bit shift that reflected products
+ * pick up. After folding, the remaining 16 bytes go through the table.
+ *
+ * The caller's CRC is folded in by xoring it into the first two bytes,
+ * which is equivalent for a CRC without final xor.
+ */
+
+/* x^n mod P, normal (non reflected) bit order */
+static uint16_t xpow_mod(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x11021;
+	}
+	return r;
+}
+
+static uint16_t rev16(uint16_t x)
+{
+	uint16_t r = 0;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if (x & (1 << i))
+			r |= 1 << (15 - i);
+	return r;
+}
+
+static uint64_t fold_constant(unsigned int n)
+{
+	return (uint64_t)rev16(xpow_mod(n - 1)) << 48;
+}
+
+#if defined(HAVE_CLMUL_X86)
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i x, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+			     _mm_clmulepi64_si128(x, k, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t crc_ccitt_clmul_x86(uint16_t crc, const uint8_t *p, size_t len)
+{
+	__m128i k128 = _mm_set_epi64x(k_fold128[1], k_fold128[0]);
+	__m128i k512 = _mm_set_epi64x(k_fold512[1], k_fold512[0]);
+	__m128i x0, x1, x2, x3;
+	uint8_t tmp[16];
+
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p),
+			   _mm_cvtsi32_si128(crc));
+	p += 16;
+	len -= 16;
+
+	if (len >= 64) {
+		x1 = _mm_loadu_si128((const __m128i *)p);
+		x2 = _mm_loadu_si128((const __m128i *)(p + 16));
+		x3 = _mm_loadu_si128((const __m128i *)(p + 32));
+		p += 48;
+		len -= 48;
+		while (len >= 64) {
+			x0 = _mm_xor_si128(fold(x0, k512),
+					   _mm_loadu_si128((const __m128i *)p));
+			x1 = _mm_xor_si128(fold(x1, k512),
+					   _mm_loadu_si128((const __m128i *)(p + 16)));
+			x2 = _mm_xor_si128(fold(x2, k512),
+					   _mm_loadu_si128((const __m128i *)(p + 32)));
+			x3 = _mm_xor_si128(fold(x3, k512),
+					   _mm_loadu_si128((const __m128i *)(p + 48)));
+			p += 64;
+			len -= 64;
+		}
+		x1 = _mm_xor_si128(x1, fold(x0, k128));
+		x2 = _mm_xor_si128(x2, fold(x1, k128));
+		x0 = _mm_xor_si128(x3, fold(x2, k128));
+	}
+
+	while (len >= 16) {
+		x0 = _mm_xor_si128(fold(x0, k128),
+				   _mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)tmp, x0);
+	crc = crc_ccitt_slice8(0, tmp, 16);
+	return crc_ccitt_slice8(crc, p, len);
+}
+
+#elif defined(HAVE_CLMUL_ARM)
+
+static inline uint64x2_t fold(uint64x2_t x, const uint64_t *k)
+{
+	poly128_t lo = vmull_p64(vgetq_lane_u64(x, 0), k[0]);
+	poly128_t hi = vmull_p64(vgetq_lane_u64(x, 1), k[1]);
+
+	return veorq_u64(vreinterpretq_u64_p128(lo), vreinterpretq_u64_p128(hi));
+}
+
+static uint16_t crc_ccitt_clmul_arm(uint16_t crc, const uint8_t *p, size_t len)
+{
+	uint64x2_t x0, x1, x2, x3;
+	uint8_t tmp[16];
+
+	x0 = veorq_u64(vld1q_u64((const uint64_t *)p),
+		       vsetq_lane_u64(crc, vdupq_n_u64(0), 0));
+	p += 16;
+	len -= 16;
+
+	if (len >= 64) {
+		x1 = vld1q_u64((const uint64_t *)p);
+		x2 = vld1q_u64((const uint64_t *)(p + 16));
+		x3 = vld1q_u64((const uint64_t *)(p + 32));
+		p += 48;
+		len -= 48;
+		while (len >= 64) {
+			x0 = veorq_u64(fold(x0, k_fold512),
+				       vld1q_u64((const uint64_t *)p));
+			x1 = veorq_u64(fold(x1, k_fold512),
+				       vld1q_u64((const uint64_t *)(p + 16)));
+			x2 = veorq_u64(fold(x2, k_fold512),
+				       vld1q_u64((const uint64_t *)(p + 32)));
+			x3 = veorq_u64(fold(x3, k_fold512),
+				       vld1q_u64((const uint64_t *)(p + 48)));
+			p += 64;
+			len -= 64;
+		}
+		x1 = veorq_u64(x1, fold(x0, k_fold128));
+		x2 = veorq_u64(x2, fold(x1, k_fold128));
+		x0 = veorq_u64(x3, fold(x2, k_fold128));
+	}
+
+	while (len >= 16) {
+		x0 = veorq_u64(fold(x0, k_fold128),
+			       vld1q_u64((const uint64_t *)p));
+		p += 16;
+		len -= 16;
+	}
+
+	vst1q_u64((uint64_t *)tmp, x0);
+	crc = crc_ccitt_slice8(0, tmp, 16);
+	return crc_ccitt_slice8(crc, p, len);
+}
+
+#endif
+
+/**
+ *	crc_ccitt_clmul - recompute the CRC with carry-less multiplication
+ *	@crc: previous CRC value
+ *	@buffer: data pointer
+ *	@len: number of bytes in the buffer
+ *
+ *	Uses PCLMULQDQ or PMULL where the CPU has it and falls back to
+ *	crc_ccitt_slice8() otherwise, and for buffers too short to fold.
+ */
+uint16_t crc_ccitt_clmul(uint16_t crc, const void *buffer, size_t len)
+{
+	if (len < 32 || !have_clmul)
+		return crc_ccitt_slice8(crc, buffer, len);
+#if defined(HAVE_CLMUL_X86)
+	return crc_ccitt_clmul_x86(crc, buffer, len);
+#elif defined(HAVE_CLMUL_ARM)
+	return crc_ccitt_clmul_arm(crc, buffer, len);
+#else
+	return crc_ccitt_slice8(crc, buffer, len);
+#endif
+}
+
+int crc_ccitt_have_clmul(void)
+{
+	return have_clmul;
+}
+
+/**
+ *	crc_ccitt - recompute the CRC for the data buffer
+ *	@crc: previous CRC value
+ *	@buffer: data pointer
+ *	@len: number of bytes in the buffer
+ */
+uint16_t crc_ccitt(uint16_t crc, const void *buffer, size_t len)
+{
+	return crc_ccitt_impl(crc, buffer, len);
+}
+
+/* a * b mod P, normal bit order */
+static uint16_t mul_mod(uint16_t a, uint16_t b)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 15; i >= 0; i--) {
+		r <<= 1;
+		if (r & 0x10000)
+			r ^= 0x11021;
+		if (b & (1 << i))
+			r ^= a;
+	}
+	return r;
+}
+
+/**
+ *	crc_ccitt_combine - CRC of two concatenated buffers
+ *	@crc1: CRC of the first buffer, with whatever seed the caller uses
+ *	@crc2: CRC of the second buffer, computed with a seed of 0
+ *	@len2: length of the second buffer
+ *
+ *	Lets independently checksummed chunks be merged in O(log len2):
+ *	crc_ccitt(s, A ++ B) == crc_ccitt_combine(crc_ccitt(s, A),
+ *	crc_ccitt(0, B), len(B)).
+ */
+uint16_t crc_ccitt_combine(uint16_t crc1, uint16_t crc2, size_t len2)
+{
+	/* crc1 advanced over len2 zero bytes is crc1 * x^(8 * len2) mod P */
+	uint16_t r = rev16(crc1), sq = 0x0100;	/* x^8 */
+
+	while (len2) {
+		if (len2 & 1)
+			r = mul_mod(r, sq);
+		sq = mul_mod(sq, sq);
+		len2 >>= 1;
+	}
+	return rev16(r) ^ crc2;
+}
+
+__attribute__((constructor))
+static void crc_ccitt_init(void)
+{
+	uint16_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc_ccitt_table[i];
+		for (k = 0; k < 7; k++) {
+			crc = (crc >> 8) ^ crc_ccitt_table[crc & 0xff];
+			crc_ccitt_slice[k][i] = crc;
+		}
+	}
+
+	k_fold128[0] = fold_constant(128 + 64);
+	k_fold128[1] = fold_constant(128);
+	k_fold512[0] = fold_constant(512 + 64);
+	k_fold512[1] = fold_constant(512);
+
+#if defined(HAVE_CLMUL_X86)
+	__builtin_cpu_init();
+	have_clmul = __builtin_cpu_supports("pclmul");
+#elif defined(HAVE_CLMUL_ARM)
+	have_clmul = 1;
+#endif
+	if (have_clmul)
+		crc_ccitt_impl = crc_ccitt_clmul;
+}
@@ -0,0 +1,24 @@
+/* CRC-CCITT (reflected, polynomial 0x8408) as used by the QDL protocol */
+
+#ifndef CRC_CCITT_H
+#define CRC_CCITT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern uint16_t const crc_ccitt_table[256];
+
+uint16_t crc_ccitt_byte(uint16_t crc, const char c);
+
+/* Best implementation for this CPU; all variants give identical results */
+uint16_t crc_ccitt(uint16_t crc, const void *buffer, size_t len);
+
+/* Individual engines, exposed for benchmarking */
+uint16_t crc_ccitt_bytewise(uint16_t crc, const void *buffer, size_t len);
+uint16_t crc_ccitt_slice8(uint16_t crc, const void *buffer, size_t len);
+uint16_t crc_ccitt_clmul(uint16_t crc, const void *buffer, size_t len);
+int crc_ccitt_have_clmul(void);
+
+uint16_t crc_ccitt_combine(uint16_t crc1, uint16_t crc2, size_t len2);
+
+#endif
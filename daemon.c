@@ -0,0 +1,1039 @@
+/* Multi-device firmware loading daemon for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "gobi_loader -daemon" keeps running and accepts load requests on a unix
+ * socket ("gobi_loader -submit ..." sends one and waits for the result).
+ * Every serial device gets its own session with private protocol state,
+ * and all sessions are driven by one epoll loop, so several cards load in
+ * parallel. Firmware directories are mapped once into a shared fw_set,
+ * together with the encoded command frames, and reused for every session
+ * that asks for the same directory and variant until the files change.
+ * A bundle from "pack" is mapped image by image and its frames are taken
+ * as they are. Compressed images are unpacked once into anonymous memory
+ * when the set is mapped, so sessions never decode.
+ *
+ * A failed step is retried like the command line loader does (see
+ * qdl_retry()): after RETRY_BACKOFF ms, doubling, with the same -retries
+ * and -restarts. Output still queued is dropped and the image is sent
+ * again from its open request, since how much of it the device took is
+ * not known; once the retries are used up the whole load starts over
+ * with a hello. A device that hangs up is not retried. Sessions write
+ * the tty directly, without the transports, metrics, traces or tuned
+ * settings of the command line path.
+ *
+ * With -uevent the daemon doesn't wait for udev either: it reads the
+ * kernel's device events from a NETLINK_KOBJECT_UEVENT socket and starts
+ * a session for every ttyUSB that appears with an id from the device
+ * database. Devices already present at startup, or announced while the
+ * socket buffer overflowed, are found by a scan of /sys/class/tty.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+
+#include "gobi_loader.h"
+#include "fwcache.h"
+#include "hdlc.h"
+#include "bundle.h"
+#include "variant.h"
+#include "unpack.h"
+#include "devdb.h"
+#include "tune.h"
+#include "verify.h"
+
+#define MAX_EVENTS	16
+#define MAX_REQUEST	(2 * PATH_MAX + 16)
+#define UEVENT_BUF	8192		/* one event, the kernel's limit is 2048 */
+#define UEVENT_RCVBUF	(1024 * 1024)	/* room for a burst at boot */
+
+struct fw_image {
+	char name[16];
+	char *map;
+	size_t maplen;
+	size_t len;		/* bytes sent to the device */
+	struct stat st;		/* identity at load time, for revalidation */
+	uint8_t open[HDLC_ENCODED_MAX(13)];
+	size_t open_len;
+	uint8_t header[QDL_HEADER_LEN];
+};
+
+struct fw_set {
+	struct fw_set *next;
+	char dir[PATH_MAX];
+	int variant;
+	const struct qdl_variant *v;
+	int bundle;		/* dir is a bundle file */
+	int nimages;
+	int refs;
+	struct fw_image img[QDL_MAX_IMAGES];
+	uint8_t hello[HDLC_ENCODED_MAX(36)];
+	size_t hello_len;
+	uint8_t reset[HDLC_ENCODED_MAX(1)];
+	size_t reset_len;
+};
+
+#define W_LISTEN	0
+#define W_CLIENT	1
+#define W_SERIAL	2
+#define W_UEVENT	3
+
+struct watch {
+	int type;
+	int fd;
+};
+
+struct session {
+	struct watch w;		/* must stay first, epoll hands us this */
+	struct session *next;
+	int client;		/* -1 for sessions started by a uevent */
+	char dev[PATH_MAX];
+	struct fw_set *fw;
+	int step;		/* hello, then open/stream per image, then reset */
+	const uint8_t *out[2];
+	size_t outlen[2];
+	char expect;		/* response code being waited for, 0 if none */
+	long long deadline;
+	struct hdlc_decoder dec;
+	uint8_t frame[64];
+	long long t_start;
+	int attempt;		/* retries of the current stage */
+	int backoff;		/* ms before the next one */
+	int restart;		/* full loads started over */
+	long long resume;	/* end of the backoff, 0 if none */
+};
+
+static int epfd;
+static struct fw_set *fw_sets;
+static struct session *sessions;
+static const char *fwroot;	/* firmware sets of uevent sessions */
+
+static void fw_set_unlink(struct fw_set *fw)
+{
+	struct fw_set **p;
+
+	for (p = &fw_sets; *p; p = &(*p)->next)
+		if (*p == fw) {
+			*p = fw->next;
+			break;
+		}
+}
+
+static void fw_set_put(struct fw_set *fw)
+{
+	int i;
+
+	if (--fw->refs)
+		return;
+
+	fw_set_unlink(fw);
+	for (i = 0; i < fw->nimages; i++)
+		munmap(fw->img[i].map, fw->img[i].maplen);
+	free(fw);
+}
+
+static int open_image(const char *dir, const struct qdl_stage *stage,
+		      struct stat *st, char *name, size_t len)
+{
+	int fd;
+
+	fd = bundle_open_image(dir, stage, name, len);
+	if (fd != -1 && fstat(fd, st)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/*
+ * true if every image still is the file that was mapped; with the image
+ * cache enabled that is the cache blob, which changes with the original
+ */
+static int fw_set_valid(struct fw_set *fw)
+{
+	struct stat st;
+	char name[16];
+	int i, fd;
+
+	for (i = 0; i < fw->nimages; i++) {
+		if (fw->bundle) {
+			if (stat(fw->dir, &st))
+				return 0;
+		} else {
+			fd = open_image(fw->dir, &fw->v->stages[i], &st, name,
+					sizeof(name));
+			if (fd == -1)
+				return 0;
+			close(fd);
+		}
+		if (st.st_dev != fw->img[i].st.st_dev ||
+		    st.st_ino != fw->img[i].st.st_ino ||
+		    st.st_size != fw->img[i].st.st_size ||
+		    st.st_mtime != fw->img[i].st.st_mtime)
+			return 0;
+	}
+	return 1;
+}
+
+/* unpack a compressed image into memory of its own, read-only after */
+static int fw_image_unpack(struct fw_image *img, int fd, off_t base,
+			   uint64_t stored, int codec, uint64_t size)
+{
+	struct unpack *z;
+	off_t off = 0;
+	ssize_t n = 0;
+
+	img->maplen = size;
+	img->map = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (img->map == MAP_FAILED) {
+		img->map = NULL;
+		return -1;
+	}
+	z = unpack_open(fd, base, stored, codec);
+	if (!z)
+		return -1;
+	while (off < size) {
+		n = unpack_pread(z, img->map + off, size - off, off);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	unpack_close(z);
+	if (off < size) {
+		if (!n)
+			errno = EBADMSG;	/* shorter than its header said */
+		return -1;
+	}
+	mprotect(img->map, img->maplen ? img->maplen : 1, PROT_READ);
+	return 0;
+}
+
+/* the image of a directory with a manifest has to match it */
+static int fw_image_check(struct fw_set *fw, int i)
+{
+	uint8_t want[SHA256_DIGEST_LEN], digest[SHA256_DIGEST_LEN];
+	struct sha256 c;
+	int ret;
+
+	ret = verify_lookup(fw->dir, &fw->v->stages[i], want);
+	if (ret <= 0)
+		return ret;
+	sha256_init(&c);
+	sha256_update(&c, fw->img[i].map,
+		      fw->img[i].len + fw->v->stages[i].trim);
+	sha256_final(&c, digest);
+	if (memcmp(digest, want, sizeof(digest))) {
+		fprintf(stderr, "[QDL ERROR]: %s/%s: does not match %s\n",
+			fw->dir, fw->img[i].name, VERIFY_MANIFEST);
+		return -1;
+	}
+	return 0;
+}
+
+static int fw_set_map_dir(struct fw_set *fw)
+{
+	const struct qdl_stage *stage;
+	struct fw_image *img;
+	uint64_t size = 0;
+	int i, fd, codec;
+
+	for (i = 0; i < fw->nimages; i++) {
+		stage = &fw->v->stages[i];
+		img = &fw->img[i];
+		fd = open_image(fw->dir, stage, &img->st, img->name,
+				sizeof(img->name));
+		codec = fd == -1 ? -1 :
+			unpack_detect(fd, 0, img->st.st_size, &size);
+		if (codec < 0 || size < stage->trim) {
+			fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n", fw->dir,
+				fd == -1 ? stage->names[0] : img->name,
+				codec < 0 ? strerror(errno) : "truncated");
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		img->len = size - stage->trim;
+		if (codec != UNPACK_RAW) {
+			if (fw_image_unpack(img, fd, 0, img->st.st_size, codec,
+					    size)) {
+				fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n",
+					fw->dir, img->name, strerror(errno));
+				close(fd);
+				return -1;
+			}
+			close(fd);
+		} else {
+			img->maplen = img->st.st_size;
+			img->map = mmap(NULL, img->maplen ? img->maplen : 1,
+					PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (img->map == MAP_FAILED) {
+				img->map = NULL;
+				fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n",
+					fw->dir, img->name, strerror(errno));
+				return -1;
+			}
+			madvise(img->map, img->maplen, MADV_WILLNEED);
+		}
+		if (fw_image_check(fw, i))
+			return -1;
+		img->open_len = qdl_open_request(img->open, sizeof(img->open),
+						 stage->type, img->len);
+		qdl_image_header(img->header, sizeof(img->header), img->len);
+	}
+
+	fw->hello_len = fw->v->hello_len;
+	memcpy(fw->hello, fw->v->hello, fw->hello_len);
+	fw->reset_len = QDL_RESET_LEN;
+	memcpy(fw->reset, qdl_reset_frame, QDL_RESET_LEN);
+	return 0;
+}
+
+/* images sit page aligned in the bundle, so each gets its own mapping */
+static int fw_set_map_bundle(struct fw_set *fw)
+{
+	struct bundle_header h;
+	struct fw_image *img;
+	struct stat st;
+	int i, fd;
+
+	fd = bundle_open(fw->dir, &h);
+	if (fd == -1 || fstat(fd, &st)) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", fw->dir, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if (h.variant != fw->variant) {
+		fprintf(stderr, "[QDL ERROR]: %s: packed for %s\n", fw->dir,
+			qdl_variants[h.variant].name);
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < fw->nimages; i++) {
+		img = &fw->img[i];
+		memcpy(img->name, h.img[i].name, sizeof(img->name));
+		img->st = st;
+		img->len = h.img[i].size;
+		if (h.img[i].codec != UNPACK_RAW) {
+			/* the container holds the untrimmed image */
+			if (fw_image_unpack(img, fd, h.img[i].offset,
+					    h.img[i].stored, h.img[i].codec,
+					    img->len + fw->v->stages[i].trim)) {
+				fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n",
+					fw->dir, img->name, strerror(errno));
+				close(fd);
+				return -1;
+			}
+		} else {
+			img->maplen = img->len;
+			img->map = mmap(NULL, img->maplen ? img->maplen : 1,
+					PROT_READ, MAP_SHARED, fd,
+					h.img[i].offset);
+			if (img->map == MAP_FAILED) {
+				img->map = NULL;
+				fprintf(stderr, "[QDL ERROR]: %s: %s\n",
+					fw->dir, strerror(errno));
+				close(fd);
+				return -1;
+			}
+			madvise(img->map, img->maplen, MADV_WILLNEED);
+		}
+		img->open_len = h.img[i].open_len;
+		memcpy(img->open, h.img[i].open, img->open_len);
+		memcpy(img->header, h.img[i].header, sizeof(img->header));
+	}
+	close(fd);
+
+	fw->hello_len = h.hello_len;
+	memcpy(fw->hello, h.hello, fw->hello_len);
+	fw->reset_len = h.reset_len;
+	memcpy(fw->reset, h.reset, fw->reset_len);
+	return 0;
+}
+
+static struct fw_set *fw_set_get(const char *dir, int variant)
+{
+	struct fw_set *fw, *next;
+	struct stat st;
+	int i;
+
+	for (fw = fw_sets; fw; fw = next) {
+		next = fw->next;
+		if (fw->variant != variant || strcmp(fw->dir, dir))
+			continue;
+		if (fw_set_valid(fw)) {
+			fw->refs++;
+			return fw;
+		}
+		/* stale: drop the cache's reference, sessions keep theirs */
+		fw_set_unlink(fw);
+		fw_set_put(fw);
+	}
+
+	fw = calloc(1, sizeof(*fw));
+	if (!fw)
+		return NULL;
+	snprintf(fw->dir, sizeof(fw->dir), "%s", dir);
+	fw->variant = variant;
+	fw->v = &qdl_variants[variant];
+	fw->nimages = fw->v->nstages;
+	fw->bundle = !stat(dir, &st) && S_ISREG(st.st_mode);
+
+	if (fw->bundle ? fw_set_map_bundle(fw) : fw_set_map_dir(fw))
+		goto fail;
+
+	/* one reference for the cache, one for the caller */
+	fw->refs = 2;
+	fw->next = fw_sets;
+	fw_sets = fw;
+	return fw;
+
+fail:
+	for (i = 0; i < fw->nimages; i++)
+		if (fw->img[i].map)
+			munmap(fw->img[i].map, fw->img[i].maplen);
+	free(fw);
+	return NULL;
+}
+
+static void set_events(int fd, struct watch *w, uint32_t events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = w };
+
+	epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void reply(int client, const char *msg)
+{
+	if (client == -1)
+		return;
+	send(client, msg, strlen(msg) + 1, MSG_NOSIGNAL);
+	close(client);
+}
+
+static void session_end(struct session *s, const char *err)
+{
+	struct session **p;
+
+	if (err)
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", s->dev, err);
+	else
+		printf("%s: QDL success (%.3f s)\n", s->dev,
+		       (monotonic_ms() - s->t_start) / 1000.0);
+	fflush(stdout);
+
+	reply(s->client, err ? err : "ok");
+	epoll_ctl(epfd, EPOLL_CTL_DEL, s->w.fd, NULL);
+	close(s->w.fd);
+	fw_set_put(s->fw);
+
+	for (p = &sessions; *p; p = &(*p)->next)
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	free(s);
+}
+
+/* queue the output of the current step and arm EPOLLOUT */
+static void session_step(struct session *s)
+{
+	struct fw_set *fw = s->fw;
+	struct fw_image *img;
+	int n = s->step - 1;
+
+	s->out[1] = NULL;
+	s->outlen[1] = 0;
+
+	if (s->step == 0) {
+		s->out[0] = fw->hello;
+		s->outlen[0] = fw->hello_len;
+		s->expect = fw->v->hello_ack;
+	} else if (n / 2 < fw->nimages) {
+		img = &fw->img[n / 2];
+		if (n % 2 == 0) {
+			s->out[0] = img->open;
+			s->outlen[0] = img->open_len;
+			s->expect = fw->v->stages[n / 2].open_ack;
+		} else {
+			s->out[0] = img->header;
+			s->outlen[0] = sizeof(img->header);
+			s->out[1] = (uint8_t *)img->map;
+			s->outlen[1] = img->len;
+			s->expect = fw->v->stages[n / 2].done_ack;
+		}
+	} else {
+		s->out[0] = fw->reset;
+		s->outlen[0] = fw->reset_len;
+		s->expect = 0;
+	}
+
+	set_events(s->w.fd, &s->w, EPOLLIN | EPOLLOUT);
+}
+
+/*
+ * A step failed while the device is still there: flush both directions
+ * and, after a pause, send the stage again or start the load over.
+ */
+static void session_fail(struct session *s, const char *err)
+{
+	int n = s->step - 1;
+
+	if (++s->attempt > qdl_retries) {
+		if (s->restart == qdl_restarts) {
+			session_end(s, err);
+			return;
+		}
+		s->restart++;
+		printf("%s: QDL %s, restarting load %d/%d\n", s->dev, err,
+		       s->restart, qdl_restarts);
+		s->step = 0;
+		s->attempt = 0;
+	} else {
+		printf("%s: QDL %s: retry %d/%d in %d ms\n", s->dev, err,
+		       s->attempt, qdl_retries, s->backoff);
+		/* an image goes out again from its open request */
+		if (n >= 0 && n % 2)
+			s->step--;
+	}
+	fflush(stdout);
+
+	tcflush(s->w.fd, TCIOFLUSH);
+	hdlc_decoder_init(&s->dec, s->frame, sizeof(s->frame));
+	s->outlen[0] = s->outlen[1] = 0;
+	s->expect = 0;
+	s->resume = monotonic_ms() + s->backoff;
+	s->backoff *= 2;
+	/* only a hangup wakes the session until then */
+	set_events(s->w.fd, &s->w, 0);
+}
+
+static int step_timeout(struct session *s)
+{
+	if (s->step == 0)
+		return TIMEOUT_HELLO;
+	return (s->step - 1) % 2 ? TIMEOUT_IMAGE : TIMEOUT_OPEN;
+}
+
+static void session_write(struct session *s)
+{
+	ssize_t n;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		while (s->outlen[i]) {
+			n = write(s->w.fd, s->out[i], s->outlen[i]);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					return;
+				session_end(s, strerror(errno));
+				return;
+			}
+			s->out[i] += n;
+			s->outlen[i] -= n;
+		}
+	}
+
+	if (!s->expect) {
+		session_end(s, NULL);
+		return;
+	}
+	s->deadline = monotonic_ms() + step_timeout(s);
+	set_events(s->w.fd, &s->w, EPOLLIN);
+}
+
+static void session_read(struct session *s)
+{
+	uint8_t buf[64];
+	size_t off, used;
+	ssize_t len;
+	int ret, n;
+
+	len = read(s->w.fd, buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (len <= 0) {
+		session_end(s, "Serial device closed");
+		return;
+	}
+	if (s->resume)
+		return;		/* answers to the failed try */
+
+	for (off = 0; off < len; off += used) {
+		ret = hdlc_decode(&s->dec, buf + off, len - off, &used);
+		if (ret == HDLC_MORE)
+			continue;
+		if (ret != HDLC_FRAME) {
+			session_fail(s, ret == HDLC_ERR_CRC ? "Invalid CRC" :
+				     "Invalid Package");
+			return;
+		}
+		/* a reject can come while the image is still going out */
+		if (!s->expect || s->outlen[0] || s->outlen[1] ||
+		    s->frame[0] != (uint8_t)s->expect) {
+			session_fail(s, "Invalid response Code");
+			return;
+		}
+
+		n = s->step - 1;
+		if (n >= 0 && n % 2)
+			printf("%s: QDL %s finish\n", s->dev,
+			       s->fw->img[n / 2].name);
+		/* hello or an image done, the next stage has its own retries */
+		if (n < 0 || n % 2) {
+			s->attempt = 0;
+			s->backoff = RETRY_BACKOFF;
+		}
+		s->step++;
+		session_step(s);
+	}
+}
+
+static void session_start(int client, int variant, const char *dev,
+			  const char *fwdir)
+{
+	struct epoll_event ev;
+	struct termios terminal_data;
+	struct session *s;
+	const char *err;
+
+	/* udev's -submit and our own uevent race for the same tty */
+	for (s = sessions; s; s = s->next) {
+		if (strcmp(s->dev, dev))
+			continue;
+		if (s->client == -1)
+			s->client = client;	/* gets that load's result */
+		else
+			reply(client, "Device busy");
+		return;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		reply(client, "Out of memory");
+		return;
+	}
+	s->client = client;
+	s->w.type = W_SERIAL;
+	s->t_start = monotonic_ms();
+	s->backoff = RETRY_BACKOFF;
+	snprintf(s->dev, sizeof(s->dev), "%s", dev);
+	hdlc_decoder_init(&s->dec, s->frame, sizeof(s->frame));
+
+	s->fw = fw_set_get(fwdir, variant);
+	if (!s->fw) {
+		err = "Failed to load firmware";
+		goto fail;
+	}
+
+	s->w.fd = open(dev, O_RDWR | O_NONBLOCK | O_NOCTTY);
+	if (s->w.fd == -1) {
+		err = "Failed to open serial device";
+		goto fail_fw;
+	}
+
+	tcgetattr(s->w.fd, &terminal_data);
+	cfmakeraw(&terminal_data);
+	tcsetattr(s->w.fd, TCSANOW, &terminal_data);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &s->w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->w.fd, &ev)) {
+		err = strerror(errno);
+		close(s->w.fd);
+		goto fail_fw;
+	}
+
+	s->next = sessions;
+	sessions = s;
+	session_step(s);
+	return;
+
+fail_fw:
+	fw_set_put(s->fw);
+fail:
+	fprintf(stderr, "[QDL ERROR]: %s: %s\n", dev, err);
+	reply(client, err);
+	free(s);
+}
+
+/* request: "<variant>\0<serial_device>\0<firmware_dir>\0" */
+static void client_request(struct watch *w)
+{
+	char msg[MAX_REQUEST + 1];
+	const char *dev, *dir;
+	ssize_t len;
+	int variant;
+
+	len = recv(w->fd, msg, MAX_REQUEST, 0);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+	if (len <= 0) {
+		close(w->fd);
+		free(w);
+		return;
+	}
+
+	msg[len] = '\0';
+	dev = msg + strlen(msg) + 1;
+	dir = dev < msg + len ? dev + strlen(dev) + 1 : msg + len;
+	variant = qdl_variant_find(msg);
+	if (dir >= msg + len || !*dev || !*dir) {
+		reply(w->fd, "Malformed request");
+	} else if (variant < 0) {
+		reply(w->fd, "Unknown variant");
+	} else {
+		session_start(w->fd, variant, dev, dir);
+	}
+	free(w);
+}
+
+static void client_accept(int lfd)
+{
+	struct epoll_event ev;
+	struct watch *w;
+	int fd;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	w = malloc(sizeof(*w));
+	if (!w) {
+		close(fd);
+		return;
+	}
+	w->type = W_CLIENT;
+	w->fd = fd;
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		free(w);
+	}
+}
+
+/* a tty the kernel announced; load it if it is a Gobi device */
+static void device_add(const char *name)
+{
+	char dev[PATH_MAX], fwpath[PATH_MAX];
+	const char *fwdir = NULL;
+	struct session *s;
+	uint16_t vid, pid;
+	int variant;
+
+	if (strncmp(name, "ttyUSB", 6))
+		return;
+	snprintf(dev, sizeof(dev), "/dev/%s", name);
+	for (s = sessions; s; s = s->next)
+		if (!strcmp(s->dev, dev))
+			return;
+	if (devdb_device_id(dev, &vid, &pid, NULL) || !devdb_lookup(vid, pid))
+		return;
+	if (qdl_identify(dev, &variant, 0, fwroot, &fwdir, fwpath,
+			 sizeof(fwpath)))
+		return;
+	fflush(stdout);
+	session_start(-1, variant, dev, fwdir);
+}
+
+static void device_scan(void)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir("/sys/class/tty");
+	if (!dir)
+		return;
+	while ((d = readdir(dir)))
+		device_add(d->d_name);
+	closedir(dir);
+}
+
+/* "add@/devices/...\0ACTION=add\0SUBSYSTEM=tty\0DEVNAME=ttyUSB0\0..." */
+static void uevent_read(int fd)
+{
+	char buf[UEVENT_BUF + 1];
+	struct sockaddr_nl sa;
+	socklen_t salen;
+	const char *action, *subsystem, *devname;
+	char *p;
+	ssize_t len;
+
+	for (;;) {
+		salen = sizeof(sa);
+		len = recvfrom(fd, buf, UEVENT_BUF, 0, (struct sockaddr *)&sa,
+			       &salen);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* events were dropped, look for ourselves */
+				device_scan();
+				continue;
+			}
+			return;
+		}
+		if (sa.nl_pid)		/* only trust the kernel */
+			continue;
+
+		buf[len] = '\0';
+		action = subsystem = devname = NULL;
+		for (p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strncmp(p, "ACTION=", 7))
+				action = p + 7;
+			else if (!strncmp(p, "SUBSYSTEM=", 10))
+				subsystem = p + 10;
+			else if (!strncmp(p, "DEVNAME=", 8))
+				devname = p + 8;
+		}
+		if (action && subsystem && devname && !strcmp(action, "add") &&
+		    !strcmp(subsystem, "tty"))
+			device_add(devname);
+	}
+}
+
+static int uevent_socket(void)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+	int fd, size = UEVENT_RCVBUF;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd == -1) {
+		perror("Failed to create uevent socket: ");
+		return -1;
+	}
+	/* FORCE needs CAP_NET_ADMIN, the plain one is capped by rmem_max */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		perror("Failed to listen for uevents: ");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void expire_sessions(void)
+{
+	struct session *s, *next;
+	long long now = monotonic_ms();
+
+	for (s = sessions; s; s = next) {
+		next = s->next;
+		if (s->resume && s->resume <= now) {
+			s->resume = 0;
+			session_step(s);
+		} else if (s->expect && !s->outlen[0] && !s->outlen[1] &&
+			   s->deadline <= now) {
+			session_fail(s, "Timeout waiting for response");
+		}
+	}
+}
+
+static int next_timeout(void)
+{
+	struct session *s;
+	long long now = monotonic_ms(), t = -1, due;
+
+	for (s = sessions; s; s = s->next) {
+		if (s->resume)
+			due = s->resume;
+		else if (s->expect && !s->outlen[0] && !s->outlen[1])
+			due = s->deadline;
+		else
+			continue;
+		if (t < 0 || due - now < t)
+			t = due - now > 0 ? due - now : 0;
+	}
+	return t;
+}
+
+static int listen_socket(const char *sockpath)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, sockpath);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("Failed to create socket: ");
+		return -1;
+	}
+	unlink(sockpath);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 16)) {
+		perror("Failed to listen on socket: ");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * qdl_daemon - serve load requests until killed
+ * @sockpath: unix socket for -submit
+ * @root: firmware root for devices found by uevent
+ * @uevents: also load Gobi devices the kernel announces
+ */
+int qdl_daemon(const char *sockpath, const char *root, int uevents)
+{
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct watch lw = { .type = W_LISTEN };
+	struct watch uw = { .type = W_UEVENT, .fd = -1 };
+	struct watch *w;
+	int i, n;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	lw.fd = listen_socket(sockpath);
+	if (lw.fd == -1)
+		return -1;
+	if (uevents) {
+		uw.fd = uevent_socket();
+		if (uw.fd == -1)
+			return -1;
+	}
+	fwroot = root;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1) {
+		perror("Failed to create epoll instance: ");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &lw;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, lw.fd, &ev);
+	if (uevents) {
+		ev.data.ptr = &uw;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, uw.fd, &ev);
+		/* the socket is up first, so nothing slips in between */
+		device_scan();
+	}
+
+	for (;;) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, next_timeout());
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait: ");
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			w = events[i].data.ptr;
+			switch (w->type) {
+			case W_LISTEN:
+				client_accept(w->fd);
+				break;
+			case W_CLIENT:
+				client_request(w);
+				break;
+			case W_UEVENT:
+				uevent_read(w->fd);
+				break;
+			case W_SERIAL:
+				/*
+				 * A session can end while handling one event,
+				 * so only look at one event per session here.
+				 */
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+					session_read((struct session *)w);
+				else if (events[i].events & EPOLLOUT)
+					session_write((struct session *)w);
+				break;
+			}
+		}
+
+		expire_sessions();
+	}
+}
+
+int qdl_submit(const char *sockpath, int variant, const char *dev,
+	       const char *fwdir)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char msg[MAX_REQUEST];
+	char devpath[PATH_MAX], dirpath[PATH_MAX];
+	char answer[256];
+	ssize_t len;
+	int fd, n;
+
+	/* the daemon doesn't share our working directory */
+	if (!realpath(dev, devpath) || !realpath(fwdir, dirpath)) {
+		perror("Failed to resolve path: ");
+		return -1;
+	}
+
+	n = snprintf(msg, sizeof(msg), "%s%c%s%c%s", qdl_variants[variant].name,
+		     0, devpath, 0, dirpath);
+	if (n < 0 || n >= sizeof(msg) || strlen(sockpath) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, sockpath);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("Failed to connect to daemon: ");
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	if (send(fd, msg, n + 1, 0) != n + 1) {
+		perror("Failed to send request: ");
+		close(fd);
+		return -1;
+	}
+
+	len = recv(fd, answer, sizeof(answer) - 1, 0);
+	close(fd);
+	if (len <= 0) {
+		die("No answer from daemon");
+		return -1;
+	}
+	answer[len] = '\0';
+	if (strcmp(answer, "ok")) {
+		die(answer);
+		return -1;
+	}
+	printf("QDL success\n");
+	return 0;
+}
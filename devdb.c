@@ -0,0 +1,165 @@
+/* Gobi QDL device database for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every device that shows up in QDL mode, keyed by USB VID:PID, with the
+ * protocol variant it speaks and the firmware set it needs, relative to
+ * the firmware root (e.g. "hp/elitebook2740p" for the trees in firmware/).
+ * Devices without a firmware set load from the root itself.
+ *
+ * The table is a perfect hash: each entry sits at the slot its key
+ * multiplies to, so a lookup is one multiply and one compare. A new
+ * device whose key lands on a taken slot fails the build (override-init
+ * is an error below); pick another DEVDB_MULT then, or raise DEVDB_BITS.
+ *
+ * The ids to look up come from sysfs, from the USB device above a tty or
+ * usbfs node; the loader, the daemon, -tune and -wait-modem share that.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "devdb.h"
+#include "variant.h"
+
+#define DEVDB_BITS	6
+#define DEVDB_MULT	0xbf67dcd9u
+
+#define DEVDB_KEY(vid, pid)	((uint32_t)(vid) << 16 | (pid))
+#define DEVDB_SLOT(key)	((uint32_t)((key) * DEVDB_MULT) >> (32 - DEVDB_BITS))
+
+#define DEV(vid, pid, variant, firmware, name)				\
+	[DEVDB_SLOT(DEVDB_KEY(vid, pid))] =				\
+		{ DEVDB_KEY(vid, pid), variant, firmware, name }
+
+#define G1K	QDL_GOBI1000
+#define G2K	QDL_GOBI2000
+
+#pragma GCC diagnostic error "-Woverride-init"
+
+static const struct devdb_entry devdb[1 << DEVDB_BITS] = {
+	DEV(0x05c6, 0x9211, G1K, NULL, "Acer Gobi"),
+	DEV(0x03f0, 0x201d, G1K, NULL, "HP un2400 Gobi"),
+	DEV(0x04da, 0x250c, G1K, NULL, "Panasonic Gobi"),
+	DEV(0x413c, 0x8171, G1K, NULL, "Dell Gobi"),
+	DEV(0x1410, 0xa008, G1K, NULL, "Novatel Gobi"),
+	DEV(0x0b05, 0x1774, G1K, NULL, "Asus Gobi"),
+	DEV(0x19d2, 0xfff2, G1K, NULL, "ONDA Gobi"),
+	DEV(0x1557, 0x0a80, G1K, NULL, "OQO Gobi"),
+	DEV(0x05c6, 0x9008, G1K, NULL, "Generic Gobi"),
+	DEV(0x05c6, 0x9201, G1K, NULL, "Generic Gobi"),
+	DEV(0x05c6, 0x9221, G1K, NULL, "Generic Gobi"),
+	DEV(0x05c6, 0x9231, G1K, NULL, "Generic Gobi"),
+	DEV(0x1f45, 0x0001, G1K, NULL, "Unknown Gobi"),
+	DEV(0x16d8, 0x8001, G2K, NULL, "CMDTech Gobi 2000"),
+	DEV(0x1199, 0x9000, G2K, NULL, "Sierra Wireless Gobi 2000"),
+	DEV(0x03f0, 0x241d, G2K, "hp/elitebook2740p", "HP un2420 Gobi 2000"),
+	/* the CF-U1 module carries the same images as the CF-F9 one */
+	DEV(0x04da, 0x250e, G2K, "panasonic/cf-f9", "Panasonic Gobi 2000"),
+	DEV(0x05c6, 0x9204, G2K, NULL, "Generic Gobi 2000"),
+	DEV(0x05c6, 0x9214, G2K, NULL, "Acer Gobi 2000"),
+	DEV(0x05c6, 0x9224, G2K, NULL, "Sony Gobi 2000"),
+	DEV(0x05c6, 0x9234, G2K, NULL, "Top Global Gobi 2000"),
+	DEV(0x05c6, 0x9244, G2K, NULL, "iRex Technologies Gobi 2000"),
+	DEV(0x05c6, 0x9264, G2K, NULL, "Asus Gobi 2000"),
+	DEV(0x05c6, 0x9274, G2K, NULL, "iRex Technologies Gobi 2000"),
+	DEV(0x413c, 0x8185, G2K, NULL, "Dell Gobi 2000"),
+};
+
+/* the entry for vid:pid, or NULL if it isn't a known QDL device */
+const struct devdb_entry *devdb_lookup(uint16_t vid, uint16_t pid)
+{
+	uint32_t key = DEVDB_KEY(vid, pid);
+	const struct devdb_entry *e = &devdb[DEVDB_SLOT(key)];
+
+	return e->key == key && key ? e : NULL;
+}
+
+static int read_id(const char *dir, const char *attr, uint16_t *val)
+{
+	char path[PATH_MAX], buf[8];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	*val = strtoul(buf, NULL, 16);
+	return 0;
+}
+
+/* idVendor and idProduct of the USB device at dir in sysfs; 0 if it is one */
+int devdb_read_ids(const char *dir, uint16_t *vid, uint16_t *pid)
+{
+	return read_id(dir, "idVendor", vid) || read_id(dir, "idProduct", pid);
+}
+
+/**
+ *	devdb_device_id - find the USB ids of the device behind a node
+ *	@dev: serial device or /dev/bus/usb node
+ *	@vid: set to idVendor
+ *	@pid: set to idProduct
+ *	@dir: if not NULL, set to the USB device's sysfs path, PATH_MAX bytes
+ *
+ *	Walks up from the node's sysfs directory to the first USB device.
+ *	Returns 0, or -1 if dev has no USB parent (e.g. a pty stand-in).
+ */
+int devdb_device_id(const char *dev, uint16_t *vid, uint16_t *pid,
+		    char *dir)
+{
+	char link[64], path[PATH_MAX], *slash;
+	struct stat st;
+
+	if (stat(dev, &st) || !S_ISCHR(st.st_mode))
+		return -1;
+	snprintf(link, sizeof(link), "/sys/dev/char/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(link, path))
+		return -1;
+
+	while ((slash = strrchr(path, '/')) && slash != path) {
+		if (!devdb_read_ids(path, vid, pid)) {
+			if (dir)
+				memcpy(dir, path, strlen(path) + 1);
+			return 0;
+		}
+		*slash = '\0';
+	}
+	return -1;
+}
+
+void devdb_list(FILE *f)
+{
+	const struct devdb_entry *e;
+
+	for (e = devdb; e < devdb + (1 << DEVDB_BITS); e++)
+		if (e->key)
+			fprintf(f, "%04x:%04x %s %s (%s)\n", e->key >> 16,
+				e->key & 0xffff, qdl_variants[e->variant].name,
+				e->firmware ? e->firmware : ".", e->name);
+}
@@ -0,0 +1,24 @@
+/* Compiled-in database of Gobi QDL devices */
+
+#ifndef DEVDB_H
+#define DEVDB_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define GOBI_FIRMWARE	"/lib/firmware/gobi"
+
+struct devdb_entry {
+	uint32_t key;		/* vid << 16 | pid, 0 for an empty slot */
+	int variant;		/* index into qdl_variants[] */
+	const char *firmware;	/* firmware set below the root, or NULL */
+	const char *name;
+};
+
+const struct devdb_entry *devdb_lookup(uint16_t vid, uint16_t pid);
+int devdb_read_ids(const char *dir, uint16_t *vid, uint16_t *pid);
+int devdb_device_id(const char *dev, uint16_t *vid, uint16_t *pid,
+		    char *dir);
+void devdb_list(FILE *f);
+
+#endif
@@ -0,0 +1,256 @@
+/* Persistent firmware image cache for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Firmware usually lives on slow flash or USB storage, so a copy of every
+ * image that gets loaded is kept in a cache directory that is expected to
+ * be on tmpfs (e.g. /dev/shm/gobi_loader or /tmp/gobi_loader):
+ *
+ *   <sha256 of content>.mbn   image blob, shared by identical images
+ *   <sha256 of path>.idx      "size mtime_sec mtime_nsec ino dev blob path"
+ *
+ * A lookup only stats the original file. If size, mtime and inode still
+ * match the index entry, the blob is opened instead; otherwise the image
+ * is copied in again. Blobs are touched on use and the least recently
+ * used ones are removed once the cache grows beyond its size cap.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fwcache.h"
+#include "sha256.h"
+
+#define COPY_CHUNK	(64 * 1024)
+
+static char cache_dir[PATH_MAX / 2];	/* leaves room for entry names */
+static uint64_t cache_max = FWCACHE_DEFAULT_MAX;
+
+void fwcache_init(const char *dir, uint64_t max_bytes)
+{
+	snprintf(cache_dir, sizeof(cache_dir), "%s", dir);
+	if (max_bytes)
+		cache_max = max_bytes;
+	mkdir(cache_dir, 0700);
+}
+
+static void path_key(const char *path, char hex[SHA256_HEX_LEN])
+{
+	struct sha256 c;
+	uint8_t digest[SHA256_DIGEST_LEN];
+
+	sha256_init(&c);
+	sha256_update(&c, path, strlen(path));
+	sha256_final(&c, digest);
+	sha256_hex(digest, hex);
+}
+
+/* blob fd if the index entry for src still describes st, else -1 */
+static int cache_lookup(const char *idx, const struct stat *st)
+{
+	char line[PATH_MAX + 256], blob[PATH_MAX], hex[SHA256_HEX_LEN];
+	unsigned long long size, ino, dev;
+	long long sec, nsec;
+	struct stat bst;
+	FILE *f;
+	int fd;
+
+	f = fopen(idx, "r");
+	if (!f)
+		return -1;
+	if (!fgets(line, sizeof(line), f) ||
+	    sscanf(line, "%llu %lld %lld %llu %llu %64s", &size, &sec, &nsec,
+		   &ino, &dev, hex) != 6) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	if (size != st->st_size || sec != st->st_mtim.tv_sec ||
+	    nsec != st->st_mtim.tv_nsec || ino != st->st_ino ||
+	    dev != st->st_dev)
+		return -1;
+
+	snprintf(blob, sizeof(blob), "%s/%s.mbn", cache_dir, hex);
+	fd = open(blob, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &bst) || bst.st_size != st->st_size) {
+		close(fd);
+		return -1;
+	}
+	futimens(fd, NULL);	/* LRU stamp; needs no write access */
+	return fd;
+}
+
+/* drop least recently used blobs until the cache fits in cache_max */
+static void cache_evict(const char *keep)
+{
+	char path[PATH_MAX], oldest[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	uint64_t total;
+	struct timespec t;
+	size_t len;
+	DIR *d;
+
+	for (;;) {
+		d = opendir(cache_dir);
+		if (!d)
+			return;
+		total = 0;
+		oldest[0] = '\0';
+		t.tv_sec = t.tv_nsec = 0;
+		while ((de = readdir(d))) {
+			len = strlen(de->d_name);
+			if (len < 4 || strcmp(de->d_name + len - 4, ".mbn"))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s", cache_dir, de->d_name);
+			if (stat(path, &st))
+				continue;
+			total += st.st_size;
+			if (!strcmp(path, keep))
+				continue;
+			if (!oldest[0] || st.st_mtim.tv_sec < t.tv_sec ||
+			    (st.st_mtim.tv_sec == t.tv_sec &&
+			     st.st_mtim.tv_nsec < t.tv_nsec)) {
+				t = st.st_mtim;
+				strcpy(oldest, path);
+			}
+		}
+		closedir(d);
+
+		if (total <= cache_max || !oldest[0])
+			return;
+		unlink(oldest);
+	}
+}
+
+/* copy src into a new blob and point the index at it; returns blob fd */
+static int cache_fill(int src, const struct stat *st, const char *idx,
+		      const char *srcpath)
+{
+	char tmp[PATH_MAX], blob[PATH_MAX], hex[SHA256_HEX_LEN];
+	uint8_t digest[SHA256_DIGEST_LEN];
+	struct sha256 c;
+	static char buf[COPY_CHUNK];	/* loads and fills are one at a time */
+	ssize_t n;
+	FILE *f;
+	int fd;
+
+	if (st->st_size > cache_max)
+		return -1;
+
+	snprintf(tmp, sizeof(tmp), "%s/.fill.XXXXXX", cache_dir);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+
+	sha256_init(&c);
+	while ((n = read(src, buf, COPY_CHUNK)) > 0) {
+		sha256_update(&c, buf, n);
+		if (write(fd, buf, n) != n) {
+			n = -1;
+			break;
+		}
+	}
+	close(fd);
+	if (n < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	sha256_final(&c, digest);
+	sha256_hex(digest, hex);
+
+	/* an identical image from another directory may already be cached */
+	snprintf(blob, sizeof(blob), "%s/%s.mbn", cache_dir, hex);
+	if (rename(tmp, blob)) {
+		unlink(tmp);
+		return -1;
+	}
+	chmod(blob, 0400);
+
+	snprintf(tmp, sizeof(tmp), "%s/.idx.XXXXXX", cache_dir);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	fprintf(f, "%llu %lld %lld %llu %llu %s %s\n",
+		(unsigned long long)st->st_size, (long long)st->st_mtim.tv_sec,
+		(long long)st->st_mtim.tv_nsec, (unsigned long long)st->st_ino,
+		(unsigned long long)st->st_dev, hex, srcpath);
+	if (fclose(f) || rename(tmp, idx)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	cache_evict(blob);
+	return open(blob, O_RDONLY);
+}
+
+/**
+ *	fwcache_open - open a firmware image, through the cache if enabled
+ *	@fwdir: firmware directory
+ *	@name: image file name inside fwdir
+ *
+ *	Returns a read-only fd positioned at 0 whose contents and size are
+ *	those of fwdir/name, or -1 with errno set if the image can't be
+ *	opened. Cache failures are not errors; the original file is used.
+ */
+int fwcache_open(const char *fwdir, const char *name)
+{
+	char src[PATH_MAX], real[PATH_MAX], idx[PATH_MAX], hex[SHA256_HEX_LEN];
+	struct stat st;
+	int fd, cfd;
+
+	snprintf(src, sizeof(src), "%s/%s", fwdir, name);
+	if (!cache_dir[0])
+		return open(src, O_RDONLY);
+
+	if (!realpath(src, real) || stat(real, &st))
+		return -1;
+
+	path_key(real, hex);
+	snprintf(idx, sizeof(idx), "%s/%s.idx", cache_dir, hex);
+
+	cfd = cache_lookup(idx, &st);
+	if (cfd != -1)
+		return cfd;
+
+	fd = open(real, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	cfd = cache_fill(fd, &st, idx, real);
+	if (cfd == -1) {
+		lseek(fd, 0, SEEK_SET);
+		return fd;
+	}
+	close(fd);
+	return cfd;
+}
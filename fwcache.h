@@ -0,0 +1,13 @@
+/* Persistent firmware image cache on tmpfs */
+
+#ifndef FWCACHE_H
+#define FWCACHE_H
+
+#include <stdint.h>
+
+#define FWCACHE_DEFAULT_MAX	(64ULL * 1024 * 1024)
+
+void fwcache_init(const char *dir, uint64_t max_bytes);
+int fwcache_open(const char *fwdir, const char *name);
+
+#endif
@@ -40,361 +40,1522 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <time.h>
+
+#include "crc_ccitt.h"
+#include "hdlc.h"
+#include "gobi_loader.h"
+#include "fwcache.h"
+#include "pipeline.h"
+#include "uring.h"
+#include "tune.h"
+#include "metrics.h"
+#include "bundle.h"
+#include "variant.h"
+#include "devdb.h"
+#include "unpack.h"
+#include "store.h"
+#include "trace.h"
+#include "transport.h"
+#include "verify.h"
+#include "modem.h"
+
+/* the size goes to [2] and the image type to [1] */
+static const char open_template[] = {
+	0x25, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
+	0x00, 0x00, 0x04, 0x00, 0x00, 0xff, 0xff};
+
+/* the size goes to [7] */
+static const char header_template[] = {
+	0x27, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0xff, 0xff};
 
-#if defined(BYTE_ORDER) && !defined(__BYTE_ORDER)
-#define __LITTLE_ENDIAN LITTLE_ENDIAN
-#define __BIG_ENDIAN BIG_ENDIAN
-#define __BYTE_ORDER BYTE_ORDER
-#endif
+void usage (char **argv) {
+	int i;
+
+	printf ("usage: %s [-2000] [-transfer sendfile|mmap|buffered|pipeline|uring] "
+		"serial_device [firmware_dir|bundle]\n", argv[0]);
+	printf ("       %s -transport usbfs serial_device|/dev/bus/usb/BBB/DDD "
+		"[firmware_dir|bundle]\n", argv[0]);
+	printf ("       %s -transport socket socket_path [firmware_dir|bundle]\n",
+		argv[0]);
+	printf ("       %s [-2000] pack firmware_dir bundle\n", argv[0]);
+	printf ("       %s [-store dir] import firmware_tree recipe_tree\n",
+		argv[0]);
+	printf ("       %s [-2000] manifest firmware_dir\n", argv[0]);
+	printf ("       %s verify firmware_tree\n", argv[0]);
+	printf ("       %s -daemon [-socket path] [-uevent]\n", argv[0]);
+	printf ("       %s -submit [-socket path] [-2000] "
+		"serial_device [firmware_dir|bundle]\n", argv[0]);
+	printf ("       %s -devices\n", argv[0]);
+	printf ("options: -variant ");
+	for (i = 0; i < QDL_VARIANTS; i++)
+		printf ("%s%s", i ? "|" : "", qdl_variants[i].name);
+	printf ("  chip to load (-2000 is -variant gobi2000)\n");
+	printf ("         -firmware-root dir  firmware sets of known devices (%s)\n",
+		GOBI_FIRMWARE);
+	printf ("         -cache dir [-cache-max bytes]  keep images in a tmpfs cache\n");
+	printf ("         -store dir  chunks of imported firmware (%s)\n",
+		STORE_DEFAULT);
+	printf ("         -depth n  ring buffers for -transfer pipeline, "
+		"2 to %d (%d)\n", PIPELINE_DEPTH_MAX, PIPELINE_DEPTH_DEFAULT);
+	printf ("         -retries n -restarts n  retries per stage (3) and "
+		"full reloads after a device reset (1), at most %d\n",
+		RETRY_MAX);
+	printf ("         -metrics file|-  per-phase timing as JSON lines, or a "
+		"Prometheus textfile if file ends in .prom\n");
+	printf ("         -trace file [-trace-elide]  log the frames of the load, "
+		"for tools/qdl_replay\n");
+	printf ("         -chunk bytes -write plain|drain|poll  transfer setting\n");
+	printf ("         -tune [-tune-file path]  measure and store the best "
+		"setting for this device (%s)\n", TUNE_FILE);
+	printf ("         -wait-modem s  after the reset, wait up to s seconds "
+		"(1-%d) for the modem's tty and report the time\n",
+		MODEM_WAIT_MAX);
+}
 
-#ifndef __BYTE_ORDER
-#error Unknown endian type
-#endif
+int write_all(int fd, const char *buf, size_t len) {
+	ssize_t n;
 
-static inline uint16_t __swab16(uint16_t x)
-{
-	return x<<8 | x>>8;
+	while (len) {
+		n = write(fd, buf, len);
+		io_account(1, n > 0 ? n : 0, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
 }
 
-static inline uint32_t __swab32(uint32_t x)
-{
-	return x<<24 | x>>24 |
-		(x & (uint32_t)0x0000ff00UL)<<8 |
-		(x & (uint32_t)0x00ff0000UL)>>8;
+void die(const char *err) {
+	fprintf(stderr, "[QDL ERROR]: %s\n", err);
 }
 
-static inline uint64_t __swab64(uint64_t x)
-{
-	return x<<56 | x>>56 |
-		(x & (uint64_t)0x000000000000ff00ULL)<<40 |
-		(x & (uint64_t)0x0000000000ff0000ULL)<<24 |
-		(x & (uint64_t)0x00000000ff000000ULL)<< 8 |
-		(x & (uint64_t)0x000000ff00000000ULL)>> 8 |
-		(x & (uint64_t)0x0000ff0000000000ULL)>>24 |
-		(x & (uint64_t)0x00ff000000000000ULL)>>40;
+#define FRAME_STACK	128	/* frames up to this size don't touch the heap */
+
+/*
+ * data carries len-2 bytes of payload followed by two bytes reserved for
+ * the CRC. Builds the wire form of the request into out, which must hold
+ * HDLC_ENCODED_MAX(len - 2) bytes, and returns its length.
+ */
+size_t qdl_build_request(uint8_t *out, size_t outlen, const char *data,
+			 int len, char flag) {
+	uint16_t crc;
+
+	if(flag == DATA_ENCODE) /* do transposition, similar to PPP protocol */
+		return hdlc_encode(out, outlen, data, len - 2);
+
+	if (outlen < len)
+		return 0;
+	crc = ~crc_ccitt(0xffff, data, len - 2);
+	memcpy(out, data, len - 2);
+	out[len-2] = crc & 0xff;
+	out[len-1] = crc >> 8;
+	return len;
+}
+
+/*
+ * The two frames that depend on the image size; the static ones are in
+ * variant.c.
+ */
+size_t qdl_open_request(uint8_t *out, size_t outlen, uint8_t type,
+			uint32_t size) {
+	char req[sizeof(open_template)];
+
+	memcpy(req, open_template, sizeof(req));
+	req[1] = type;
+	*(int32_t *)&req[2] = SWAPL32(size);
+	return qdl_build_request(out, outlen, req, sizeof(req), DATA_ENCODE);
+}
+
+size_t qdl_image_header(uint8_t *out, size_t outlen, uint32_t size) {
+	char req[sizeof(header_template)];
+
+	memcpy(req, header_template, sizeof(req));
+	*(int32_t *)&req[7] = SWAPL32(size);
+	return qdl_build_request(out, outlen, req, sizeof(req), DATA_NOENCODE);
 }
 
+/*
+ * Encoded frames are built in one pass by hdlc_encode() and go out in a
+ * single write. DATA_FRAMED frames are written as they are.
+ */
+int qdl_server_send_request(struct transport *port, const char *data, int len,
+			    char flag) {
+	uint8_t stack[FRAME_STACK];
+	uint8_t *buff = stack;
+	size_t cnt, max;
+	int ret;
+
+	if(data == NULL) return -1;
+	if(len < 3) return -1;
 
-#if __BYTE_ORDER == __BIG_ENDIAN
-#define SWAPL16(val) __swab16(val)
-#define SWAPL32(val) __swab32(val)
-#define SWAPL64(val) __swab64(val)
+	if (flag == DATA_FRAMED) {
+		ret = transport_write_all(port, data, len, NULL);
+		if (ret)
+			die("Failed to send request");
+		else
+			trace_tx(data, len);
+		return ret;
+	}
+
+	max = HDLC_ENCODED_MAX(len - 2);
+	if (max > sizeof(stack)) {
+#ifdef STATIC_RING
+		errno = EMSGSIZE;
+		return -1;
 #else
-#define SWAPL16(val) (val)
-#define SWAPL32(val) (val)
-#define SWAPL64(val) (val)
+		buff = malloc(max);
+		if (!buff)
+			return -1;
 #endif
+	}
 
-char magic1[] = {0x01, 0x51, 0x43, 0x4f, 0x4d, 0x20, 0x68, 0x69,
-		 0x67, 0x68, 0x20, 0x73, 0x70, 0x65, 0x65, 0x64, 0x20, 
-		 0x70, 0x72, 0x6f, 0x74, 0x6f, 0x63, 0x6f, 0x6c, 0x20,
-		 0x68, 0x73, 0x74, 0x00, 0x00, 0x00, 0x00, 0x04, 0x04,
-		 0x30, 0xff, 0xff};
-
-//char magic1[] = "QCOM high speed protocol hst\0\0\0\0\x04\x04\x30";
+	cnt = qdl_build_request(buff, max, data, len, flag);
+	ret = transport_write_all(port, buff, cnt, NULL);
+	if (ret)
+		die("Failed to send request");
+	else
+		trace_tx(buff, cnt);
 
-char magic2[] = {0x25, 0x05, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
-		 0x00, 0x00, 0x04, 0x00, 0x00, 0xff, 0xff};
+#ifndef STATIC_RING
+	if (buff != stack)
+		free(buff);
+#endif
+	return ret;
+}
 
-char magic3[] = {0x27, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		 0x00, 0x00, 0xff, 0xff};
+long long monotonic_ms(void) {
+	struct timespec ts;
 
-char magic4[] = {0x25, 0x06, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
-		 0x00, 0x00, 0x04, 0x00, 0x00, 0xff, 0xff};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-char magic5[] = {0x27, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		 0x00, 0x00, 0xff, 0xff};
+long long monotonic_us(void) {
+	struct timespec ts;
 
-char magic6[] = {0x25, 0x0d, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00,
-		 0x00, 0x00, 0x04, 0x00, 0x00, 0xff, 0xff};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-char magic7[] = {0x27, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-		 0x00, 0x00, 0xff, 0xff};
+#define RESP_MORE	(-2)
 
-char magic8[] = {0x29, 0xff, 0xff};
+/*
+ * Feed received bytes to the response decoder. Returns RESP_MORE until a
+ * frame is complete, then the qdl_server_wait_response() result for it.
+ */
+static int qdl_response_feed(struct hdlc_decoder *dec, const uint8_t *buff,
+			     size_t len, char code) {
+	size_t used, off;
+	int ret;
+
+	for (off = 0; off < len; off += used) {
+		ret = hdlc_decode(dec, buff + off, len - off, &used);
+		if (ret != HDLC_MORE)
+			trace_frame(TRACE_RX, ret == HDLC_FRAME ? 0 : TRACE_BAD,
+				    dec->buf, dec->len);
+		switch (ret) {
+		case HDLC_MORE:
+			break;
+		case HDLC_ERR_SHORT: /* 0x7e code crc1 crc2 0x7e */
+			die("Invalid Length");
+			return 1;
+		case HDLC_ERR_OVERFLOW:
+			die("Invalid Package");
+			return 2;
+		case HDLC_ERR_CRC:
+			die("Invalid CRC");
+			return 5;
+		default:
+			if(dec->buf[0] != (uint8_t)code) {
+				die("Invalid response Code");
+				return 3;
+			}
+			return 0;
+		}
+	}
+	return RESP_MORE;
+}
 
 /*
- * This mysterious table is just the CRC of each possible byte. It can be
- * computed using the standard bit-at-a-time methods. The polynomial can
- * be seen in entry 128, 0x8408. This corresponds to x^0 + x^5 + x^12.
- * Add the implicit x^16, and you have the standard CRC-CCITT.
+ * Wait up to timeout ms for one response frame and check that it carries
+ * code. The frame may arrive in any number of reads; it is unescaped and
+ * its CRC verified before the code is looked at.
  */
+int qdl_server_wait_response(struct transport *port, char code, int timeout) {
+	struct hdlc_decoder dec;
+	uint8_t frame[64];
+	uint8_t buff[64];
+	long long deadline = monotonic_ms() + timeout;
+	long long left;
+	ssize_t len;
+	int ret;
+
+	hdlc_decoder_init(&dec, frame, sizeof(frame));
+
+	for (;;) {
+		left = deadline - monotonic_ms();
+		if (left <= 0) {
+			die("Timeout waiting for response");
+			return 4;
+		}
 
-uint16_t const crc_ccitt_table[256] = {
-	0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
-	0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
-	0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
-	0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
-	0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
-	0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
-	0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
-	0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
-	0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
-	0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
-	0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
-	0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
-	0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
-	0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
-	0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
-	0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
-	0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
-	0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
-	0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
-	0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
-	0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
-	0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
-	0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
-	0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
-	0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
-	0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
-	0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
-	0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
-	0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
-	0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
-	0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
-	0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
-};
+		len = port->ops->read(port, buff, sizeof(buff), left);
+		if (len == 0)
+			continue;
+		if (len < 0) {
+			die("Serial device closed");
+			return -1;
+		}
 
-uint16_t crc_ccitt_byte(uint16_t crc, const char c)
-{
-        return (crc >> 8) ^ crc_ccitt_table[(crc ^ c) & 0xff];
+		ret = qdl_response_feed(&dec, buff, len, code);
+		if (ret != RESP_MORE)
+			return ret;
+	}
 }
 
-/**
- *	crc_ccitt - recompute the CRC for the data buffer
- *	@crc: previous CRC value
- *	@buffer: data pointer
- *	@len: number of bytes in the buffer
+#ifdef STATIC_RING
+#define FW_SIZE_PER_PACKAGE		STATIC_RING
+#else
+#define FW_SIZE_PER_PACKAGE		(256*1024)	/* default, see -tune */
+#endif
+
+/*
+ * Image data is pushed to the serial device with the cheapest mechanism the
+ * kernel accepts: sendfile() keeps it in the kernel entirely, mmap() at least
+ * avoids the bounce through a user buffer, and the buffered read()/write()
+ * loop is the last resort. Each stage picks up at the offset the previous
+ * one stopped at.
+ *
+ * The pipeline path is only used on request. It reads the image ahead into
+ * a ring from a second thread, which pays off when the firmware sits on
+ * storage slow enough that sendfile() would stall the link on every read.
+ * The io_uring path (see below) also carries the command exchange.
  */
-uint16_t crc_ccitt(int16_t crc, char const *buffer, size_t len)
-{
-	while (len--)
-		crc = crc_ccitt_byte(crc, *buffer++);
-	return crc;
+#define XFER_SENDFILE	0
+#define XFER_MMAP	1
+#define XFER_BUFFERED	2
+#define XFER_PIPELINE	3
+#define XFER_URING	4
+
+static const char *xfer_names[] = {"sendfile", "mmap", "buffered", "pipeline",
+				   "uring"};
+static int xfer_mode = XFER_SENDFILE;
+static int transport = TRANSPORT_TTY;
+static int last_xfer = -1;	/* path that sent the last image */
+static unsigned pipeline_depth = PIPELINE_DEPTH_DEFAULT;
+static struct pipeline_stats pipeline_stats;
+
+/*
+ * Chunk size and write strategy of the sendfile, mmap and buffered paths.
+ * -tune measures them per device model; the pipeline and io_uring paths
+ * only take the chunk size.
+ */
+static size_t xfer_chunk = FW_SIZE_PER_PACKAGE;
+static int xfer_write = TUNE_WRITE_PLAIN;
+static int tune;
+static int tune_fixed;		/* -chunk or -write given */
+static const char *tunefile = TUNE_FILE;
+
+/* -write poll: the device is non-blocking, wait until it takes more */
+static int xfer_wait_writable(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, TIMEOUT_IMAGE);
+		io_account(1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret == 0)
+		errno = ETIMEDOUT;
+	return ret > 0 ? 0 : -1;
 }
 
-void usage (char **argv) {
-	printf ("usage: %s [-2000] serial_device firmware_dir\n", argv[0]);
+/*
+ * hand one chunk to the serial device according to xfer_write; the image
+ * header held by qdl_send_image() goes out in the same writev(). *off
+ * moves past whatever went out, also when the write fails part way.
+ */
+static int xfer_write_chunk(struct transport *port, const char *buf,
+			    size_t len, off_t *off) {
+	size_t sent;
+	int ret;
+
+	ret = transport_write_all(port, buf, len, &sent);
+	*off += sent;
+	if (ret)
+		return -1;
+	if (xfer_write == TUNE_WRITE_DRAIN)
+		return port->ops->drain(port);
+	return 0;
 }
 
-#define DATA_ENCODE	1	/* add 0x7e head/tail, do encode */
-#define DATA_NOENCODE	0	/* no 0x7e head/tail, no encode */
-int qdl_server_send_request(int fd, const char *data, int len, char flag) {
-	int i, cnt;
-	char buff[64];
+static int stream_sendfile(struct transport *port, int fwfd, off_t *off,
+			   off_t len) {
+	off_t end;
+	ssize_t n;
+
+	while (*off < len) {
+		end = *off + xfer_chunk < len ? *off + xfer_chunk : len;
+		while (*off < end) {
+			n = sendfile(port->fd, fwfd, off, end - *off);
+			io_account(1, n > 0 ? n : 0, 0);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN && !xfer_wait_writable(port->fd))
+					continue;
+				return -1;
+			}
+			if (n == 0) {
+				errno = EIO;	/* firmware shrank under us */
+				return -1;
+			}
+		}
+		if (xfer_write == TUNE_WRITE_DRAIN && port->ops->drain(port))
+			return -1;
+	}
+	return 0;
+}
 
-	if(data == NULL) return -1;
-	if(len < 3) return -1;
+static int stream_mmap(struct transport *port, int fwfd, off_t *off,
+		       off_t len) {
+	char *map;
+	size_t n;
 
-	cnt = len;
-	memcpy(buff, data, len);
+	map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fwfd, 0);
+	io_account(1, 0, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, len, MADV_SEQUENTIAL);
+	io_account(2, 0, 0);	/* madvise and munmap */
+
+	while (*off < len) {
+		n = len - *off;
+		if (n > xfer_chunk)
+			n = xfer_chunk;
+		if (xfer_write_chunk(port, map + *off, n, off)) {
+			munmap(map, len);
+			return -1;
+		}
+	}
+	munmap(map, len);
+	return 0;
+}
 
-	*(int16_t *)&buff[len-2] = SWAPL16(~crc_ccitt(0xffff, data, len-2)); /* crc */
+static int stream_buffered(struct transport *port, int fwfd, off_t *off,
+			   off_t len) {
+#ifdef STATIC_RING
+	static char fwdata[STATIC_RING];	/* xfer_chunk is at most this */
+#else
+	static char *fwdata;
+	static size_t fwdata_len;
+#endif
+	ssize_t n;
 
-	if(flag == DATA_ENCODE) { /* do transposition, similar to PPP protocol */
-		for(i=0; i<len; i++) {
-			switch(buff[i]) {
-				case 0x7e:
-					buff[i] = 0x7d;
-					memmove(buff+i+2, buff+i+1, len-i-1);
-					buff[i+1] = 0x5e;
-					cnt++;
-					break;
+#ifndef STATIC_RING
+	if (fwdata_len < xfer_chunk) {
+		free(fwdata);
+		fwdata = malloc(xfer_chunk);
+		fwdata_len = fwdata ? xfer_chunk : 0;
+	}
+	if (!fwdata) {
+		fprintf(stderr, "Failed to allocate memory for firmware\n");
+		return -1;
+	}
+#endif
 
-				case 0x7d:
-					buff[i] = 0x7d;
-					memmove(buff+i+2, buff+i+1, len-i-1);
-					buff[i+1] = 0x5d;
-					cnt++;
-					break;
-			}
+	while (*off < len) {
+		n = len - *off;
+		if (n > xfer_chunk)
+			n = xfer_chunk;
+		n = pread(fwfd, fwdata, n, *off);
+		io_account(1, 0, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return -1;
 		}
+		if (xfer_write_chunk(port, fwdata, n, off))
+			return -1;
 	}
+	return 0;
+}
 
-	if(flag == DATA_ENCODE) write(fd, "\x7e", 1);
-	write(fd, buff, cnt);
-	if(flag == DATA_ENCODE) write(fd, "\x7e", 1);
+/* only give up on a zero-copy path if the kernel can't do it for this fd */
+static int xfer_unsupported(int err) {
+	return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ||
+		err == ENODEV || err == ENOMEM;
+}
 
+/*
+ * io_uring backend. Each chunk is a READ_FIXED into a registered buffer
+ * linked to a WRITE_FIXED of the same buffer, and a window of such pairs
+ * is chained so the kernel runs the whole window in order without a trip
+ * back to user space. The next window is prefetched with an async fadvise
+ * meanwhile, so slow storage still overlaps with the link. A held image
+ * header turns the first write into a WRITEV of the header and the
+ * buffer. Commands go out as a write linked to the response read and a
+ * link timeout.
+ *
+ * The ring is set up on first use. If the kernel refuses it (too old,
+ * io_uring_disabled, seccomp) the POSIX paths take over.
+ */
+#define URING_WINDOW	8	/* chained read->write pairs per submission */
+#define URING_BUFS	2
+
+#define TAG_READ	0
+#define TAG_WRITE	1
+#define TAG_ADVISE	2
+#define TAG_TIMEOUT	3
+#define URING_TAG(k, t)	((uint64_t)(k) << 2 | (t))
+
+static struct uring ring;
+static int ring_state;		/* 0 not tried, 1 ready, -1 unavailable */
+static int ring_fixed;		/* buffers registered with the kernel */
+#ifdef STATIC_RING
+static char ring_buf[URING_BUFS * STATIC_RING];
+#else
+static char *ring_buf;
+#endif
+static size_t ring_chunk;	/* xfer_chunk when the ring was set up */
+
+static int qdl_uring_setup(void) {
+	struct iovec iov[URING_BUFS];
+	int i;
+
+	if (ring_state)
+		return ring_state > 0 ? 0 : -1;
+
+	ring_state = -1;
+	if (uring_init(&ring, 4 * URING_WINDOW))
+		return -1;
+	ring_chunk = xfer_chunk > FW_SIZE_PER_PACKAGE ?
+		     xfer_chunk : FW_SIZE_PER_PACKAGE;
+#ifndef STATIC_RING
+	ring_buf = malloc(URING_BUFS * ring_chunk);
+	if (!ring_buf) {
+		uring_exit(&ring);
+		errno = ENOMEM;
+		return -1;
+	}
+#endif
+	for (i = 0; i < URING_BUFS; i++) {
+		iov[i].iov_base = ring_buf + i * ring_chunk;
+		iov[i].iov_len = ring_chunk;
+	}
+	/* fails under a small RLIMIT_MEMLOCK on older kernels; plain ops work */
+	ring_fixed = !uring_register_buffers(&ring, iov, URING_BUFS);
+	ring_state = 1;
 	return 0;
 }
 
-static void die(const char *err) {
-	fprintf(stderr, "[QDL ERROR]: %s\n", err);
+static void uring_prep_rw(struct io_uring_sqe *sqe, int write, int fd,
+			  int buf, size_t len, uint64_t off) {
+	if (ring_fixed)
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)(ring_buf + buf * ring_chunk);
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = buf;
 }
 
-int qdl_server_wait_response(int fd, char code) {
-	int len;
-	char buff[64];
+static int stream_uring(struct transport *port, int fwfd, off_t *off,
+			off_t len) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct iovec hiov[2];
+	int rres[URING_WINDOW], wres[URING_WINDOW];
+	size_t want[URING_WINDOW];
+	size_t chunk, held, sent;
+	int n, k, pending, ret;
+	off_t o;
+
+	if (qdl_uring_setup())
+		return -1;
+	chunk = xfer_chunk < ring_chunk ? xfer_chunk : ring_chunk;
+
+	while (*off < len) {
+		o = *off;
+		for (n = 0; n < URING_WINDOW && o < len; n++) {
+			want[n] = len - o;
+			if (want[n] > chunk)
+				want[n] = chunk;
+			rres[n] = wres[n] = -ECANCELED;
+
+			sqe = uring_sqe(&ring);
+			uring_prep_rw(sqe, 0, fwfd, n % URING_BUFS, want[n], o);
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = URING_TAG(n, TAG_READ);
+
+			o += want[n];
+			sqe = uring_sqe(&ring);
+			/* the serial device has no file position */
+			uring_prep_rw(sqe, 1, port->fd, n % URING_BUFS, want[n],
+				      (uint64_t)-1);
+			if (!n && port->held_len) {
+				hiov[0].iov_base = (void *)port->held;
+				hiov[0].iov_len = port->held_len;
+				hiov[1].iov_base = ring_buf;
+				hiov[1].iov_len = want[0];
+				sqe->opcode = IORING_OP_WRITEV;
+				sqe->addr = (uintptr_t)hiov;
+				sqe->len = 2;
+			}
+			if (n + 1 < URING_WINDOW && o < len)
+				sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = URING_TAG(n, TAG_WRITE);
+		}
+		pending = 2 * n;
+
+		if (o < len) {
+			sqe = uring_sqe(&ring);
+			sqe->opcode = IORING_OP_FADVISE;
+			sqe->fd = fwfd;
+			sqe->off = o;
+			sqe->len = URING_WINDOW * chunk;
+			sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+			sqe->user_data = URING_TAG(0, TAG_ADVISE);
+			pending++;
+		}
 
-	len = read(fd, buff, sizeof(buff));
+		if (uring_submit(&ring, 0) < 0)
+			return -1;
+		held = port->held_len;
+		while (pending--) {
+			if (uring_wait(&ring, &cqe))
+				return -1;
+			k = cqe.user_data >> 2;
+			if ((cqe.user_data & 3) == TAG_READ) {
+				rres[k] = cqe.res;
+			} else if ((cqe.user_data & 3) == TAG_WRITE) {
+				wres[k] = cqe.res;
+				if (cqe.res > 0)
+					io_account(0, cqe.res, 0);
+			}
+		}
 
-	if(len < 4) { /* 0x7e crc1 crc2 0x7e */
-		die("Invalid Length");
-		return 1;
-	}
+		/* the header counts as sent, the rest is image data */
+		if (held && wres[0] >= 0) {
+			transport_sent_held(port, wres[0]);
+			wres[0] = (size_t)wres[0] > held ? wres[0] - held : 0;
+		}
 
-	if((buff[0] != 0x7e) || (buff[len-1] != 0x7e)) {
-		die("Invalid Package");
-		return 2;
+		/*
+		 * A short read or write breaks the chain; resume behind it.
+		 * Blocking tty writes from io_uring workers also come back
+		 * with -EINTR when the worker is poked, having written nothing.
+		 */
+		for (k = 0; k < n; k++) {
+			if (wres[k] == (int)want[k]) {
+				*off += want[k];
+				continue;
+			}
+			if (wres[k] >= 0) {
+				*off += wres[k];
+				break;
+			}
+			if (wres[k] == -EINTR || wres[k] == -EAGAIN ||
+			    rres[k] == -EINTR || rres[k] == -EAGAIN)
+				break;
+			if (rres[k] < 0 && rres[k] != -ECANCELED) {
+				errno = -rres[k];
+				return -1;
+			}
+			if (wres[k] != -ECANCELED) {
+				errno = -wres[k];
+				return -1;
+			}
+			if (rres[k] == 0) {
+				errno = EIO;	/* firmware shrank under us */
+				return -1;
+			}
+			if (rres[k] > 0) {
+				ret = transport_write_all(port, ring_buf +
+							  (k % URING_BUFS) *
+							  ring_chunk, rres[k],
+							  &sent);
+				*off += sent;
+				if (ret)
+					return -1;
+			}
+			break;
+		}
 	}
+	return 0;
+}
+
+/*
+ * Writing a ready-made frame and qdl_server_wait_response() on the ring:
+ * the frame write, the first read and its timeout are one linked
+ * submission. Without data this only waits for the response.
+ */
+static int qdl_uring_command(int fd, const char *data, int len, char code,
+			     int timeout) {
+	struct hdlc_decoder dec;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe cqe;
+	struct __kernel_timespec ts;
+	uint8_t frame[64];
+	uint8_t buff[64];
+	long long deadline = monotonic_ms() + timeout;
+	long long left;
+	size_t cnt = data ? len : 0;
+	int rres, wres, pending, ret;
+
+	hdlc_decoder_init(&dec, frame, sizeof(frame));
+
+	for (;;) {
+		left = deadline - monotonic_ms();
+		if (left <= 0) {
+			die("Timeout waiting for response");
+			return 4;
+		}
+
+		pending = 0;
+		wres = -ECANCELED;
+		if (cnt) {
+			sqe = uring_sqe(&ring);
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t)data;
+			sqe->len = cnt;
+			sqe->off = (uint64_t)-1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = URING_TAG(0, TAG_WRITE);
+			pending++;
+		}
 
-	if(buff[1] != code) {
-		die("Invalid response Code");
-		return 3;
+		sqe = uring_sqe(&ring);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buff;
+		sqe->len = sizeof(buff);
+		sqe->off = (uint64_t)-1;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = URING_TAG(0, TAG_READ);
+
+		ts.tv_sec = left / 1000;
+		ts.tv_nsec = (left % 1000) * 1000000;
+		sqe = uring_sqe(&ring);
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (uintptr_t)&ts;
+		sqe->len = 1;
+		sqe->user_data = URING_TAG(0, TAG_TIMEOUT);
+		pending += 2;
+
+		if (uring_submit(&ring, 0) < 0) {
+			die("Failed to submit to io_uring");
+			return -1;
+		}
+		rres = -ECANCELED;
+		while (pending--) {
+			if (uring_wait(&ring, &cqe)) {
+				die("Failed to wait for io_uring");
+				return -1;
+			}
+			if ((cqe.user_data & 3) == TAG_READ)
+				rres = cqe.res;
+			else if ((cqe.user_data & 3) == TAG_WRITE)
+				wres = cqe.res;
+			if (cqe.res > 0 && (cqe.user_data & 3) == TAG_READ)
+				io_account(0, 0, cqe.res);
+			else if (cqe.res > 0 && (cqe.user_data & 3) == TAG_WRITE)
+				io_account(0, cqe.res, 0);
+		}
+
+		if (cnt) {
+			if (wres != (int)cnt) {
+				die("Failed to send request");
+				return -1;
+			}
+			trace_tx(data, cnt);
+			cnt = 0;
+		}
+
+		/* cancelled by the link timeout; the deadline check decides */
+		if (rres == -ECANCELED || rres == -EINTR || rres == -EAGAIN)
+			continue;
+		if (rres <= 0) {
+			die("Serial device closed");
+			return -1;
+		}
+
+		ret = qdl_response_feed(&dec, buff, rres, code);
+		if (ret != RESP_MORE)
+			return ret;
 	}
+}
 
-	/* check crc? */
+/* send a command frame and wait for its response */
+static int qdl_command(struct transport *port, const uint8_t *frame,
+		       size_t len, char code, int timeout) {
+	if (xfer_mode == XFER_URING && port->stream && !qdl_uring_setup())
+		return qdl_uring_command(port->fd, (const char *)frame, len,
+					 code, timeout);
+	if (qdl_server_send_request(port, (const char *)frame, len,
+				    DATA_FRAMED))
+		return -1;
+	return qdl_server_wait_response(port, code, timeout);
+}
 
-	return 0;
+static int qdl_wait(struct transport *port, char code, int timeout) {
+	if (xfer_mode == XFER_URING && port->stream && !qdl_uring_setup())
+		return qdl_uring_command(port->fd, NULL, 0, code, timeout);
+	return qdl_server_wait_response(port, code, timeout);
 }
 
-#define FW_SIZE_PER_PACKAGE		(256*1024)
-int main(int argc, char **argv) {	
-	int serialfd;
-	int fwfd;
-	int len;
-	int err;
-	int gobi2000 = 0;
-	struct termios terminal_data;
-	struct stat file_data;
-	char *fwdata = malloc(FW_SIZE_PER_PACKAGE);
+static int stream_range(struct transport *port, int fwfd, struct unpack *z,
+			struct verify *v, off_t *off, off_t len) {
+	int mode = xfer_mode;
+
+	/*
+	 * unpacking and hashing need a thread of their own to keep up with
+	 * the link, and a link that isn't a file descriptor only takes the
+	 * pipeline's writes
+	 */
+	if (!port->stream)
+		mode = XFER_PIPELINE;
+	if (z || v) {
+		if (pipeline_stream_from(port, v ? verify_pread : unpack_pread,
+					 v ? (void *)v : z, off, len,
+					 xfer_chunk, pipeline_depth,
+					 &pipeline_stats))
+			return -1;
+		return XFER_PIPELINE;
+	}
 
-	if (argc < 3 || argc > 4) {
-		usage(argv);
-		return -1;
+	if (mode == XFER_URING) {
+		if (!stream_uring(port, fwfd, off, len))
+			return XFER_URING;
+		if (!xfer_unsupported(errno) && errno != EPERM)
+			return -1;
+		mode = XFER_SENDFILE;
 	}
 
-	if (!fwdata) {
-		fprintf(stderr, "Failed to allocate memory for firmware\n");
-		return -1;
+	if (mode == XFER_PIPELINE) {
+		if (pipeline_stream(port, fwfd, off, len, xfer_chunk,
+				    pipeline_depth, &pipeline_stats))
+			return -1;
+		return XFER_PIPELINE;
 	}
 
-	if (argc == 4) {
-		if (!strcmp(argv[1], "-2000")) {
-			gobi2000=1;
-			magic1[33]++;
-			magic1[34]++;
-		} else {
-			usage(argv);
+	if (mode == XFER_SENDFILE) {
+		/*
+		 * sendfile takes the data from the file, not a buffer, so the
+		 * first chunk is read into one to go out in the same writev()
+		 * as the held header; that pread stands in for one sendfile
+		 */
+		if (port->held_len &&
+		    stream_buffered(port, fwfd, off, *off + xfer_chunk < len ?
+						     *off + xfer_chunk : len))
+			return -1;
+		if (!stream_sendfile(port, fwfd, off, len))
+			return XFER_SENDFILE;
+		if (!xfer_unsupported(errno))
+			return -1;
+		mode = XFER_MMAP;
+	}
+
+	if (mode == XFER_MMAP) {
+		if (!stream_mmap(port, fwfd, off, len))
+			return XFER_MMAP;
+		if (!xfer_unsupported(errno))
+			return -1;
+		mode = XFER_BUFFERED;
+	}
+
+	if (!stream_buffered(port, fwfd, off, len))
+		return XFER_BUFFERED;
+	return -1;
+}
+
+/*
+ * Send bytes *off..len-1 of fwfd to the serial device, advancing *off as
+ * data goes out; with z set, the offsets are in the image z unpacks from
+ * fwfd. With v set, the image is hashed on the way and its last chunk
+ * isn't sent unless it matches. Returns the transfer path that completed
+ * the range, or -1 on error with *off at the first byte not sent.
+ */
+static int qdl_stream_range(struct transport *port, int fwfd, struct unpack *z,
+			    struct verify *v, off_t *off, off_t len) {
+	int flags = -1;
+	int ret, err;
+
+	if (xfer_write == TUNE_WRITE_POLL && xfer_mode <= XFER_BUFFERED && !z &&
+	    !v && port->stream) {
+		flags = fcntl(port->fd, F_GETFL);
+		if (flags != -1)
+			fcntl(port->fd, F_SETFL, flags | O_NONBLOCK);
+	}
+	ret = stream_range(port, fwfd, z, v, off, len);
+	/* an empty range leaves the header held */
+	if (ret >= 0 && transport_flush_held(port))
+		ret = -1;
+	if (flags != -1) {
+		err = errno;
+		fcntl(port->fd, F_SETFL, flags);
+		errno = err;
+	}
+	return ret;
+}
+
+static const size_t tune_chunks[] = {
+	16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+};
+#define TUNE_TRIALS \
+	(sizeof(tune_chunks) / sizeof(tune_chunks[0]) * TUNE_WRITE_MODES)
+
+/*
+ * -tune: send the image in equal slices, each with a different chunk size
+ * and write strategy, and time every slice up to the point the device has
+ * taken all of it. The remainder goes out with the fastest setting, which
+ * is returned in best.
+ */
+static int qdl_tune_image(struct transport *port, int fwfd, struct unpack *z,
+			  struct verify *v, off_t *off, off_t len,
+			  struct tune *best) {
+	off_t slice = (len - *off) / (TUNE_TRIALS + 1);
+	long long t;
+	double rate;
+	unsigned c;
+	int w;
+
+	best->chunk = xfer_chunk;
+	best->write = xfer_write;
+	best->rate = 0;
+
+	for (c = 0; c < TUNE_TRIALS / TUNE_WRITE_MODES; c++) {
+		if (tune_chunks[c] > TUNE_CHUNK_MAX)
+			break;
+		for (w = 0; w < TUNE_WRITE_MODES; w++) {
+			xfer_chunk = tune_chunks[c];
+			xfer_write = w;
+			t = monotonic_us();
+			if (qdl_stream_range(port, fwfd, z, v, off,
+					     *off + slice) < 0)
+				return -1;
+			port->ops->drain(port);
+			t = monotonic_us() - t;
+			rate = slice * 1e6 / (t > 0 ? t : 1);
+			printf("QDL tune chunk=%zu write=%s %.0f B/s\n",
+			       xfer_chunk, tune_write_names[w], rate);
+			if (rate > best->rate) {
+				best->chunk = xfer_chunk;
+				best->write = w;
+				best->rate = rate;
+			}
 		}
 	}
 
-	serialfd = open(argv[argc-2], O_RDWR);
+	xfer_chunk = best->chunk;
+	xfer_write = best->write;
+	return qdl_stream_range(port, fwfd, z, v, off, len);
+}
 
-	if (serialfd == -1) {
-		perror("Failed to open serial device: ");
-		usage(argv);
+/*
+ * Failed stages are retried while the device is still attached, with a
+ * growing pause in between. Once the retries of a stage are used up the
+ * device gets a fresh hello: if it answers, it has gone back to the start
+ * of the protocol and the whole load is run again (QDL_RESTART). A hung up
+ * tty means the device re-enumerated and udev starts a new loader for it.
+ */
+#define QDL_RESTART	1
+
+#define STAGE_OPEN	0
+#define STAGE_STREAM	1
+#define STAGE_ACK	2
+
+static const char *stage_names[] = {"open", "stream", "ack"};
+int qdl_retries = 3;
+int qdl_restarts = 1;
+
+/* set while the images of a firmware directory with a manifest load */
+static int verifying;
+static struct verify verify[QDL_MAX_IMAGES];
+
+/* back off before the next attempt; -1 if there shouldn't be one */
+static int qdl_retry(struct transport *port, int *attempt, int *backoff,
+		     const char *what, const char *name) {
+	if (port->ops->gone(port)) {
+		die("Device went away");
 		return -1;
 	}
-
-	err = chdir(argv[argc-1]);
-	if (err) {
-		perror("Failed to change directory: ");
-		usage(argv);
+	if (++*attempt > qdl_retries)
 		return -1;
+	printf("QDL %s%s%s: retry %d/%d in %d ms\n", what, name ? " " : "",
+	       name ? name : "", *attempt, qdl_retries, *backoff);
+	metrics_phase("backoff", name);
+	usleep(*backoff * 1000);
+	*backoff *= 2;
+	/* drop whatever answered the failed try */
+	port->ops->flush(port, TCIFLUSH);
+	return 0;
+}
+
+static int qdl_hello(struct transport *port, const struct bundle_header *fw) {
+	char ack = qdl_variants[fw->variant].hello_ack;
+	int attempt = 0, backoff = RETRY_BACKOFF;
+
+	for (;;) {
+		metrics_phase("hello", NULL);
+		if (!qdl_command(port, fw->hello, fw->hello_len, ack,
+				 TIMEOUT_HELLO))
+			return 0;
+		if (qdl_retry(port, &attempt, &backoff, "hello", NULL))
+			return -1;
 	}
+}
 
-	fwfd = open("amss.mbn", O_RDONLY);
+/*
+ * One stage: open command, raw header, image data and the done_ack the
+ * device sends once it has checked the data. An interrupted stream
+ * resumes where it stopped; any other failure opens the image again,
+ * except for an image that doesn't match the manifest. tuned is only set
+ * for the image -tune runs its trials on.
+ */
+static int qdl_send_image(struct transport *port, int fwfd, struct unpack *z,
+			  struct verify *check, const struct bundle_header *fw,
+			  int image, struct tune *tuned) {
+	const struct qdl_variant *v = &qdl_variants[fw->variant];
+	const struct qdl_stage *s = &v->stages[image];
+	const struct bundle_image *img = &fw->img[image];
+	const char *name = img->name;
+	off_t start = z ? 0 : img->offset;
+	off_t end = start + img->size;
+	int stage = STAGE_OPEN;
+	int attempt = 0, backoff = RETRY_BACKOFF;
+	int xfer;
+	off_t off = start, from;
+
+	for (;;) {
+		if (stage == STAGE_OPEN) {
+			metrics_phase("open", name);
+			if (qdl_command(port, img->open, img->open_len,
+					s->open_ack, TIMEOUT_OPEN))
+				goto failed;
+			metrics_phase("stream", name);
+			/* goes out with the first chunk */
+			transport_hold(port, img->header, sizeof(img->header));
+			off = start;
+			stage = STAGE_STREAM;
+		} else if (stage == STAGE_STREAM) {
+			metrics_phase("stream", name);
+		}
 
-	if (fwfd == -1) {
-		perror("Failed to open firmware: ");
-		usage(argv);
-		return -1;
+		if (stage == STAGE_STREAM) {
+			from = off;
+			if (tuned && off == start)
+				xfer = qdl_tune_image(port, fwfd, z, check,
+						      &off, end, tuned);
+			else
+				xfer = qdl_stream_range(port, fwfd, z, check,
+							&off, end);
+			trace_data(off - from);
+			if (xfer < 0 && check && check->state == VERIFY_BAD) {
+				fprintf(stderr, "[QDL ERROR]: %s does not "
+					"match %s, stopped before its last "
+					"chunk\n", name, VERIFY_MANIFEST);
+				transport_hold(port, NULL, 0);
+				return -1;
+			}
+			if (xfer < 0) {
+				perror("Failed to send firmware: ");
+				goto failed;
+			}
+			last_xfer = xfer;
+			stage = STAGE_ACK;
+		}
+
+		metrics_phase("ack", name);
+		if (!qdl_wait(port, s->done_ack, TIMEOUT_IMAGE)) {
+			printf("QDL %s finish (%s%s%s%s)\n", name,
+			       xfer_names[xfer], z ? ", " : "",
+			       z ? unpack_names[img->codec] : "",
+			       check ? ", sha256 ok" : "");
+			if (xfer == XFER_PIPELINE)
+				pipeline_report(stdout, &pipeline_stats);
+			return 0;
+		}
+failed:
+		if (qdl_retry(port, &attempt, &backoff, stage_names[stage],
+			      name)) {
+			transport_hold(port, NULL, 0);
+			if (attempt <= qdl_retries)
+				return -1;
+			metrics_phase("probe", NULL);
+			port->ops->flush(port, TCIOFLUSH);
+			if (qdl_command(port, fw->hello, fw->hello_len,
+					v->hello_ack, TIMEOUT_HELLO))
+				return -1;
+			return QDL_RESTART;
+		}
+		if (stage == STAGE_ACK)
+			stage = STAGE_OPEN;	/* rejected or lost, send it again */
 	}
+}
+
+/*
+ * a compressed image is unpacked on the fly while it streams, and one in
+ * the manifest hashed
+ */
+static int qdl_image(struct transport *port, int fwfd,
+		     const struct bundle_header *fw, int image, struct tune *tuned) {
+	const struct bundle_image *img = &fw->img[image];
+	struct unpack *z = NULL;
+	struct verify *check = verifying ? &verify[image] : NULL;
+	int ret;
+
+	if (img->codec != UNPACK_RAW) {
+		z = unpack_open(fwfd, img->offset, img->stored, img->codec);
+		if (!z) {
+			perror("Failed to unpack firmware: ");
+			return -1;
+		}
+	}
+	if (check)
+		verify_start(check, z ? unpack_pread : pipeline_pread,
+			     z ? (void *)z : &fwfd, z ? 0 : img->offset,
+			     img->size,
+			     qdl_variants[fw->variant].stages[image].trim);
+	ret = qdl_send_image(port, fwfd, z, check, fw, image, tuned);
+	unpack_close(z);
+	return ret;
+}
 
-	fstat(fwfd, &file_data);
-	*(int32_t *)&magic2[2] = SWAPL32(file_data.st_size - 8);
-	*(int32_t *)&magic3[7] = SWAPL32(file_data.st_size - 8);
+/*
+ * The stages of the variant, in order. -tune runs its trials on the first
+ * stage, which carries the main (largest) image.
+ */
+static int qdl_load_images(struct transport *port,
+			   const struct bundle_header *fw,
+			   const int fds[QDL_MAX_IMAGES], struct tune *tuned) {
+	int i;
+	int ret;
 
-	tcgetattr (serialfd, &terminal_data);
-	cfmakeraw (&terminal_data);
-	tcsetattr (serialfd, TCSANOW, &terminal_data);
+	if (qdl_hello(port, fw))
+		return -1;
 
-	qdl_server_send_request(serialfd, magic1, sizeof(magic1), DATA_ENCODE);
-	qdl_server_wait_response(serialfd, 0x02);
+	for (i = 0; i < fw->nimages; i++) {
+		ret = qdl_image(port, fds[i], fw, i,
+				tune && !i ? tuned : NULL);
+		if (ret)
+			return ret;
+
+		if (tune && !i) {
+			printf("QDL %04x:%04x best chunk=%zu write=%s %.0f B/s\n",
+			       tuned->vid, tuned->pid, tuned->chunk,
+			       tune_write_names[tuned->write], tuned->rate);
+			if (tune_save(tunefile, tuned))
+				perror("Failed to save tuning: ");
+		}
+	}
 
-	qdl_server_send_request(serialfd, magic2, sizeof(magic2), DATA_ENCODE);
-	qdl_server_wait_response(serialfd, 0x26);
-	qdl_server_send_request(serialfd, magic3, sizeof(magic3), DATA_NOENCODE);
+	metrics_phase("reset", NULL);
+	if (qdl_server_send_request(port, (const char *)fw->reset,
+				    fw->reset_len, DATA_FRAMED))
+		return -1;
+	printf("QDL success\n");
 
-	while (1) {
-		len = read (fwfd, fwdata, FW_SIZE_PER_PACKAGE);
-		if (len == FW_SIZE_PER_PACKAGE)
-			write (serialfd, fwdata, FW_SIZE_PER_PACKAGE);
-		else {
-			write (serialfd, fwdata, len-8);
-			break;
+	return 0;
+}
+
+/*
+ * fwpath is either a firmware directory or a bundle from "pack"; both end
+ * up as a bundle header with the command frames and one image fd each.
+ * A directory with a manifest has its images checked against it.
+ */
+static int qdl_open_firmware(const char *fwpath, int variant,
+			     struct bundle_header *fw, int fds[QDL_MAX_IMAGES]) {
+	struct stat st;
+	int fd, i, ret = 1;
+
+	verifying = 0;
+	if (stat(fwpath, &st) || !S_ISREG(st.st_mode)) {
+		if (bundle_build(fwpath, variant, fw, fds))
+			return -1;
+		for (i = 0; i < fw->nimages && ret > 0; i++)
+			ret = verify_lookup(fwpath,
+					    &qdl_variants[variant].stages[i],
+					    verify[i].want);
+		if (ret < 0) {
+			for (i = 0; i < fw->nimages; i++)
+				close(fds[i]);
+			return -1;
 		}
-		write (serialfd, fwdata, 0);
+		verifying = ret > 0;
+		return 0;
 	}
-	qdl_server_wait_response(serialfd, 0x28);
-	printf("QDL amss.mbn finish\n");
 
-	fwfd = open("apps.mbn", O_RDONLY);
+	fd = bundle_open(fwpath, fw);
+	if (fd == -1) {
+		perror("Failed to open firmware bundle: ");
+		return -1;
+	}
+	if (fw->variant != variant) {
+		fprintf(stderr, "[QDL ERROR]: %s was packed for %s\n", fwpath,
+			qdl_variants[fw->variant].name);
+		close(fd);
+		return -1;
+	}
+	for (i = 0; i < fw->nimages; i++)
+		fds[i] = fd;
+	return 0;
+}
+
+static void qdl_close_firmware(const struct bundle_header *fw,
+			       int fds[QDL_MAX_IMAGES]) {
+	int i;
+
+	for (i = 0; i < fw->nimages; i++)
+		if (!i || fds[i] != fds[i - 1])	/* a bundle is one fd */
+			close(fds[i]);
+}
 
-	if (fwfd == -1) {
-		perror("Failed to open secondary firmware: ");
+/*
+ * Load the firmware in fwdir, a directory or a bundle, into the device
+ * behind dev. Every phase is announced to the metrics code; returns 0 on
+ * success, -1 on any error.
+ */
+static int qdl_load(char **argv, int variant, const char *dev,
+		    const char *fwdir) {
+	struct transport port;
+	int ret;
+	int restart;
+	int fds[QDL_MAX_IMAGES];
+	struct bundle_header fw;
+	struct tune tuned = { 0 };
+
+	/* before usbfs takes the interface and the tty goes away */
+	devdb_device_id(dev, &tuned.vid, &tuned.pid, NULL);
+
+	if (transport_open(&port, transport, dev)) {
+		perror("Failed to open serial device: ");
 		usage(argv);
 		return -1;
 	}
 
-	fstat(fwfd, &file_data);
-	*(int32_t *)&magic4[2] = SWAPL32(file_data.st_size);
-	*(int32_t *)&magic5[7] = SWAPL32(file_data.st_size);
+	/* settings from an earlier -tune run for this device model */
+	if (!tune && !tune_fixed && !tune_load(tunefile, &tuned)) {
+		xfer_chunk = tuned.chunk;
+		xfer_write = tuned.write;
+		printf("QDL %04x:%04x tuned chunk=%zu write=%s\n", tuned.vid,
+		       tuned.pid, xfer_chunk, tune_write_names[xfer_write]);
+	}
 
-	qdl_server_send_request(serialfd, magic4, sizeof(magic4), DATA_ENCODE);
-	qdl_server_wait_response(serialfd, 0x26);
-	qdl_server_send_request(serialfd, magic5, sizeof(magic5), DATA_NOENCODE);
+	if (qdl_open_firmware(fwdir, variant, &fw, fds)) {
+		port.ops->close(&port);
+		usage(argv);
+		return -1;
+	}
 
-	while (1) {
-		len = read (fwfd, fwdata, FW_SIZE_PER_PACKAGE);
-		if (len == FW_SIZE_PER_PACKAGE)
-			write (serialfd, fwdata, FW_SIZE_PER_PACKAGE);
-		else {
-			write (serialfd, fwdata, len);
+	for (restart = 0;; restart++) {
+		ret = qdl_load_images(&port, &fw, fds, &tuned);
+		if (ret != QDL_RESTART)
 			break;
+		if (restart == qdl_restarts) {
+			die("Device keeps resetting");
+			ret = -1;
+			break;
+		}
+		printf("QDL device reset, restarting load %d/%d\n",
+		       restart + 1, qdl_restarts);
+	}
+	qdl_close_firmware(&fw, fds);
+	port.ops->close(&port);
+	return ret;
+}
+
+/*
+ * Look dev up in the device database. A known device supplies the variant
+ * unless one was given and, if fwdir is NULL, its firmware set below
+ * fwroot, or fwroot itself if the set isn't installed separately. Returns
+ * 0, or 1 for an unknown device without fwdir: udev runs the loader for every
+ * ttyUSB, including other serial adapters and the modem's own ttys, and
+ * those are quietly left alone.
+ */
+int qdl_identify(const char *dev, int *variant, int variant_set,
+		 const char *fwroot, const char **fwdir, char *buf, size_t len) {
+	const struct devdb_entry *e = NULL;
+	uint16_t vid, pid;
+	struct stat st;
+
+	if (!devdb_device_id(dev, &vid, &pid, NULL))
+		e = devdb_lookup(vid, pid);
+	if (!e)
+		return *fwdir ? 0 : 1;
+
+	if (!variant_set)
+		*variant = e->variant;
+	if (!*fwdir) {
+		*fwdir = fwroot;
+		if (e->firmware) {
+			snprintf(buf, len, "%s/%s", fwroot, e->firmware);
+			if (!stat(buf, &st) && S_ISDIR(st.st_mode))
+				*fwdir = buf;
 		}
-		write (serialfd, fwdata, 0);
 	}
-	qdl_server_wait_response(serialfd, 0x28);
-	printf("QDL apps.mbn finish\n");
+	printf("QDL %04x:%04x %s, %s from %s\n", vid, pid, e->name,
+	       qdl_variants[*variant].name, *fwdir);
+	return 0;
+}
 
-	if (gobi2000) {
-		fwfd = open("UQCN.mbn", O_RDONLY);
+/* an option's number, all of arg and from min to max; -1 if it isn't */
+static int parse_num(const char *arg, long long min, long long max,
+		     long long *val) {
+	char *end;
 
-		if (fwfd == -1)
-			fwfd = open("uqcn.mbn", O_RDONLY);
+	errno = 0;
+	*val = strtoll(arg, &end, 0);
+	if (errno || end == arg || *end || *val < min || *val > max)
+		return -1;
+	return 0;
+}
+
+/*
+ * Wait for the device loaded since start to come back as a modem and
+ * report how long the load and the re-enumeration took.
+ */
+static int qdl_wait_modem(struct modem *m, long long start, int timeout) {
+	int ret = modem_wait(m, timeout * 1000);
+	long long now = monotonic_ms();
+
+	if (ret)
+		fprintf(stderr, "[QDL ERROR]: %s within %d s of the reset\n",
+			m->usb_ms ? "no modem tty" : "modem did not enumerate",
+			timeout);
+	else
+		printf("QDL modem %04x:%04x ready (%s): load %.2f s, "
+		       "re-enumeration %.2f s (usb %.2f s), total %.2f s\n",
+		       m->vid, m->pid, m->ifaces,
+		       (m->reset_ms - start) / 1000.0,
+		       (now - m->reset_ms) / 1000.0,
+		       (m->usb_ms - m->reset_ms) / 1000.0,
+		       (now - start) / 1000.0);
+	return ret;
+}
 
-		if (fwfd == -1) {
-			perror("Failed to open tertiary firmware: ");
+int main(int argc, char **argv) {
+	int i;
+	int ret;
+	long wait_modem = 0;
+	long long start;
+	struct modem modem;
+	int variant = QDL_GOBI1000;
+	int variant_set = 0;
+	int daemon_mode = 0;
+	int uevents = 0;
+	int submit = 0;
+	const char *sockpath = GOBI_SOCKET;
+	const char *cachedir = NULL;
+	const char *metricsfile = NULL;
+	const char *tracefile = NULL;
+	int trace_elide = 0;
+	const char *fwroot = GOBI_FIRMWARE;
+	const char *dev, *fwdir;
+	char fwpath[PATH_MAX];
+	unsigned long long cachemax = 0;
+	long long num;
+	struct store_stats imported;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-2000")) {
+			variant = QDL_GOBI2000;
+			variant_set = 1;
+		} else if (!strcmp(argv[i], "-variant") && i + 1 < argc) {
+			variant = qdl_variant_find(argv[++i]);
+			if (variant < 0) {
+				usage(argv);
+				return -1;
+			}
+			variant_set = 1;
+		} else if (!strcmp(argv[i], "-firmware-root") && i + 1 < argc) {
+			fwroot = argv[++i];
+		} else if (!strcmp(argv[i], "-devices")) {
+			devdb_list(stdout);
+			return 0;
+		} else if (!strcmp(argv[i], "-transfer") && i + 1 < argc) {
+			i++;
+			for (xfer_mode = 0; xfer_mode <= XFER_URING; xfer_mode++)
+				if (!strcmp(argv[i], xfer_names[xfer_mode]))
+					break;
+			if (xfer_mode > XFER_URING) {
+				usage(argv);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "-transport") && i + 1 < argc) {
+			transport = transport_find(argv[++i]);
+			if (transport < 0) {
+				usage(argv);
+				return -1;
+			}
+		} else if (!strcmp(argv[i], "-chunk") && i + 1 < argc) {
+			if (parse_num(argv[++i], TUNE_CHUNK_MIN, TUNE_CHUNK_MAX,
+				      &num)) {
+				usage(argv);
+				return -1;
+			}
+			xfer_chunk = num;
+			tune_fixed = 1;
+		} else if (!strcmp(argv[i], "-write") && i + 1 < argc) {
+			xfer_write = tune_write_mode(argv[++i]);
+			if (xfer_write < 0) {
+				usage(argv);
+				return -1;
+			}
+			tune_fixed = 1;
+		} else if (!strcmp(argv[i], "-tune")) {
+			tune = 1;
+		} else if (!strcmp(argv[i], "-tune-file") && i + 1 < argc) {
+			tunefile = argv[++i];
+		} else if (!strcmp(argv[i], "-retries") && i + 1 < argc) {
+			if (parse_num(argv[++i], 0, RETRY_MAX, &num)) {
+				usage(argv);
+				return -1;
+			}
+			qdl_retries = num;
+		} else if (!strcmp(argv[i], "-restarts") && i + 1 < argc) {
+			if (parse_num(argv[++i], 0, RETRY_MAX, &num)) {
+				usage(argv);
+				return -1;
+			}
+			qdl_restarts = num;
+		} else if (!strcmp(argv[i], "-metrics") && i + 1 < argc) {
+			metricsfile = argv[++i];
+		} else if (!strcmp(argv[i], "-trace") && i + 1 < argc) {
+			tracefile = argv[++i];
+		} else if (!strcmp(argv[i], "-trace-elide")) {
+			trace_elide = 1;
+		} else if (!strcmp(argv[i], "-wait-modem") && i + 1 < argc) {
+			if (parse_num(argv[++i], 1, MODEM_WAIT_MAX, &num)) {
+				usage(argv);
+				return -1;
+			}
+			wait_modem = num;
+		} else if (!strcmp(argv[i], "-depth") && i + 1 < argc) {
+			if (parse_num(argv[++i], 2, PIPELINE_DEPTH_MAX, &num)) {
+				usage(argv);
+				return -1;
+			}
+			pipeline_depth = num;
+		} else if (!strcmp(argv[i], "-daemon")) {
+			daemon_mode = 1;
+		} else if (!strcmp(argv[i], "-uevent")) {
+			daemon_mode = uevents = 1;
+		} else if (!strcmp(argv[i], "-submit")) {
+			submit = 1;
+		} else if (!strcmp(argv[i], "-socket") && i + 1 < argc) {
+			sockpath = argv[++i];
+		} else if (!strcmp(argv[i], "-cache") && i + 1 < argc) {
+			cachedir = argv[++i];
+		} else if (!strcmp(argv[i], "-cache-max") && i + 1 < argc) {
+			if (parse_num(argv[++i], 1, LLONG_MAX, &num)) {
+				usage(argv);
+				return -1;
+			}
+			cachemax = num;
+		} else if (!strcmp(argv[i], "-store") && i + 1 < argc) {
+			store_init(argv[++i]);
+		} else {
 			usage(argv);
 			return -1;
 		}
+	}
 
-		fstat(fwfd, &file_data);
-		*(int32_t *)&magic6[2] = SWAPL32(file_data.st_size);
-		*(int32_t *)&magic7[7] = SWAPL32(file_data.st_size);
+	if (cachedir)
+		fwcache_init(cachedir, cachemax);
 
-		qdl_server_send_request(serialfd, magic6, sizeof(magic6), DATA_ENCODE);
-		qdl_server_wait_response(serialfd, 0x26);
-		qdl_server_send_request(serialfd, magic7, sizeof(magic7), DATA_NOENCODE);
+	if (argc - i == 3 && !strcmp(argv[i], "pack")) {
+		if (bundle_pack(argv[i + 1], variant, argv[i + 2])) {
+			perror("Failed to pack firmware: ");
+			return -1;
+		}
+		return 0;
+	}
 
-		while (1) {
-			len = read (fwfd, fwdata, FW_SIZE_PER_PACKAGE);
-			if (len == FW_SIZE_PER_PACKAGE)
-				write (serialfd, fwdata, FW_SIZE_PER_PACKAGE);
-			else {
-				write (serialfd, fwdata, len);
-				break;
-			}
-			write (serialfd, fwdata, 0);
+	if (argc - i == 3 && !strcmp(argv[i], "import")) {
+		if (store_import(argv[i + 1], argv[i + 2], &imported))
+			return -1;
+		printf("QDL imported %u files, %llu bytes in %llu chunks; "
+		       "%llu chunks, %llu bytes new\n", imported.files,
+		       (unsigned long long)imported.bytes,
+		       (unsigned long long)imported.chunks,
+		       (unsigned long long)imported.new_chunks,
+		       (unsigned long long)imported.new_bytes);
+		return 0;
+	}
+
+	if (argc - i == 2 && !strcmp(argv[i], "manifest")) {
+		if (verify_write_manifest(argv[i + 1], variant)) {
+			perror("Failed to write manifest: ");
+			return -1;
 		}
-		qdl_server_wait_response(serialfd, 0x28);
-		printf("QDL uqcn.mbn finish\n");
+		return 0;
 	}
 
-	qdl_server_send_request(serialfd, magic8, sizeof(magic8), DATA_ENCODE);
-	printf("QDL success\n");
+	if (argc - i == 2 && !strcmp(argv[i], "verify"))
+		return verify_tree(argv[i + 1]);
 
-	return 0;
+	if (daemon_mode) {
+		if (i != argc) {
+			usage(argv);
+			return -1;
+		}
+		return qdl_daemon(sockpath, fwroot, uevents);
+	}
+
+	if (argc - i != 1 && argc - i != 2) {
+		usage(argv);
+		return -1;
+	}
+	dev = argv[i];
+	fwdir = argc - i == 2 ? argv[i + 1] : NULL;
+	if (qdl_identify(dev, &variant, variant_set, fwroot, &fwdir, fwpath,
+			 sizeof(fwpath)))
+		return 0;	/* not a Gobi device */
+
+	if (submit)
+		return qdl_submit(sockpath, variant, dev, fwdir);
+
+	/* the port the device is on, while it is still there */
+	if (wait_modem && modem_watch(&modem, dev)) {
+		fprintf(stderr, "[QDL ERROR]: -wait-modem: no USB device "
+			"behind %s\n", dev);
+		return -1;
+	}
+	if (tracefile && trace_open(tracefile, trace_elide)) {
+		perror("Failed to open trace: ");
+		return -1;
+	}
+	metrics_start(dev, fwdir, qdl_variants[variant].name);
+	start = monotonic_ms();
+	ret = qdl_load(argv, variant, dev, fwdir);
+	if (wait_modem && !ret)
+		ret = qdl_wait_modem(&modem, start, wait_modem);
+	if (wait_modem)
+		modem_close(&modem);
+	trace_close();
+	metrics_end(ret, xfer_names[last_xfer >= 0 ? last_xfer : xfer_mode]);
+	printf("QDL %llu syscalls, %llu bytes out, %llu in\n",
+	       (unsigned long long)qdl_io.syscalls,
+	       (unsigned long long)qdl_io.tx, (unsigned long long)qdl_io.rx);
+	if (metricsfile && metrics_write(metricsfile))
+		perror("Failed to write metrics: ");
+
+	return ret;
 }
@@ -0,0 +1,115 @@
+/* Shared definitions for the gobi_loader protocol code and daemon */
+
+#ifndef GOBI_LOADER_H
+#define GOBI_LOADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <endian.h>
+
+#if defined(BYTE_ORDER) && !defined(__BYTE_ORDER)
+#define __LITTLE_ENDIAN LITTLE_ENDIAN
+#define __BIG_ENDIAN BIG_ENDIAN
+#define __BYTE_ORDER BYTE_ORDER
+#endif
+
+#ifndef __BYTE_ORDER
+#error Unknown endian type
+#endif
+
+static inline uint16_t __swab16(uint16_t x)
+{
+	return x<<8 | x>>8;
+}
+
+static inline uint32_t __swab32(uint32_t x)
+{
+	return x<<24 | x>>24 |
+		(x & (uint32_t)0x0000ff00UL)<<8 |
+		(x & (uint32_t)0x00ff0000UL)>>8;
+}
+
+static inline uint64_t __swab64(uint64_t x)
+{
+	return x<<56 | x>>56 |
+		(x & (uint64_t)0x000000000000ff00ULL)<<40 |
+		(x & (uint64_t)0x0000000000ff0000ULL)<<24 |
+		(x & (uint64_t)0x00000000ff000000ULL)<< 8 |
+		(x & (uint64_t)0x000000ff00000000ULL)>> 8 |
+		(x & (uint64_t)0x0000ff0000000000ULL)>>24 |
+		(x & (uint64_t)0x00ff000000000000ULL)>>40;
+}
+
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define SWAPL16(val) __swab16(val)
+#define SWAPL32(val) __swab32(val)
+#define SWAPL64(val) __swab64(val)
+#else
+#define SWAPL16(val) (val)
+#define SWAPL32(val) (val)
+#define SWAPL64(val) (val)
+#endif
+
+#define DATA_ENCODE	1	/* add 0x7e head/tail, do encode */
+#define DATA_NOENCODE	0	/* no 0x7e head/tail, no encode */
+#define DATA_FRAMED	2	/* already in wire form, CRC included */
+
+/* response deadlines, in milliseconds */
+#define TIMEOUT_HELLO	2000	/* hello_ack after the hello */
+#define TIMEOUT_OPEN	5000	/* open_ack after an open request */
+#define TIMEOUT_IMAGE	30000	/* done_ack after an image, includes flash writes */
+
+/* failed stages, see qdl_retry(); the daemon's sessions follow the same */
+#define RETRY_BACKOFF	200	/* ms before the first retry, doubled after */
+#define RETRY_MAX	10	/* for -retries and -restarts */
+extern int qdl_retries;		/* per stage */
+extern int qdl_restarts;	/* full loads after a device reset */
+
+#define QDL_MAX_IMAGES	3	/* stages of the largest variant */
+
+#define QDL_HEADER_LEN	13	/* raw header sent ahead of image data */
+
+#define GOBI_SOCKET	"/run/gobi_loader.sock"
+
+void die(const char *err);
+int write_all(int fd, const char *buf, size_t len);
+long long monotonic_ms(void);
+long long monotonic_us(void);
+
+size_t qdl_build_request(uint8_t *out, size_t outlen, const char *data,
+			 int len, char flag);
+size_t qdl_open_request(uint8_t *out, size_t outlen, uint8_t type,
+			uint32_t size);
+size_t qdl_image_header(uint8_t *out, size_t outlen, uint32_t size);
+
+struct transport;
+
+int qdl_server_send_request(struct transport *port, const char *data, int len,
+			    char flag);
+int qdl_server_wait_response(struct transport *port, char code, int timeout);
+
+int qdl_identify(const char *dev, int *variant, int variant_set,
+		 const char *fwroot, const char **fwdir, char *buf, size_t len);
+
+/* daemon.c; its sessions are allocated per device, so not without a heap */
+#ifdef STATIC_RING
+static inline int qdl_daemon(const char *sockpath, const char *fwroot,
+			     int uevents)
+{
+	die("No daemon in this build");
+	return -1;
+}
+static inline int qdl_submit(const char *sockpath, int variant,
+			     const char *dev, const char *fwdir)
+{
+	die("No daemon in this build");
+	return -1;
+}
+#else
+int qdl_daemon(const char *sockpath, const char *fwroot, int uevents);
+int qdl_submit(const char *sockpath, int variant, const char *dev,
+	       const char *fwdir);
+#endif
+
+#endif
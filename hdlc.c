@@ -0,0 +1,220 @@
+/* HDLC-like framing for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "hdlc.h"
+#include "crc_ccitt.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ *	hdlc_scan - find the next byte that needs escaping
+ *	@p: data pointer
+ *	@len: number of bytes to search
+ *
+ *	Returns the offset of the first 0x7e or 0x7d, or len if there is none.
+ *	Escapable bytes are rare in firmware data, so most of the time this
+ *	runs a whole frame at vector width.
+ */
+size_t hdlc_scan(const uint8_t *p, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i flag = _mm_set1_epi8(HDLC_FLAG);
+	const __m128i esc = _mm_set1_epi8(HDLC_ESC);
+	__m128i v;
+	int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag),
+						      _mm_cmpeq_epi8(v, esc)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	const uint8x16_t flag = vdupq_n_u8(HDLC_FLAG);
+	const uint8x16_t esc = vdupq_n_u8(HDLC_ESC);
+	uint8x16_t v;
+
+	for (; i + 16 <= len; i += 16) {
+		v = vld1q_u8(p + i);
+		if (vmaxvq_u8(vorrq_u8(vceqq_u8(v, flag), vceqq_u8(v, esc))))
+			break;
+	}
+#endif
+
+	for (; i < len; i++)
+		if (p[i] == HDLC_FLAG || p[i] == HDLC_ESC)
+			break;
+	return i;
+}
+
+static size_t escape(uint8_t *out, const uint8_t *in, size_t len)
+{
+	size_t n = 0, run;
+
+	while (len) {
+		run = hdlc_scan(in, len);
+		memcpy(out + n, in, run);
+		n += run;
+		in += run;
+		len -= run;
+		if (len) {
+			out[n++] = HDLC_ESC;
+			out[n++] = *in++ ^ HDLC_ESC_MASK;
+			len--;
+		}
+	}
+	return n;
+}
+
+static size_t escaped_len(const uint8_t *in, size_t len)
+{
+	size_t n = len, run;
+
+	while ((run = hdlc_scan(in, len)) < len) {
+		n++;
+		in += run + 1;
+		len -= run + 1;
+	}
+	return n;
+}
+
+/**
+ *	hdlc_encode - build a complete frame in one pass
+ *	@out: output buffer
+ *	@outlen: size of the output buffer, HDLC_ENCODED_MAX(len) always fits
+ *	@data: payload, without CRC
+ *	@len: payload length
+ *
+ *	Writes flag, escaped payload, escaped CRC and the closing flag.
+ *	Returns the number of bytes written, or 0 if out is too small.
+ */
+size_t hdlc_encode(uint8_t *out, size_t outlen, const void *data, size_t len)
+{
+	uint16_t crc = ~crc_ccitt(0xffff, data, len);
+	uint8_t tail[2] = { crc & 0xff, crc >> 8 };
+	size_t n = 0;
+
+	if (outlen < HDLC_ENCODED_MAX(len) &&
+	    outlen < 2 + escaped_len(data, len) + escaped_len(tail, 2))
+		return 0;
+
+	out[n++] = HDLC_FLAG;
+	n += escape(out + n, data, len);
+	n += escape(out + n, tail, 2);
+	out[n++] = HDLC_FLAG;
+	return n;
+}
+
+void hdlc_decoder_init(struct hdlc_decoder *d, uint8_t *buf, size_t size)
+{
+	d->buf = buf;
+	d->size = size;
+	d->len = 0;
+	d->escaped = 0;
+	d->overflow = 0;
+	d->done = 0;
+}
+
+/**
+ *	hdlc_decode - feed received bytes to the decoder
+ *	@d: decoder state
+ *	@in: received bytes
+ *	@len: number of received bytes
+ *	@consumed: set to the number of bytes used from in
+ *
+ *	Stops right after each closing flag so the caller can act on the frame
+ *	and then hand the rest of its buffer (which may be raw, unframed data)
+ *	to whoever owns it. Empty frames from back to back flags are skipped.
+ */
+int hdlc_decode(struct hdlc_decoder *d, const uint8_t *in, size_t len,
+		size_t *consumed)
+{
+	size_t i = 0, run, room;
+	int ret;
+
+	if (d->done) {
+		d->len = 0;
+		d->done = 0;
+	}
+
+	while (i < len) {
+		if (d->escaped) {
+			if (in[i] == HDLC_FLAG) {
+				/* aborted escape, let the flag end the frame */
+				d->escaped = 0;
+				continue;
+			}
+			if (d->len < d->size)
+				d->buf[d->len++] = in[i] ^ HDLC_ESC_MASK;
+			else
+				d->overflow = 1;
+			d->escaped = 0;
+			i++;
+			continue;
+		}
+
+		run = hdlc_scan(in + i, len - i);
+		room = d->size - d->len;
+		if (run > room) {
+			d->overflow = 1;
+			memcpy(d->buf + d->len, in + i, room);
+			d->len += room;
+		} else {
+			memcpy(d->buf + d->len, in + i, run);
+			d->len += run;
+		}
+		i += run;
+		if (i == len)
+			break;
+
+		if (in[i++] == HDLC_ESC) {
+			d->escaped = 1;
+			continue;
+		}
+
+		/* closing flag */
+		if (!d->len && !d->overflow)
+			continue;
+
+		if (d->overflow)
+			ret = HDLC_ERR_OVERFLOW;
+		else if (d->len < 3)
+			ret = HDLC_ERR_SHORT;
+		else if (crc_ccitt(0xffff, d->buf, d->len) != 0xf0b8)
+			ret = HDLC_ERR_CRC;
+		else
+			ret = HDLC_FRAME;
+
+		if (ret == HDLC_FRAME)
+			d->len -= 2;
+		d->overflow = 0;
+		d->done = 1;
+		*consumed = i;
+		return ret;
+	}
+
+	*consumed = i;
+	return HDLC_MORE;
+}
@@ -0,0 +1,39 @@
+/* HDLC-like framing (0x7e flags, 0x7d escapes, CRC-CCITT) used by QDL */
+
+#ifndef HDLC_H
+#define HDLC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HDLC_FLAG	0x7e
+#define HDLC_ESC	0x7d
+#define HDLC_ESC_MASK	0x20
+
+/* worst case size of an encoded frame carrying len payload bytes */
+#define HDLC_ENCODED_MAX(len)	(2 * ((len) + 2) + 2)
+
+size_t hdlc_scan(const uint8_t *p, size_t len);
+size_t hdlc_encode(uint8_t *out, size_t outlen, const void *data, size_t len);
+
+/* decoder results */
+#define HDLC_MORE	0	/* need more input */
+#define HDLC_FRAME	1	/* frame complete, see decoder buf/len */
+#define HDLC_ERR_CRC	-1	/* frame complete but its CRC is wrong */
+#define HDLC_ERR_SHORT	-2	/* frame too short to hold a CRC */
+#define HDLC_ERR_OVERFLOW -3	/* frame larger than the decoder buffer */
+
+struct hdlc_decoder {
+	uint8_t *buf;		/* unescaped frame, CRC stripped on HDLC_FRAME */
+	size_t size;
+	size_t len;
+	int escaped;
+	int overflow;
+	int done;		/* buf holds the last returned frame */
+};
+
+void hdlc_decoder_init(struct hdlc_decoder *d, uint8_t *buf, size_t size);
+int hdlc_decode(struct hdlc_decoder *d, const uint8_t *in, size_t len,
+		size_t *consumed);
+
+#endif
@@ -0,0 +1,310 @@
+/* Per-phase load metrics for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A load is split into phases (hello, then open/stream/ack for every
+ * image, then reset). Each phase records its monotonic duration and how
+ * far the I/O counters moved while it ran; a phase that runs again for a
+ * retry, after a backoff phase, gets the next attempt number, so every
+ * Prometheus series stays unique. With -metrics the whole load is written
+ * out as one record:
+ *
+ *   file.prom  Prometheus textfile, replaced atomically on every load
+ *   anything else, or "-" for stdout: one JSON object per line, appended
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "metrics.h"
+#include "gobi_loader.h"
+
+struct io_counters qdl_io;
+
+struct phase {
+	const char *name;
+	const char *image;	/* NULL for hello and reset */
+	int attempt;		/* 1, or more for a retried phase */
+	long long start_us;
+	long long end_us;
+	struct io_counters io;	/* counters at start, then the difference */
+};
+
+static struct {
+	const char *device;
+	const char *fwdir;
+	const char *variant;
+	time_t wall;
+	long long start_us;
+	long long end_us;
+	int status;
+	const char *transfer;
+	long peak_rss_kb;	/* of the whole process, at the end */
+	int nphases;
+	int open;		/* last phase still running */
+	struct phase phases[METRICS_MAX_PHASES];
+} m;
+
+void metrics_start(const char *device, const char *fwdir, const char *variant)
+{
+	memset(&m, 0, sizeof(m));
+	m.device = device;
+	m.fwdir = fwdir;
+	m.variant = variant;
+	m.wall = time(NULL);
+	m.start_us = monotonic_us();
+	m.status = -1;
+}
+
+static void phase_close(long long now)
+{
+	struct phase *p = &m.phases[m.nphases - 1];
+
+	if (!m.open)
+		return;
+	p->end_us = now;
+	p->io.syscalls = qdl_io.syscalls - p->io.syscalls;
+	p->io.tx = qdl_io.tx - p->io.tx;
+	p->io.rx = qdl_io.rx - p->io.rx;
+	m.open = 0;
+}
+
+/* end the running phase, if any, and start the next one */
+void metrics_phase(const char *name, const char *image)
+{
+	long long now = monotonic_us();
+	struct phase *p;
+	int i, attempt = 1;
+
+	phase_close(now);
+	if (m.nphases == METRICS_MAX_PHASES)
+		return;
+	for (i = 0; i < m.nphases; i++)
+		if (!strcmp(m.phases[i].name, name) &&
+		    (m.phases[i].image == image ||
+		     (image && m.phases[i].image &&
+		      !strcmp(m.phases[i].image, image))))
+			attempt++;
+	p = &m.phases[m.nphases++];
+	p->name = name;
+	p->image = image;
+	p->attempt = attempt;
+	p->start_us = now;
+	p->io = qdl_io;
+	m.open = 1;
+}
+
+void metrics_end(int status, const char *transfer)
+{
+	struct rusage ru;
+
+	m.end_us = monotonic_us();
+	if (!getrusage(RUSAGE_SELF, &ru))
+		m.peak_rss_kb = ru.ru_maxrss;
+	phase_close(m.end_us);
+	m.status = status;
+	m.transfer = transfer;
+}
+
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; s && *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static double rate(uint64_t bytes, long long us)
+{
+	return us > 0 ? bytes * 1e6 / us : 0;
+}
+
+static void write_json(FILE *f)
+{
+	struct phase *p;
+	int i;
+
+	fprintf(f, "{\"time\":%lld,\"device\":", (long long)m.wall);
+	json_string(f, m.device);
+	fprintf(f, ",\"firmware\":");
+	json_string(f, m.fwdir);
+	fprintf(f, ",\"variant\":\"%s\",\"transfer\":", m.variant);
+	json_string(f, m.transfer);
+	fprintf(f, ",\"status\":\"%s\"", m.status ? "failed" : "ok");
+	if (m.status && m.nphases)
+		fprintf(f, ",\"failed_phase\":\"%s\"",
+			m.phases[m.nphases - 1].name);
+	fprintf(f, ",\"total_us\":%lld,\"peak_rss_kb\":%ld,\"phases\":[",
+		m.end_us - m.start_us, m.peak_rss_kb);
+
+	for (i = 0; i < m.nphases; i++) {
+		p = &m.phases[i];
+		fprintf(f, "%s{\"phase\":\"%s\"", i ? "," : "", p->name);
+		if (p->image)
+			fprintf(f, ",\"image\":\"%s\"", p->image);
+		if (p->attempt > 1)
+			fprintf(f, ",\"attempt\":%d", p->attempt);
+		fprintf(f, ",\"us\":%lld,\"tx_bytes\":%llu,\"rx_bytes\":%llu,"
+			"\"syscalls\":%llu,\"tx_bytes_per_s\":%.0f}",
+			p->end_us - p->start_us,
+			(unsigned long long)p->io.tx,
+			(unsigned long long)p->io.rx,
+			(unsigned long long)p->io.syscalls,
+			rate(p->io.tx, p->end_us - p->start_us));
+	}
+	fprintf(f, "]}\n");
+}
+
+static void prom_labels(FILE *f, const struct phase *p)
+{
+	const char *dev = strrchr(m.device, '/');
+
+	fprintf(f, "{device=\"%s\"", dev ? dev + 1 : m.device);
+	if (p) {
+		fprintf(f, ",phase=\"%s\"", p->name);
+		if (p->image)
+			fprintf(f, ",image=\"%s\"", p->image);
+		fprintf(f, ",attempt=\"%d\"", p->attempt);
+	}
+	fprintf(f, "} ");
+}
+
+static void write_prom(FILE *f)
+{
+	static const char *metric[] = {
+		"gobi_loader_phase_seconds",
+		"gobi_loader_phase_tx_bytes",
+		"gobi_loader_phase_rx_bytes",
+		"gobi_loader_phase_syscalls",
+	};
+	static const char *help[] = {
+		"Duration of a load phase",
+		"Bytes written to the device during a load phase",
+		"Bytes read from the device during a load phase",
+		"System calls made during a load phase",
+	};
+	struct phase *p;
+	uint64_t tx = 0;
+	int i, k;
+
+	for (k = 0; k < 4; k++) {
+		fprintf(f, "# HELP %s %s.\n# TYPE %s gauge\n",
+			metric[k], help[k], metric[k]);
+		for (i = 0; i < m.nphases; i++) {
+			p = &m.phases[i];
+			fprintf(f, "%s", metric[k]);
+			prom_labels(f, p);
+			switch (k) {
+			case 0:
+				fprintf(f, "%.6f\n",
+					(p->end_us - p->start_us) / 1e6);
+				break;
+			case 1:
+				fprintf(f, "%llu\n", (unsigned long long)p->io.tx);
+				break;
+			case 2:
+				fprintf(f, "%llu\n", (unsigned long long)p->io.rx);
+				break;
+			case 3:
+				fprintf(f, "%llu\n",
+					(unsigned long long)p->io.syscalls);
+				break;
+			}
+		}
+	}
+	for (i = 0; i < m.nphases; i++)
+		tx += m.phases[i].io.tx;
+
+	fprintf(f, "# HELP gobi_loader_load_seconds Duration of the whole load.\n"
+		"# TYPE gobi_loader_load_seconds gauge\ngobi_loader_load_seconds");
+	prom_labels(f, NULL);
+	fprintf(f, "%.6f\n", (m.end_us - m.start_us) / 1e6);
+	fprintf(f, "# HELP gobi_loader_load_tx_bytes Bytes written during the load.\n"
+		"# TYPE gobi_loader_load_tx_bytes gauge\ngobi_loader_load_tx_bytes");
+	prom_labels(f, NULL);
+	fprintf(f, "%llu\n", (unsigned long long)tx);
+	fprintf(f, "# HELP gobi_loader_peak_rss_bytes Peak resident memory of the loader.\n"
+		"# TYPE gobi_loader_peak_rss_bytes gauge\ngobi_loader_peak_rss_bytes");
+	prom_labels(f, NULL);
+	fprintf(f, "%ld\n", m.peak_rss_kb * 1024);
+	fprintf(f, "# HELP gobi_loader_load_success 1 if the last load succeeded.\n"
+		"# TYPE gobi_loader_load_success gauge\ngobi_loader_load_success");
+	prom_labels(f, NULL);
+	fprintf(f, "%d\n", m.status ? 0 : 1);
+	fprintf(f, "# HELP gobi_loader_load_timestamp_seconds Start of the last load.\n"
+		"# TYPE gobi_loader_load_timestamp_seconds gauge\n"
+		"gobi_loader_load_timestamp_seconds");
+	prom_labels(f, NULL);
+	fprintf(f, "%lld\n", (long long)m.wall);
+}
+
+/**
+ *	metrics_write - emit the record of the finished load
+ *	@path: "-", a .prom textfile or a JSON lines file
+ *
+ *	Returns 0, or -1 with errno set if the file couldn't be written.
+ */
+int metrics_write(const char *path)
+{
+	char tmp[PATH_MAX];
+	size_t len = strlen(path);
+	FILE *f;
+	int fd;
+
+	if (!strcmp(path, "-")) {
+		write_json(stdout);
+		return fflush(stdout);
+	}
+
+	if (len > 5 && !strcmp(path + len - 5, ".prom")) {
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+		fd = mkstemp(tmp);
+		if (fd == -1)
+			return -1;
+		fchmod(fd, 0644);
+		f = fdopen(fd, "w");
+		if (!f) {
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+		write_prom(f);
+		if (fclose(f) || rename(tmp, path)) {
+			unlink(tmp);
+			return -1;
+		}
+		return 0;
+	}
+
+	f = fopen(path, "a");
+	if (!f)
+		return -1;
+	write_json(f);
+	return fclose(f);
+}
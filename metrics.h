@@ -0,0 +1,34 @@
+/* Per-phase load metrics: timing, bytes and syscalls */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MAX_PHASES	64	/* room for retries */
+
+/* running totals, bumped by every I/O site of the load path */
+struct io_counters {
+	uint64_t syscalls;
+	uint64_t tx;		/* bytes written to the device */
+	uint64_t rx;		/* bytes read from the device */
+};
+
+extern struct io_counters qdl_io;
+
+/* safe to call from the pipeline reader thread */
+static inline void io_account(unsigned calls, uint64_t tx, uint64_t rx)
+{
+	__atomic_add_fetch(&qdl_io.syscalls, calls, __ATOMIC_RELAXED);
+	if (tx)
+		__atomic_add_fetch(&qdl_io.tx, tx, __ATOMIC_RELAXED);
+	if (rx)
+		__atomic_add_fetch(&qdl_io.rx, rx, __ATOMIC_RELAXED);
+}
+
+void metrics_start(const char *device, const char *fwdir, const char *variant);
+void metrics_phase(const char *name, const char *image);
+void metrics_end(int status, const char *transfer);
+int metrics_write(const char *path);
+
+#endif
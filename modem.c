@@ -0,0 +1,233 @@
+/* Modem readiness after a load for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * After the reset the device drops off the bus and comes back on the
+ * same port with its modem VID:PID, and qcserial (and qmi_wwan, if there
+ * is one) bind to its interfaces. "-wait-modem s" remembers the port the
+ * device sits on before the load and afterwards watches it in sysfs until
+ * the device is back with an id that isn't a QDL one and has a ttyUSB
+ * with its /dev node. Kernel uevents wake the check up as things appear,
+ * with a slow poll as a fallback where the uevent socket is not allowed.
+ * The time until the USB device is back and the time until the tty is
+ * there go to the "enumerate" and "bind" metrics phases.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "modem.h"
+#include "devdb.h"
+#include "gobi_loader.h"
+#include "metrics.h"
+
+#define MODEM_POLL		100	/* ms between checks without uevents */
+#define MODEM_POLL_UEVENT	1000	/* in case an event got lost */
+
+#define MODEM_GONE	0	/* not on the bus */
+#define MODEM_QDL	1	/* still, or again, in QDL mode */
+#define MODEM_USB	2	/* back with a modem id */
+#define MODEM_READY	3	/* and its tty is there */
+
+static int uevent_socket(void)
+{
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd != -1 && bind(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/**
+ *	modem_watch - note where the device is before loading it
+ *	@m: filled in
+ *	@dev: serial device or /dev/bus/usb node of the device in QDL mode
+ *
+ *	Returns 0, or -1 with errno set to ENODEV if dev isn't a USB device.
+ */
+int modem_watch(struct modem *m, const char *dev)
+{
+	char dir[PATH_MAX];
+
+	memset(m, 0, sizeof(*m));
+	m->uevent = -1;
+	if (devdb_device_id(dev, &m->qdl_vid, &m->qdl_pid, dir)) {
+		errno = ENODEV;
+		return -1;
+	}
+	/* the port's name, e.g. 1-1.2, stays the same */
+	snprintf(m->port, sizeof(m->port), "/sys/bus/usb/devices%s",
+		 strrchr(dir, '/'));
+	/* before the reset, so no event is missed */
+	m->uevent = uevent_socket();
+	return 0;
+}
+
+static void add_iface(struct modem *m, const char *name)
+{
+	size_t len = strlen(m->ifaces);
+
+	snprintf(m->ifaces + len, sizeof(m->ifaces) - len, "%s%s",
+		 len ? " " : "", name);
+}
+
+/* QMI nodes: cdc-wdm from qmi_wwan, qcqmi from Qualcomm's driver */
+static void add_qmi(struct modem *m, const char *dir)
+{
+	struct dirent *e;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((e = readdir(d)))
+		if (e->d_name[0] != '.')
+			add_iface(m, e->d_name);
+	closedir(d);
+}
+
+/* list the ttys and QMI nodes of the device's interfaces; number of ttys */
+static int modem_ifaces(struct modem *m)
+{
+	char intf[PATH_MAX], path[PATH_MAX];
+	const char *base = strrchr(m->port, '/') + 1;
+	struct dirent *e, *f;
+	DIR *d, *di;
+	int ttys = 0;
+
+	m->ifaces[0] = '\0';
+	d = opendir(m->port);
+	if (!d)
+		return 0;
+	/* interfaces are called <port>:<config>.<number> */
+	while ((e = readdir(d))) {
+		if (strncmp(e->d_name, base, strlen(base)) ||
+		    e->d_name[strlen(base)] != ':')
+			continue;
+		if (snprintf(intf, sizeof(intf), "%s/%s", m->port,
+			     e->d_name) >= (int)sizeof(intf))
+			continue;
+		di = opendir(intf);
+		if (!di)
+			continue;
+		while ((f = readdir(di))) {
+			if (!strncmp(f->d_name, "ttyUSB", 6)) {
+				/* devtmpfs has made the node by now */
+				snprintf(path, sizeof(path), "/dev/%s",
+					 f->d_name);
+				if (access(path, F_OK))
+					continue;
+				add_iface(m, f->d_name);
+				ttys++;
+			} else if ((!strcmp(f->d_name, "usbmisc") ||
+				    !strcmp(f->d_name, "qcqmi")) &&
+				   snprintf(path, sizeof(path), "%s/%s", intf,
+					    f->d_name) < (int)sizeof(path)) {
+				add_qmi(m, path);
+			}
+		}
+		closedir(di);
+	}
+	closedir(d);
+	return ttys;
+}
+
+static int modem_scan(struct modem *m)
+{
+	uint16_t vid, pid;
+
+	if (devdb_read_ids(m->port, &vid, &pid))
+		return MODEM_GONE;
+	if ((vid == m->qdl_vid && pid == m->qdl_pid) || devdb_lookup(vid, pid))
+		return MODEM_QDL;
+	m->vid = vid;
+	m->pid = pid;
+	return modem_ifaces(m) ? MODEM_READY : MODEM_USB;
+}
+
+/* sleep until a uevent arrives or ms pass */
+static void modem_sleep(struct modem *m, int ms)
+{
+	struct pollfd pfd = { .fd = m->uevent, .events = POLLIN };
+	char buf[256];
+
+	if (m->uevent == -1) {
+		poll(NULL, 0, ms);
+		return;
+	}
+	if (poll(&pfd, 1, ms) > 0)
+		/* which event doesn't matter, sysfs is checked again */
+		while (recv(m->uevent, buf, sizeof(buf), MSG_DONTWAIT) > 0 ||
+		       errno == ENOBUFS)
+			;
+}
+
+/**
+ *	modem_wait - wait for the loaded device to come up as a modem
+ *	@m: set up by modem_watch() before the load
+ *	@timeout_ms: deadline, counted from the call
+ *
+ *	To be called right after the reset. Sets m->reset_ms and, once the
+ *	device is back on the bus, m->usb_ms, vid and pid. Returns 0 when it
+ *	has a tty, listed in m->ifaces with any QMI nodes, or -1 with errno
+ *	ETIMEDOUT.
+ */
+int modem_wait(struct modem *m, int timeout_ms)
+{
+	int poll_ms = m->uevent == -1 ? MODEM_POLL : MODEM_POLL_UEVENT;
+	long long now, deadline;
+	int state;
+
+	m->reset_ms = monotonic_ms();
+	deadline = m->reset_ms + timeout_ms;
+	metrics_phase("enumerate", NULL);
+
+	for (;;) {
+		state = modem_scan(m);
+		now = monotonic_ms();
+		if (state >= MODEM_USB && !m->usb_ms) {
+			m->usb_ms = now;
+			metrics_phase("bind", NULL);
+		}
+		if (state == MODEM_READY)
+			return 0;
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		modem_sleep(m, deadline - now < poll_ms ? deadline - now :
+			    poll_ms);
+	}
+}
+
+void modem_close(struct modem *m)
+{
+	if (m->uevent != -1)
+		close(m->uevent);
+	m->uevent = -1;
+}
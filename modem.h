@@ -0,0 +1,26 @@
+/* Waiting for the modem to come back after the reset */
+
+#ifndef MODEM_H
+#define MODEM_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#define MODEM_IFACES	64	/* names of its ttys and QMI nodes */
+#define MODEM_WAIT_MAX	600	/* s, the most -wait-modem takes */
+
+struct modem {
+	char port[PATH_MAX];	/* sysfs directory of the USB device */
+	uint16_t qdl_vid, qdl_pid;
+	int uevent;		/* kernel uevent socket, or -1 to poll */
+	long long reset_ms;	/* reset sent */
+	long long usb_ms;	/* back with a modem id, 0 until then */
+	uint16_t vid, pid;
+	char ifaces[MODEM_IFACES];
+};
+
+int modem_watch(struct modem *m, const char *dev);
+int modem_wait(struct modem *m, int timeout_ms);
+void modem_close(struct modem *m);
+
+#endif
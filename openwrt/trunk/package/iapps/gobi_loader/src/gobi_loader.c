@@ -29,6 +29,17 @@
  * Send firmware with 256*1024 bytes per package
  * Read and check device response after send cmd
  * Use 0x7d as an escape character encode package
+ *
+ * 2026-10-16
+ * Send firmware from a static FW_SIZE_PER_PACKAGE buffer, 16KB by default,
+ * instead of a 256KB malloc; several loaders run at once on routers with
+ * more than one card. Set it with EXTRA_CFLAGS=-DFW_SIZE_PER_PACKAGE=n
+ * Stop at the end of amss.mbn when fewer than 8 bytes are left to read
+ * Send each request, 0x7e flags included, in a single write, and drop the
+ * zero-length write after every firmware package
+ *
+ * 2026-10-17
+ * Send each image header in the same writev as the first firmware package
  */
 
 #include <stdio.h>
@@ -38,9 +49,9 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
-#include <malloc.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #if defined(BYTE_ORDER) && !defined(__BYTE_ORDER)
 #define __LITTLE_ENDIAN LITTLE_ENDIAN
@@ -180,41 +191,44 @@ void usage (char **argv) {
 
 #define DATA_ENCODE	1	/* add 0x7e head/tail, do encode */
 #define DATA_NOENCODE	0	/* no 0x7e head/tail, no encode */
-int qdl_server_send_request(int fd, const char *data, int len, char flag) {
-	int i, cnt;
-	char buff[64];
+#define REQUEST_MAX	(2 * 64 + 2)	/* every byte escaped, plus both flags */
+
+/* build the request in buff, return its length */
+static int qdl_server_encode(char *buff, const char *data, int len, char flag) {
+	int i, cnt = 0;
+	char crc[2];
 
 	if(data == NULL) return -1;
-	if(len < 3) return -1;
-
-	cnt = len;
-	memcpy(buff, data, len);
-
-	*(int16_t *)&buff[len-2] = SWAPL16(~crc_ccitt(0xffff, data, len-2)); /* crc */
-
-	if(flag == DATA_ENCODE) { /* do transposition, similar to PPP protocol */
-		for(i=0; i<len; i++) {
-			switch(buff[i]) {
-				case 0x7e:
-					buff[i] = 0x7d;
-					memmove(buff+i+2, buff+i+1, len-i-1);
-					buff[i+1] = 0x5e;
-					cnt++;
-					break;
-
-				case 0x7d:
-					buff[i] = 0x7d;
-					memmove(buff+i+2, buff+i+1, len-i-1);
-					buff[i+1] = 0x5d;
-					cnt++;
-					break;
-			}
+	if(len < 3 || len > 64) return -1;
+
+	*(int16_t *)crc = SWAPL16(~crc_ccitt(0xffff, data, len-2));
+
+	if(flag == DATA_ENCODE) buff[cnt++] = 0x7e;
+	for(i=0; i<len; i++) {
+		char c = i < len-2 ? data[i] : crc[i-(len-2)];
+
+		/* do transposition, similar to PPP protocol */
+		if(flag == DATA_ENCODE && (c == 0x7e || c == 0x7d)) {
+			buff[cnt++] = 0x7d;
+			buff[cnt++] = c ^ 0x20;
+		} else {
+			buff[cnt++] = c;
 		}
 	}
+	if(flag == DATA_ENCODE) buff[cnt++] = 0x7e;
+
+	return cnt;
+}
 
-	if(flag == DATA_ENCODE) write(fd, "\x7e", 1);
+int qdl_server_send_request(int fd, const char *data, int len, char flag) {
+	char buff[REQUEST_MAX];
+	int cnt;
+
+	cnt = qdl_server_encode(buff, data, len, flag);
+	if(cnt < 0) return -1;
+
+	/* one write per request */
 	write(fd, buff, cnt);
-	if(flag == DATA_ENCODE) write(fd, "\x7e", 1);
 
 	return 0;
 }
@@ -249,27 +263,47 @@ int qdl_server_wait_response(int fd, char code) {
 	return 0;
 }
 
-#define FW_SIZE_PER_PACKAGE		(256*1024)
+#ifndef FW_SIZE_PER_PACKAGE
+#define FW_SIZE_PER_PACKAGE		(16*1024)	/* one usb bulk urb */
+#endif
+static char fwdata[FW_SIZE_PER_PACKAGE];
+
+/* send the raw header in the same writev as the first package of left bytes */
+static void qdl_send_image(int serialfd, int fwfd, const char *header,
+			   int header_len, off_t left) {
+	char buff[REQUEST_MAX];
+	struct iovec iov[2];
+	int len;
+
+	iov[0].iov_base = buff;
+	iov[0].iov_len = qdl_server_encode(buff, header, header_len,
+					   DATA_NOENCODE);
+	do {
+		len = read (fwfd, fwdata, left < FW_SIZE_PER_PACKAGE ?
+			    left : FW_SIZE_PER_PACKAGE);
+		if (len < 0)
+			len = 0;
+		iov[1].iov_base = fwdata;
+		iov[1].iov_len = len;
+		writev (serialfd, iov, 2);
+		iov[0].iov_len = 0;	/* only with the first package */
+		left -= len;
+	} while (left > 0 && len == FW_SIZE_PER_PACKAGE);
+}
+
 int main(int argc, char **argv) {	
 	int serialfd;
 	int fwfd;
-	int len;
 	int err;
 	int gobi2000 = 0;
 	struct termios terminal_data;
 	struct stat file_data;
-	char *fwdata = malloc(FW_SIZE_PER_PACKAGE);
 
 	if (argc < 3 || argc > 4) {
 		usage(argv);
 		return -1;
 	}
 
-	if (!fwdata) {
-		fprintf(stderr, "Failed to allocate memory for firmware\n");
-		return -1;
-	}
-
 	if (argc == 4) {
 		if (!strcmp(argv[1], "-2000")) {
 			gobi2000=1;
@@ -316,18 +350,9 @@ int main(int argc, char **argv) {
 
 	qdl_server_send_request(serialfd, magic2, sizeof(magic2), DATA_ENCODE);
 	qdl_server_wait_response(serialfd, 0x26);
-	qdl_server_send_request(serialfd, magic3, sizeof(magic3), DATA_NOENCODE);
-
-	while (1) {
-		len = read (fwfd, fwdata, FW_SIZE_PER_PACKAGE);
-		if (len == FW_SIZE_PER_PACKAGE)
-			write (serialfd, fwdata, FW_SIZE_PER_PACKAGE);
-		else {
-			write (serialfd, fwdata, len-8);
-			break;
-		}
-		write (serialfd, fwdata, 0);
-	}
+	/* the last 8 bytes of amss.mbn are not sent */
+	qdl_send_image(serialfd, fwfd, magic3, sizeof(magic3),
+		       file_data.st_size - 8);
 	qdl_server_wait_response(serialfd, 0x28);
 	printf("QDL amss.mbn finish\n");
 
@@ -345,18 +370,8 @@ int main(int argc, char **argv) {
 
 	qdl_server_send_request(serialfd, magic4, sizeof(magic4), DATA_ENCODE);
 	qdl_server_wait_response(serialfd, 0x26);
-	qdl_server_send_request(serialfd, magic5, sizeof(magic5), DATA_NOENCODE);
-
-	while (1) {
-		len = read (fwfd, fwdata, FW_SIZE_PER_PACKAGE);
-		if (len == FW_SIZE_PER_PACKAGE)
-			write (serialfd, fwdata, FW_SIZE_PER_PACKAGE);
-		else {
-			write (serialfd, fwdata, len);
-			break;
-		}
-		write (serialfd, fwdata, 0);
-	}
+	qdl_send_image(serialfd, fwfd, magic5, sizeof(magic5),
+		       file_data.st_size);
 	qdl_server_wait_response(serialfd, 0x28);
 	printf("QDL apps.mbn finish\n");
 
@@ -378,18 +393,8 @@ int main(int argc, char **argv) {
 
 		qdl_server_send_request(serialfd, magic6, sizeof(magic6), DATA_ENCODE);
 		qdl_server_wait_response(serialfd, 0x26);
-		qdl_server_send_request(serialfd, magic7, sizeof(magic7), DATA_NOENCODE);
-
-		while (1) {
-			len = read (fwfd, fwdata, FW_SIZE_PER_PACKAGE);
-			if (len == FW_SIZE_PER_PACKAGE)
-				write (serialfd, fwdata, FW_SIZE_PER_PACKAGE);
-			else {
-				write (serialfd, fwdata, len);
-				break;
-			}
-			write (serialfd, fwdata, 0);
-		}
+		qdl_send_image(serialfd, fwfd, magic7, sizeof(magic7),
+			       file_data.st_size);
 		qdl_server_wait_response(serialfd, 0x28);
 		printf("QDL uqcn.mbn finish\n");
 	}
@@ -0,0 +1,278 @@
+/* Double-buffered file to serial transfer for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A reader thread fills a ring of fixed size buffers from the image while
+ * the calling thread drains them to the serial device, so a slow flash or
+ * USB stick read overlaps with the previous chunk going over the link.
+ * Memory use is bounded by depth * chunk and the buffers are kept for the
+ * next image; gobi_loader-static has them in a fixed array instead. A
+ * compressed image is unpacked by the reader thread too, so decoding
+ * overlaps with the link the same way.
+ *
+ * The writer counts how often it found the ring empty (the link sat idle
+ * waiting for storage) and the reader how often it found it full (storage
+ * sat idle waiting for the link), which tells which side limits a board.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "gobi_loader.h"
+#include "metrics.h"
+#include "transport.h"
+
+struct slot {
+	size_t len;
+};
+
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;		/* reader -> writer */
+	pthread_cond_t drained;		/* writer -> reader */
+	pipeline_read_fn read;
+	void *arg;
+	off_t off;			/* next offset to read */
+	off_t len;
+	size_t chunk;
+	unsigned depth;
+	unsigned head;			/* next slot to fill */
+	unsigned tail;			/* next slot to drain */
+	unsigned count;			/* filled slots */
+	int eof;			/* reader is finished */
+	int err;			/* reader errno, 0 if none */
+	int stop;			/* writer gave up */
+	char *buf;
+	struct slot slots[PIPELINE_DEPTH_MAX];
+	struct pipeline_stats *st;
+};
+
+#ifdef STATIC_RING
+static char ring[PIPELINE_DEPTH_MAX * STATIC_RING];
+#else
+static char *ring;
+static size_t ring_size;
+#endif
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *reader(void *arg)
+{
+	struct pipeline *p = arg;
+	uint64_t t;
+	ssize_t n;
+	size_t want;
+	unsigned s;
+
+	pthread_mutex_lock(&p->lock);
+	while (p->off < p->len && !p->stop) {
+		if (p->count == p->depth) {
+			p->st->storage_waits++;
+			t = now_us();
+			while (p->count == p->depth && !p->stop)
+				pthread_cond_wait(&p->drained, &p->lock);
+			p->st->storage_wait_us += now_us() - t;
+			continue;
+		}
+		s = p->head;
+		want = p->len - p->off < p->chunk ? p->len - p->off : p->chunk;
+		pthread_mutex_unlock(&p->lock);
+
+		do
+			n = p->read(p->arg, p->buf + s * p->chunk, want, p->off);
+		while (n < 0 && errno == EINTR);
+
+		pthread_mutex_lock(&p->lock);
+		if (n <= 0) {
+			p->err = n ? errno : EIO;	/* firmware shrank */
+			break;
+		}
+		p->slots[s].len = n;
+		p->off += n;
+		p->head = (s + 1) % p->depth;
+		p->count++;
+		pthread_cond_signal(&p->filled);
+	}
+	p->eof = 1;
+	pthread_cond_signal(&p->filled);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* pipeline_read_fn for a plain file, arg points to its fd */
+ssize_t pipeline_pread(void *arg, void *buf, size_t len, off_t off)
+{
+	io_account(1, 0, 0);
+	return pread(*(int *)arg, buf, len, off);
+}
+
+/**
+ *	pipeline_stream_from - feed an image to the serial device through the ring
+ *	@out: link to the device
+ *	@read: fills the slots, called like pread() from the reader thread
+ *	@arg: passed to read
+ *	@off: first byte to send, advanced as data is written
+ *	@len: end of the data to send
+ *	@chunk: slot size in bytes
+ *	@depth: number of slots, at most PIPELINE_DEPTH_MAX
+ *	@st: statistics, reset on entry
+ *
+ *	Returns 0 once everything up to len has been written, or -1 with
+ *	errno set if either side failed.
+ */
+int pipeline_stream_from(struct transport *out, pipeline_read_fn read,
+			 void *arg, off_t *off, off_t len, size_t chunk,
+			 unsigned depth, struct pipeline_stats *st)
+{
+	struct pipeline p;
+	pthread_attr_t attr;
+	pthread_t tid;
+	uint64_t t;
+	unsigned s;
+	size_t sent;
+	int err = 0;
+	int ret;
+
+	if (depth < 2)
+		depth = 2;
+	if (depth > PIPELINE_DEPTH_MAX)
+		depth = PIPELINE_DEPTH_MAX;
+
+#ifdef STATIC_RING
+	if (chunk > STATIC_RING)
+		chunk = STATIC_RING;
+#else
+	if (ring_size < depth * chunk) {
+		free(ring);
+		ring = malloc(depth * chunk);
+		if (!ring) {
+			ring_size = 0;
+			return -1;
+		}
+		ring_size = depth * chunk;
+	}
+#endif
+
+	memset(st, 0, sizeof(*st));
+	st->depth = depth;
+	st->chunk = chunk;
+
+	memset(&p, 0, sizeof(p));
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.filled, NULL);
+	pthread_cond_init(&p.drained, NULL);
+	p.read = read;
+	p.arg = arg;
+	p.off = *off;
+	p.len = len;
+	p.chunk = chunk;
+	p.depth = depth;
+	p.buf = ring;
+	p.st = st;
+
+	pthread_attr_init(&attr);
+#ifdef STATIC_RING
+	pthread_attr_setstacksize(&attr, PIPELINE_STACK);
+#endif
+	ret = pthread_create(&tid, &attr, reader, &p);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+
+	pthread_mutex_lock(&p.lock);
+	for (;;) {
+		if (!p.count) {
+			if (p.eof)
+				break;
+			st->link_waits++;
+			t = now_us();
+			while (!p.count && !p.eof)
+				pthread_cond_wait(&p.filled, &p.lock);
+			st->link_wait_us += now_us() - t;
+			continue;
+		}
+		s = p.tail;
+		st->chunks++;
+		st->queued += p.count;
+		if (p.count > st->max_queued)
+			st->max_queued = p.count;
+		pthread_mutex_unlock(&p.lock);
+
+		if (transport_write_all(out, p.buf + s * chunk,
+					p.slots[s].len, &sent))
+			err = errno;
+		*off += sent;
+
+		pthread_mutex_lock(&p.lock);
+		if (err) {
+			p.stop = 1;
+			pthread_cond_signal(&p.drained);
+			break;
+		}
+		p.tail = (s + 1) % depth;
+		p.count--;
+		pthread_cond_signal(&p.drained);
+	}
+	if (!err)
+		err = p.err;
+	pthread_mutex_unlock(&p.lock);
+
+	pthread_join(tid, NULL);
+	pthread_cond_destroy(&p.drained);
+	pthread_cond_destroy(&p.filled);
+	pthread_mutex_destroy(&p.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* pipeline_stream_from() reading straight from the image file infd */
+int pipeline_stream(struct transport *out, int infd, off_t *off, off_t len,
+		    size_t chunk, unsigned depth, struct pipeline_stats *st)
+{
+	return pipeline_stream_from(out, pipeline_pread, &infd, off, len,
+				    chunk, depth, st);
+}
+
+void pipeline_report(FILE *f, const struct pipeline_stats *st)
+{
+	fprintf(f, "QDL pipeline: %u x %zu KiB, queue avg %.1f max %u, "
+		"link idle %llu times %llu ms, reader blocked %llu times %llu ms\n",
+		st->depth, st->chunk / 1024,
+		st->chunks ? (double)st->queued / st->chunks : 0.0,
+		st->max_queued,
+		(unsigned long long)st->link_waits,
+		(unsigned long long)st->link_wait_us / 1000,
+		(unsigned long long)st->storage_waits,
+		(unsigned long long)st->storage_wait_us / 1000);
+}
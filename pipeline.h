@@ -0,0 +1,46 @@
+/* Double-buffered file to serial transfer */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PIPELINE_DEPTH_DEFAULT	4
+#ifdef STATIC_RING
+#define PIPELINE_DEPTH_MAX	8	/* slots of STATIC_RING bytes */
+#define PIPELINE_STACK		(64 * 1024)	/* reader thread */
+#else
+#define PIPELINE_DEPTH_MAX	64
+#endif
+
+struct pipeline_stats {
+	unsigned depth;			/* ring slots */
+	size_t chunk;			/* bytes per slot */
+	uint64_t chunks;		/* slots handed from reader to writer */
+	uint64_t queued;		/* sum of filled slots seen by the writer */
+	unsigned max_queued;
+	uint64_t link_waits;		/* writer found the ring empty */
+	uint64_t link_wait_us;
+	uint64_t storage_waits;		/* reader found the ring full */
+	uint64_t storage_wait_us;
+};
+
+/* pread() shaped source, e.g. unpack_pread() for a compressed image */
+typedef ssize_t (*pipeline_read_fn)(void *arg, void *buf, size_t len,
+				    off_t off);
+
+struct transport;
+
+ssize_t pipeline_pread(void *arg, void *buf, size_t len, off_t off);
+
+int pipeline_stream_from(struct transport *out, pipeline_read_fn read,
+			 void *arg, off_t *off, off_t len, size_t chunk,
+			 unsigned depth, struct pipeline_stats *st);
+int pipeline_stream(struct transport *out, int infd, off_t *off, off_t len,
+		    size_t chunk, unsigned depth, struct pipeline_stats *st);
+void pipeline_report(FILE *f, const struct pipeline_stats *st);
+
+#endif
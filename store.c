@@ -0,0 +1,501 @@
+/* Content-addressed firmware store for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Boards that carry firmware for several carriers or laptop models hold
+ * mostly the same bytes many times over. "gobi_loader import src dst"
+ * cuts every image under src into content defined chunks, stores each
+ * chunk once in the store directory under its sha256:
+ *
+ *   <store>/ab/cdef...   chunk whose hash is abcdef...
+ *
+ * and writes a recipe (struct store_recipe and its store_refs) under the
+ * same name below dst. dst is then used as a firmware directory; the
+ * loader recognises recipes by their magic and reassembles the image from
+ * the chunks while streaming it, checking each chunk against its hash.
+ *
+ * Chunk boundaries come from a gear hash over the data, so an insertion
+ * in one carrier's image only changes the chunks around it and the rest
+ * still match the other carriers'. Identical chunks are one file, so they
+ * take flash and page cache once.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "gobi_loader.h"
+#include "metrics.h"
+#include "verify.h"
+
+#define CHUNK_BITS	13	/* a cut every 8KB past the minimum, on average */
+#define STORE_MAX_CHUNKS	(1 << 20)
+
+struct store_image {
+	unsigned n;
+	int cur;		/* chunk in buf, -1 if none */
+	uint64_t size;
+	struct store_ref *ref;	/* host byte order */
+	uint64_t *off;		/* image offset of each chunk */
+	uint8_t buf[STORE_CHUNK_MAX];
+};
+
+static char store_dir[PATH_MAX / 2] = STORE_DEFAULT;
+static uint64_t gear[256];
+
+void store_init(const char *dir)
+{
+	snprintf(store_dir, sizeof(store_dir), "%s", dir);
+}
+
+static void chunk_path(const uint8_t hash[SHA256_DIGEST_LEN], char *path,
+		       size_t len)
+{
+	char hex[SHA256_HEX_LEN];
+
+	sha256_hex(hash, hex);
+	snprintf(path, len, "%s/%.2s/%s", store_dir, hex, hex + 2);
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, off);
+		io_account(1, 0, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = ENOSPC;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* a fixed table, so every import cuts the same data the same way */
+static void gear_init(void)
+{
+	uint64_t x = 0x676f6269, z;
+	int i;
+
+	if (gear[0])
+		return;
+	for (i = 0; i < 256; i++) {		/* splitmix64 */
+		z = x += 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* length of the chunk starting at p */
+static size_t chunk_len(const uint8_t *p, size_t len)
+{
+	uint64_t h = 0;
+	size_t i;
+
+	if (len <= STORE_CHUNK_MIN)
+		return len;
+	if (len > STORE_CHUNK_MAX)
+		len = STORE_CHUNK_MAX;
+	/* the top bits depend on the last 64 bytes only */
+	for (i = STORE_CHUNK_MIN; i < len; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h >> (64 - CHUNK_BITS)))
+			return i + 1;
+	}
+	return len;
+}
+
+/* write a file atomically, readable by all */
+static int write_file(const char *path, const void *a, size_t alen,
+		      const void *b, size_t blen)
+{
+	char tmp[PATH_MAX];
+	int fd, err = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+	if (write_full(fd, a, alen) || write_full(fd, b, blen) ||
+	    fchmod(fd, 0644) || fsync(fd))
+		err = errno;
+	if (close(fd) && !err)
+		err = errno;
+	if (!err && rename(tmp, path))
+		err = errno;
+	if (err) {
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int chunk_put(const uint8_t *data, size_t len,
+		     const uint8_t hash[SHA256_DIGEST_LEN],
+		     struct store_stats *st)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	char *slash;
+
+	st->chunks++;
+	chunk_path(hash, path, sizeof(path));
+	if (!stat(path, &sb) && sb.st_size == (off_t)len)
+		return 0;
+
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+	*slash = '/';
+	if (write_file(path, data, len, NULL, 0))
+		return -1;
+	st->new_chunks++;
+	st->new_bytes += len;
+	return 0;
+}
+
+static int import_file(const char *src, const char *dst,
+		       struct store_stats *st)
+{
+	struct store_recipe r;
+	struct store_ref *refs = NULL, *tmp;
+	struct sha256 c;
+	struct stat sb;
+	uint8_t *map = NULL;
+	const char *name = strrchr(src, '/');
+	size_t pos, len, n = 0, max = 0;
+	int fd, ret = -1;
+
+	fd = open(src, O_RDONLY);
+	if (fd == -1 || fstat(fd, &sb))
+		goto out;
+	if (sb.st_size) {
+		map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			goto out;
+		}
+	}
+
+	/* a manifest lists unpacked images, so it holds for the recipes */
+	if (!strcmp(name ? name + 1 : src, VERIFY_MANIFEST)) {
+		ret = write_file(dst, map, sb.st_size, NULL, 0);
+		goto out;
+	}
+
+	for (pos = 0; pos < sb.st_size; pos += len) {
+		len = chunk_len(map + pos, sb.st_size - pos);
+		if (n == max) {
+			max = max ? 2 * max : 256;
+			tmp = realloc(refs, max * sizeof(*refs));
+			if (!tmp)
+				goto out;
+			refs = tmp;
+		}
+		sha256_init(&c);
+		sha256_update(&c, map + pos, len);
+		sha256_final(&c, refs[n].hash);
+		if (chunk_put(map + pos, len, refs[n].hash, st))
+			goto out;
+		refs[n++].len = SWAPL32(len);
+	}
+
+	memcpy(r.magic, STORE_MAGIC, sizeof(r.magic));
+	r.version = SWAPL32(STORE_VERSION);
+	r.nchunks = SWAPL32(n);
+	r.size = SWAPL64((uint64_t)sb.st_size);
+	if (write_file(dst, &r, sizeof(r), refs, n * sizeof(*refs)))
+		goto out;
+	st->files++;
+	st->bytes += sb.st_size;
+	ret = 0;
+out:
+	if (ret)
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", src, strerror(errno));
+	if (map)
+		munmap(map, sb.st_size);
+	if (fd != -1)
+		close(fd);
+	free(refs);
+	return ret;
+}
+
+static int import_tree(const char *src, const char *dst,
+		       struct store_stats *st)
+{
+	char s[PATH_MAX], d[PATH_MAX];
+	struct dirent *e;
+	struct stat sb;
+	DIR *dir;
+	int ret = 0;
+
+	if (stat(src, &sb)) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", src, strerror(errno));
+		return -1;
+	}
+	if (S_ISREG(sb.st_mode))
+		return import_file(src, dst, st);
+	if (!S_ISDIR(sb.st_mode))
+		return 0;
+
+	if ((mkdir(dst, 0755) && errno != EEXIST) || !(dir = opendir(src))) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", dst, strerror(errno));
+		return -1;
+	}
+	/* dot entries are skipped, which keeps a store inside src out */
+	while (!ret && (e = readdir(dir))) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(s, sizeof(s), "%s/%s", src, e->d_name);
+		snprintf(d, sizeof(d), "%s/%s", dst, e->d_name);
+		ret = import_tree(s, d, st);
+	}
+	closedir(dir);
+	return ret;
+}
+
+/**
+ *	store_import - move a firmware tree into the store
+ *	@src: firmware directory or tree of them, e.g. a vendor's Packages
+ *	@dst: where the recipes go, same layout as src
+ *	@st: filled in with what was imported and what was new
+ *
+ *	src is left alone. Returns 0, or -1 after printing which file failed.
+ */
+int store_import(const char *src, const char *dst, struct store_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	gear_init();
+	if (mkdir(store_dir, 0755) && errno != EEXIST) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", store_dir,
+			strerror(errno));
+		return -1;
+	}
+	return import_tree(src, dst, st);
+}
+
+static int recipe_header(int fd, off_t base, uint64_t stored,
+			 struct store_recipe *r)
+{
+	if (stored < sizeof(*r) || read_at(fd, r, sizeof(*r), base))
+		goto invalid;
+	r->version = SWAPL32(r->version);
+	r->nchunks = SWAPL32(r->nchunks);
+	r->size = SWAPL64(r->size);
+	if (memcmp(r->magic, STORE_MAGIC, sizeof(r->magic)) ||
+	    r->version != STORE_VERSION || r->nchunks > STORE_MAX_CHUNKS ||
+	    stored != sizeof(*r) + r->nchunks * sizeof(struct store_ref))
+		goto invalid;
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/* size of the image a recipe stands for */
+int store_size(int fd, off_t base, uint64_t stored, uint64_t *size)
+{
+	struct store_recipe r;
+
+	if (recipe_header(fd, base, stored, &r))
+		return -1;
+	*size = r.size;
+	return 0;
+}
+
+/**
+ *	store_open - start reassembling an image from its recipe
+ *	@fd: file holding the recipe
+ *	@base: offset of the recipe in fd
+ *	@stored: length of the recipe
+ *
+ *	Returns the image for store_pread(), or NULL with errno set; EINVAL
+ *	if the recipe is damaged.
+ */
+struct store_image *store_open(int fd, off_t base, uint64_t stored)
+{
+	struct store_recipe r;
+	struct store_image *s;
+	uint64_t off = 0;
+	unsigned i;
+
+	if (recipe_header(fd, base, stored, &r))
+		return NULL;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->n = r.nchunks;
+	s->cur = -1;
+	s->size = r.size;
+	s->ref = malloc(s->n * sizeof(*s->ref) + 1);
+	s->off = malloc(s->n * sizeof(*s->off) + 1);
+	if (!s->ref || !s->off ||
+	    read_at(fd, s->ref, s->n * sizeof(*s->ref), base + sizeof(r)))
+		goto fail;
+
+	for (i = 0; i < s->n; i++) {
+		s->ref[i].len = SWAPL32(s->ref[i].len);
+		if (!s->ref[i].len || s->ref[i].len > STORE_CHUNK_MAX) {
+			errno = EINVAL;
+			goto fail;
+		}
+		s->off[i] = off;
+		off += s->ref[i].len;
+	}
+	if (off != s->size) {
+		errno = EINVAL;
+		goto fail;
+	}
+	return s;
+
+fail:
+	store_close(s);
+	return NULL;
+}
+
+/* load chunk i into buf and check it against its hash */
+static int chunk_load(struct store_image *s, unsigned i)
+{
+	uint8_t digest[SHA256_DIGEST_LEN];
+	char path[PATH_MAX];
+	struct sha256 c;
+	int fd, ret;
+
+	s->cur = -1;
+	chunk_path(s->ref[i].hash, path, sizeof(path));
+	fd = open(path, O_RDONLY);
+	io_account(1, 0, 0);
+	if (fd == -1) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	ret = read_at(fd, s->buf, s->ref[i].len, 0);
+	close(fd);
+	if (ret)
+		return -1;
+
+	sha256_init(&c);
+	sha256_update(&c, s->buf, s->ref[i].len);
+	sha256_final(&c, digest);
+	if (memcmp(digest, s->ref[i].hash, sizeof(digest))) {
+		fprintf(stderr, "[QDL ERROR]: %s: corrupt chunk\n", path);
+		errno = EBADMSG;
+		return -1;
+	}
+	s->cur = i;
+	return 0;
+}
+
+/* the chunk holding byte pos of the image, pos < size */
+static unsigned chunk_at(const struct store_image *s, uint64_t pos)
+{
+	unsigned lo = 0, hi = s->n, mid;
+
+	if (s->cur >= 0 && pos >= s->off[s->cur]) {
+		if (pos < s->off[s->cur] + s->ref[s->cur].len)
+			return s->cur;
+		if (s->cur + 1 < s->n && pos < s->off[s->cur + 1] +
+						s->ref[s->cur + 1].len)
+			return s->cur + 1;
+	}
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (s->off[mid] <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ *	store_pread - read from a reassembled image
+ *	@s: image from store_open()
+ *	@buf: destination
+ *	@len: bytes wanted
+ *	@off: offset in the image
+ *
+ *	Same contract as pread(). Returns the number of bytes read, 0 past
+ *	the end, or -1 with errno set; EBADMSG if a chunk doesn't match its
+ *	hash.
+ */
+ssize_t store_pread(struct store_image *s, void *buf, size_t len, off_t off)
+{
+	uint64_t pos;
+	size_t done = 0, skip, n;
+	unsigned i;
+
+	while (done < len && (pos = off + done) < s->size) {
+		i = chunk_at(s, pos);
+		if (s->cur != (int)i && chunk_load(s, i))
+			return done ? done : -1;
+		skip = pos - s->off[i];
+		n = s->ref[i].len - skip;
+		if (n > len - done)
+			n = len - done;
+		memcpy((char *)buf + done, s->buf + skip, n);
+		done += n;
+	}
+	return done;
+}
+
+void store_close(struct store_image *s)
+{
+	if (!s)
+		return;
+	free(s->ref);
+	free(s->off);
+	free(s);
+}
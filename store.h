@@ -0,0 +1,84 @@
+/* Content-addressed, chunk deduplicated firmware store */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sha256.h"
+
+#define STORE_DEFAULT	"/lib/firmware/gobi/.store"
+#define STORE_MAGIC	"GOBICAS\n"
+#define STORE_VERSION	1
+
+/* content defined chunk sizes, see store.c */
+#define STORE_CHUNK_MIN	(4 * 1024)
+#define STORE_CHUNK_MAX	(64 * 1024)
+
+/*
+ * An image in a store backed firmware directory is a recipe: this header,
+ * then one store_ref per chunk in order. Little endian on disk.
+ */
+struct store_recipe {
+	char magic[8];
+	uint32_t version;
+	uint32_t nchunks;
+	uint64_t size;		/* image size, the sum of the chunk lengths */
+} __attribute__((packed));
+
+struct store_ref {
+	uint8_t hash[SHA256_DIGEST_LEN];	/* sha256 of the chunk */
+	uint32_t len;
+} __attribute__((packed));
+
+struct store_stats {
+	unsigned files;
+	uint64_t bytes;		/* image bytes imported */
+	uint64_t chunks;
+	uint64_t new_chunks;	/* chunks the store didn't have yet */
+	uint64_t new_bytes;
+};
+
+struct store_image;
+
+#ifdef STATIC_RING
+/* a recipe's chunk index is sized at run time, so no store without a heap */
+static inline void store_init(const char *dir) {}
+static inline int store_size(int fd, off_t base, uint64_t stored,
+			     uint64_t *size)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+static inline struct store_image *store_open(int fd, off_t base,
+					     uint64_t stored)
+{
+	errno = ENOTSUP;
+	return NULL;
+}
+static inline ssize_t store_pread(struct store_image *s, void *buf,
+				  size_t len, off_t off)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+static inline void store_close(struct store_image *s) {}
+static inline int store_import(const char *src, const char *dst,
+			       struct store_stats *st)
+{
+	fprintf(stderr, "[QDL ERROR]: No firmware store in this build\n");
+	return -1;
+}
+#else
+void store_init(const char *dir);
+int store_size(int fd, off_t base, uint64_t stored, uint64_t *size);
+struct store_image *store_open(int fd, off_t base, uint64_t stored);
+ssize_t store_pread(struct store_image *s, void *buf, size_t len, off_t off);
+void store_close(struct store_image *s);
+int store_import(const char *src, const char *dst, struct store_stats *st);
+#endif
+
+#endif
@@ -0,0 +1,449 @@
+/* QDL device emulator for gobi_loader */
+
+/* Copyright 2026 the gobi_loader authors
+ *
+ * Plays the device side of the Qualcomm QDL handshake on a pseudo-terminal
+ * so that gobi_loader can be run, timed and regression-tested without a
+ * physical Gobi card.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Protocol as seen from the device:
+ *
+ *   host -> 0x7e 0x01 "QCOM high speed protocol hst" ... crc 0x7e  (hello)
+ *   dev  -> 0x7e 0x02 ... crc 0x7e
+ *   host -> 0x7e 0x25 type size32 ... crc 0x7e                    (open)
+ *   dev  -> 0x7e 0x26 ... crc 0x7e
+ *   host -> 0x27 ... size32 at offset 7 ... crc                   (raw header)
+ *   host -> size32 bytes of raw image data
+ *   dev  -> 0x7e 0x28 ... crc 0x7e
+ *   ... repeated for each image ...
+ *   host -> 0x7e 0x29 crc 0x7e                                    (reset)
+ *
+ * For exercising the loader's retry logic, -n N answers the Nth image with
+ * a NAK (0x03) instead of 0x28, and -r N does the same but also forgets the
+ * session, NAKing every open until the host says hello again.
+ *
+ * With -u the link is a unix socket at link_path instead of a pty, for
+ * "gobi_loader -transport socket"; one connection is served.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../crc_ccitt.h"
+#include "../hdlc.h"
+
+#define QDL_HDR_LEN	13	/* raw 0x27 header that precedes image data */
+#define MAX_IMAGES	16
+#define MAX_FRAME	512
+
+enum emu_state {
+	EMU_FRAME,		/* collecting an HDLC framed command */
+	EMU_HEADER,		/* collecting the raw 0x27 header */
+	EMU_IMAGE,		/* consuming raw image bytes */
+};
+
+struct emu_image {
+	uint8_t type;
+	uint32_t size;
+	uint32_t received;
+	double t_open;		/* 0x25 seen */
+	double t_data;		/* first image byte */
+	double t_done;		/* last image byte */
+};
+
+static long bandwidth;		/* bytes per second, 0 = unlimited */
+static long write_latency;	/* usec charged per chunk read off the link */
+static long ack_delay;		/* usec before each response frame */
+static size_t chunk = 16384;	/* max bytes consumed per read */
+static int fragment;		/* dribble responses out one byte per write */
+static int nak_image;		/* NAK this image (1-based), 0 = never */
+static int reset_image;		/* NAK it and drop back to pre-hello state */
+static int need_hello;
+static int verbose;
+
+static struct emu_image images[MAX_IMAGES];
+static int nimages;
+static unsigned long crc_errors;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_us(long us)
+{
+	struct timespec ts;
+
+	if (us <= 0)
+		return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static const char *image_name(uint8_t type)
+{
+	switch (type) {
+	case 0x05: return "amss.mbn";
+	case 0x06: return "apps.mbn";
+	case 0x0d: return "uqcn.mbn";
+	default:   return "unknown";
+	}
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_response(int fd, const uint8_t *data, size_t len)
+{
+	uint8_t frame[HDLC_ENCODED_MAX(MAX_FRAME)];
+	size_t i, n;
+
+	sleep_us(ack_delay);
+
+	n = hdlc_encode(frame, sizeof(frame), data, len);
+	if (verbose)
+		fprintf(stderr, "emu: -> 0x%02x (%zu bytes)\n", data[0], n);
+	if (fragment) {
+		for (i = 0; i < n; i++) {
+			if (write_all(fd, frame + i, 1))
+				return -1;
+			sleep_us(1000);
+		}
+		return 0;
+	}
+	return write_all(fd, frame, n);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * frame is the decoded command with its CRC stripped, status the decoder
+ * result. Returns 1 when the host asked for a reset, -1 on error.
+ */
+static int handle_frame(int fd, uint8_t *frame, size_t len, int status,
+			enum emu_state *state)
+{
+	static const uint8_t hello[] = {0x02, 'Q', 'C', 'O', 'M', ' ', 'h', 'i',
+		'g', 'h', ' ', 's', 'p', 'e', 'e', 'd', ' ', 'p', 'r', 'o', 't',
+		'o', 'c', 'o', 'l', ' ', 'd', 'e', 'v', 0x04, 0x04};
+	static const uint8_t open_ack[] = {0x26, 0x00, 0x00};
+	static const uint8_t nak[] = {0x03, 0x00, 0x00};
+	struct emu_image *img;
+
+	if (status == HDLC_ERR_SHORT || status == HDLC_ERR_OVERFLOW) {
+		if (verbose)
+			fprintf(stderr, "emu: dropped malformed frame\n");
+		return 0;
+	}
+
+	if (status == HDLC_ERR_CRC) {
+		fprintf(stderr, "emu: bad crc on 0x%02x frame\n", frame[0]);
+		crc_errors++;
+	}
+
+	if (verbose)
+		fprintf(stderr, "emu: <- 0x%02x (%zu bytes)\n", frame[0], len);
+
+	switch (frame[0]) {
+	case 0x01:
+		need_hello = 0;
+		return send_response(fd, hello, sizeof(hello));
+
+	case 0x25:
+		if (len < 6 || nimages == MAX_IMAGES) {
+			fprintf(stderr, "emu: bad open request\n");
+			return -1;
+		}
+		if (need_hello)
+			return send_response(fd, nak, sizeof(nak));
+		img = &images[nimages];
+		memset(img, 0, sizeof(*img));
+		img->type = frame[1];
+		img->size = get_le32(&frame[2]);
+		img->t_open = now();
+		*state = EMU_HEADER;
+		return send_response(fd, open_ack, sizeof(open_ack));
+
+	case 0x29:
+		return 1;
+
+	default:
+		fprintf(stderr, "emu: unhandled command 0x%02x\n", frame[0]);
+		return 0;
+	}
+}
+
+static void report(double t_start, double t_end)
+{
+	struct emu_image *img;
+	double t;
+	int i;
+
+	for (i = 0; i < nimages; i++) {
+		img = &images[i];
+		t = img->t_done - img->t_open;
+		printf("image %s type=0x%02x bytes=%u time=%.6f rate=%.0f\n",
+		       image_name(img->type), img->type, img->received, t,
+		       t > 0 ? img->received / t : 0.0);
+	}
+	printf("session images=%d time=%.6f crc_errors=%lu\n", nimages,
+	       t_end - t_start, crc_errors);
+	fflush(stdout);
+}
+
+/* wait for the loader on a unix socket; the connection */
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int lfd, fd;
+
+	/* listen on a temporary name, so the path only shows up when ready */
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.new", path) >=
+	    sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+
+	unlink(addr.sun_path);
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lfd, 1) || rename(addr.sun_path, path)) {
+		perror("Failed to create socket: ");
+		return -1;
+	}
+	do {
+		fd = accept(lfd, NULL, NULL);
+	} while (fd == -1 && errno == EINTR);
+	if (fd == -1)
+		perror("Failed to accept: ");
+	close(lfd);
+	unlink(path);
+	return fd;
+}
+
+static void usage(char **argv)
+{
+	fprintf(stderr, "usage: %s [-v] [-s] [-u] [-b bytes_per_sec] [-l write_latency_us] "
+		"[-a ack_delay_us] [-c chunk] [-n nak_image] [-r reset_image] "
+		"link_path\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+	enum emu_state state = EMU_FRAME;
+	uint8_t frame[MAX_FRAME];
+	uint8_t hdr[QDL_HDR_LEN];
+	struct hdlc_decoder dec;
+	size_t hlen = 0, used;
+	double t_start = 0, t_rate = 0;
+	uint64_t rate_bytes = 0, seen = 0;
+	struct termios tio;
+	struct emu_image *img;
+	uint8_t *buf;
+	const char *link_path;
+	ssize_t n, i, take;
+	int master, ret, opt, unix_socket = 0;
+
+	while ((opt = getopt(argc, argv, "vsub:l:a:c:n:r:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 's': fragment = 1; break;
+		case 'u': unix_socket = 1; break;
+		case 'b': bandwidth = atol(optarg); break;
+		case 'l': write_latency = atol(optarg); break;
+		case 'a': ack_delay = atol(optarg); break;
+		case 'c': chunk = atol(optarg); break;
+		case 'n': nak_image = atoi(optarg); break;
+		case 'r': reset_image = atoi(optarg); break;
+		default:
+			usage(argv);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1 || chunk == 0) {
+		usage(argv);
+		return -1;
+	}
+	link_path = argv[optind];
+	hdlc_decoder_init(&dec, frame, sizeof(frame));
+
+	buf = malloc(chunk);
+	if (!buf) {
+		fprintf(stderr, "Failed to allocate read buffer\n");
+		return -1;
+	}
+
+	if (unix_socket) {
+		master = listen_socket(link_path);
+		if (master == -1)
+			return -1;
+		goto serve;
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) || unlockpt(master)) {
+		perror("Failed to allocate pty: ");
+		return -1;
+	}
+
+	/* Keep the line discipline out of the way before the loader opens it */
+	tcgetattr(master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(master, TCSANOW, &tio);
+
+	unlink(link_path);
+	if (symlink(ptsname(master), link_path)) {
+		perror("Failed to create link: ");
+		return -1;
+	}
+
+serve:
+	for (;;) {
+		n = read(master, buf, chunk);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			/* EIO once the loader closes the slave side */
+			fprintf(stderr, "emu: link closed before reset\n");
+			report(t_start, now());
+			unlink(link_path);
+			return 1;
+		}
+
+		for (i = 0; i < n; ) {
+			switch (state) {
+			case EMU_FRAME:
+				ret = hdlc_decode(&dec, buf + i, n - i, &used);
+				i += used;
+				if (ret == HDLC_MORE)
+					break;
+				if (!t_start)
+					t_start = now();
+				ret = handle_frame(master, dec.buf, dec.len, ret, &state);
+				if (ret < 0)
+					return 1;
+				if (ret > 0) {
+					report(t_start, now());
+					unlink(link_path);
+					return 0;
+				}
+				/* any bytes after an open ack belong to the header */
+				if (state != EMU_FRAME)
+					hlen = 0;
+				break;
+
+			case EMU_HEADER:
+				take = QDL_HDR_LEN - hlen;
+				if (take > n - i)
+					take = n - i;
+				memcpy(hdr + hlen, buf + i, take);
+				hlen += take;
+				i += take;
+				if (hlen < QDL_HDR_LEN)
+					break;
+				img = &images[nimages];
+				if (hdr[0] != 0x27 || get_le32(&hdr[7]) != img->size)
+					fprintf(stderr, "emu: unexpected image header\n");
+				if (crc_ccitt(0xffff, hdr, QDL_HDR_LEN) != 0xf0b8)
+					crc_errors++;
+				img->t_data = now();
+				t_rate = img->t_data;
+				rate_bytes = seen = 0;
+				state = EMU_IMAGE;
+				if (img->size == 0)
+					goto image_done;
+				break;
+
+			case EMU_IMAGE:
+				img = &images[nimages];
+				take = img->size - img->received;
+				if (take > n - i)
+					take = n - i;
+				img->received += take;
+				rate_bytes += take;
+				i += take;
+				if (img->received < img->size)
+					break;
+			image_done:
+				img = &images[nimages];
+				img->t_done = now();
+				nimages++;
+				state = EMU_FRAME;
+				if (nimages == nak_image || nimages == reset_image) {
+					fprintf(stderr, "emu: rejecting image %d%s\n",
+						nimages, nimages == reset_image ?
+						" and resetting" : "");
+					need_hello = nimages == reset_image;
+					ret = send_response(master,
+						(const uint8_t *)"\x03\x00\x00", 3);
+				} else {
+					ret = send_response(master,
+						(const uint8_t *)"\x28\x00\x00", 3);
+				}
+				if (ret)
+					return 1;
+				break;
+			}
+		}
+
+		/* emulate the link: fixed cost per transfer plus a bandwidth cap */
+		if (rate_bytes != seen) {
+			seen = rate_bytes;
+			sleep_us(write_latency);
+			if (bandwidth) {
+				double due = t_rate + (double)rate_bytes / bandwidth;
+				double t = now();
+
+				if (due > t)
+					sleep_us((due - t) * 1e6);
+			}
+		}
+	}
+}
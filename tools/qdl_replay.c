@@ -0,0 +1,335 @@
+/* Replays the device side of a gobi_loader trace */
+
+/* Copyright 2026 the gobi_loader authors
+ *
+ * Takes a trace written by "gobi_loader -trace" and plays the device's
+ * half of it back on a pseudo-terminal, with the timing it had when it
+ * was recorded, so that a slow or failing load from the field can be run
+ * and profiled again on a desk.
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The records are walked in order. A frame the loader sent is waited for
+ * and its command code checked against the trace; image data is taken off
+ * the link no faster than it went out originally. A response goes out as
+ * long after the loader's preceding frame or data as it came back in the
+ * trace, so device latency, slow acks and timeouts happen again as they
+ * did. Responses that were elided are padded with zeroes to their
+ * original length, and ones that failed to decode are sent with a broken
+ * CRC. -x scales all delays, -x 0 drops them.
+ *
+ * At the end the time the loader took is compared with the trace.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../crc_ccitt.h"
+#include "../hdlc.h"
+#include "../trace.h"
+
+#define MAX_FRAME	512
+#define CHUNK		16384	/* max image bytes taken per read */
+
+static const char *type_names[] = {"tx", "rx", "data"};
+
+static uint8_t in[CHUNK];
+static size_t in_pos, in_len;
+static int master;
+static double scale = 1.0;
+static int verbose;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t)
+{
+	struct timespec ts;
+	double d = t - now();
+
+	if (d <= 0)
+		return;
+	ts.tv_sec = d;
+	ts.tv_nsec = (d - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* make sure there are unread bytes from the loader; -1 once it's gone */
+static int fill(void)
+{
+	ssize_t n;
+
+	if (in_pos < in_len)
+		return 0;
+	do {
+		n = read(master, in, sizeof(in));
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return -1;	/* EIO once the loader closes the slave side */
+	in_pos = 0;
+	in_len = n;
+	return 0;
+}
+
+/* the next HDLC frame from the loader; the decoder result */
+static int take_frame(struct hdlc_decoder *dec)
+{
+	size_t used;
+	int ret;
+
+	for (;;) {
+		if (fill())
+			return -1;
+		ret = hdlc_decode(dec, in + in_pos, in_len - in_pos, &used);
+		in_pos += used;
+		if (ret != HDLC_MORE)
+			return ret;
+	}
+}
+
+/*
+ * Consume len raw bytes from the loader, spread over at least duration
+ * seconds from start. Copies the first bytes to buf, if given.
+ */
+static int take_bytes(uint8_t *buf, size_t buflen, uint64_t len, double start,
+		      double duration)
+{
+	uint64_t got = 0;
+	size_t n;
+
+	while (got < len) {
+		if (fill())
+			return -1;
+		n = in_len - in_pos;
+		if (n > len - got)
+			n = len - got;
+		if (buf && got < buflen)
+			memcpy(buf + got, in + in_pos,
+			       n < buflen - got ? n : buflen - got);
+		in_pos += n;
+		got += n;
+		if (duration > 0)
+			sleep_until(start + duration * got / len);
+	}
+	return 0;
+}
+
+/* a response the loader's decoder will turn down with a CRC error */
+static void break_crc(uint8_t *frame, size_t n)
+{
+	uint8_t c = frame[n - 2] ^ 0x80;
+
+	if (c == HDLC_FLAG || c == HDLC_ESC)
+		c = frame[n - 2] ^ 0x01;
+	frame[n - 2] = c;
+}
+
+static int send_response(const struct trace_record *r, const uint8_t *data,
+			 uint32_t len)
+{
+	uint8_t payload[MAX_FRAME];
+	uint8_t frame[HDLC_ENCODED_MAX(MAX_FRAME)];
+	size_t n;
+
+	if (len > sizeof(payload))
+		len = sizeof(payload);
+	memset(payload, 0, len);
+	memcpy(payload, data, r->stored < len ? r->stored : len);
+
+	n = hdlc_encode(frame, sizeof(frame), payload, len);
+	if (r->flags & TRACE_BAD)
+		break_crc(frame, n);
+	return write_all(master, frame, n);
+}
+
+static void usage(char **argv)
+{
+	fprintf(stderr, "usage: %s [-v] [-x scale] trace link_path\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header *h;
+	struct trace_record r;
+	struct hdlc_decoder dec;
+	struct termios tio;
+	struct stat st;
+	uint8_t frame[MAX_FRAME];
+	uint8_t *trace, *p, *end;
+	const char *link_path;
+	double t_local = 0, t_trace = 0;	/* last loader record, both clocks */
+	double t_first = 0, t_first_trace = 0, t;
+	unsigned nrec = 0;
+	int fd, ret, opt;
+
+	while ((opt = getopt(argc, argv, "vx:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'x': scale = atof(optarg); break;
+		default:
+			usage(argv);
+			return -1;
+		}
+	}
+	if (optind != argc - 2 || scale < 0) {
+		usage(argv);
+		return -1;
+	}
+	link_path = argv[optind + 1];
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd == -1 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return -1;
+	}
+	trace = malloc(st.st_size + 1);
+	if (!trace || read(fd, trace, st.st_size) != st.st_size) {
+		perror(argv[optind]);
+		return -1;
+	}
+	close(fd);
+
+	h = (struct trace_header *)trace;
+	if (st.st_size < sizeof(*h) || memcmp(h->magic, TRACE_MAGIC, 8) ||
+	    get_le32((uint8_t *)&h->version) != TRACE_VERSION) {
+		fprintf(stderr, "%s: not a gobi_loader trace\n", argv[optind]);
+		return -1;
+	}
+	p = trace + sizeof(*h);
+	end = trace + st.st_size;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1 || grantpt(master) || unlockpt(master)) {
+		perror("Failed to allocate pty: ");
+		return -1;
+	}
+	tcgetattr(master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(master, TCSANOW, &tio);
+
+	unlink(link_path);
+	if (symlink(ptsname(master), link_path)) {
+		perror("Failed to create link: ");
+		return -1;
+	}
+	hdlc_decoder_init(&dec, frame, sizeof(frame));
+	t_local = now();
+
+	for (; p + sizeof(r) <= end; p += sizeof(r) + r.stored, nrec++) {
+		memcpy(&r, p, sizeof(r));
+		r.time = get_le32((uint8_t *)&r.time);
+		r.len = get_le32((uint8_t *)&r.len);
+		r.stored = p[10] | p[11] << 8;
+		if (p + sizeof(r) + r.stored > end || r.type > TRACE_DATA) {
+			fprintf(stderr, "replay: trace truncated at record %u\n",
+				nrec);
+			break;
+		}
+		t = r.time / 1e6;
+
+		if (verbose)
+			fprintf(stderr, "replay: %10.6f %-4s 0x%02x %u bytes\n",
+				t, type_names[r.type],
+				r.stored ? p[sizeof(r)] : 0, r.len);
+
+		if (r.type == TRACE_RX) {
+			sleep_until(t_local + (t - t_trace) * scale);
+			if (send_response(&r, p + sizeof(r), r.len))
+				goto gone;
+			continue;
+		}
+
+		if (r.type == TRACE_DATA) {
+			ret = take_bytes(NULL, 0, r.len, t_local,
+					 (t - t_trace) * scale);
+		} else if (r.flags & TRACE_RAW) {
+			ret = take_bytes(frame, sizeof(frame), r.len, 0, 0);
+			if (!ret && r.stored && r.len && frame[0] != p[sizeof(r)])
+				goto diverged;
+		} else {
+			ret = take_frame(&dec);
+			if (ret < 0)
+				goto gone;
+			if (ret != HDLC_FRAME)
+				fprintf(stderr, "replay: bad frame from the "
+					"loader at record %u\n", nrec);
+			else if (r.stored && dec.buf[0] != p[sizeof(r)])
+				goto diverged;
+			ret = 0;
+		}
+		if (ret)
+			goto gone;
+
+		t_local = now();
+		t_trace = t;
+		if (!t_first) {
+			t_first = t_local;
+			t_first_trace = t;
+		}
+	}
+
+	printf("replay records=%u time=%.6f trace=%.6f\n", nrec,
+	       t_local - t_first, t_trace - t_first_trace);
+	unlink(link_path);
+	return 0;
+
+diverged:
+	fprintf(stderr, "replay: loader sent 0x%02x where the trace has 0x%02x "
+		"(record %u)\n", frame[0], p[sizeof(r)], nrec);
+	unlink(link_path);
+	return 1;
+
+gone:
+	fprintf(stderr, "replay: link closed at record %u\n", nrec);
+	unlink(link_path);
+	return 1;
+}
@@ -0,0 +1,303 @@
+/* usbfs stand-in for testing "gobi_loader -transport usbfs" */
+
+/* Copyright 2026 the gobi_loader authors
+ *
+ * An LD_PRELOAD library that makes one /dev/bus/usb node look like a Gobi
+ * in QDL mode, with its bulk endpoints wired to a unix socket, so the
+ * usbfs transport can be run and benchmarked against "tools/qdl_emu -u":
+ *
+ *   tools/qdl_emu -u /tmp/qdl &
+ *   USBFS_MOCK_SOCKET=/tmp/qdl USBFS_MOCK_DEVICE=/dev/bus/usb/001/001 \
+ *   LD_PRELOAD=tools/usbfs_mock.so \
+ *       ./gobi_loader -transport usbfs /dev/bus/usb/001/001 firmware
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Opening USBFS_MOCK_DEVICE connects to USBFS_MOCK_SOCKET and hands out
+ * the socket. Reading it gives a device and configuration descriptor with
+ * one interface and a bulk endpoint each way. Bulk OUT URBs are written to
+ * the socket when submitted and complete right away; bulk IN transfers
+ * read from it, with their timeout. Claiming, releasing and driver
+ * (dis)connects succeed without doing anything.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/usbdevice_fs.h>
+
+#define MOCK_EP_IN	0x81
+#define MOCK_EP_OUT	0x01
+#define MOCK_URBS	64	/* completed URBs waiting to be reaped */
+
+static const uint8_t descriptors[] = {
+	/* device: 05c6:9221, the QDL id of a Gobi 2000 */
+	18, 0x01, 0x00, 0x02, 0xff, 0xff, 0xff, 64,
+	0xc6, 0x05, 0x21, 0x92, 0x00, 0x00, 1, 2, 0, 1,
+	/* configuration */
+	9, 0x02, 32, 0, 1, 1, 0, 0x80, 250,
+	/* interface 0, vendor specific */
+	9, 0x04, 0, 0, 2, 0xff, 0xff, 0xff, 0,
+	/* bulk endpoints, 512 byte packets */
+	7, 0x05, MOCK_EP_IN, 0x02, 0x00, 0x02, 0,
+	7, 0x05, MOCK_EP_OUT, 0x02, 0x00, 0x02, 0,
+};
+
+static int mock_fd = -1;
+static size_t desc_pos;
+static struct usbdevfs_urb *done[MOCK_URBS];
+static unsigned done_head, done_count;
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int mock_open(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *path = getenv("USBFS_MOCK_SOCKET");
+	int fd;
+
+	if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENODEV;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		errno = ENODEV;
+		return -1;
+	}
+	mock_fd = fd;
+	desc_pos = 0;
+	done_count = 0;
+	return fd;
+}
+
+static int is_mock_path(const char *path)
+{
+	const char *dev = getenv("USBFS_MOCK_DEVICE");
+
+	return dev && !strcmp(path, dev);
+}
+
+int open(const char *path, int flags, ...)
+{
+	static int (*real_open)(const char *, int, ...);
+	va_list ap;
+	mode_t mode = 0;
+
+	if (is_mock_path(path))
+		return mock_open();
+
+	if (!real_open)
+		real_open = dlsym(RTLD_NEXT, "open");
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+	static int (*real_open64)(const char *, int, ...);
+	va_list ap;
+	mode_t mode = 0;
+
+	if (is_mock_path(path))
+		return mock_open();
+
+	if (!real_open64)
+		real_open64 = dlsym(RTLD_NEXT, "open64");
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	return real_open64(path, flags, mode);
+}
+
+int __open_2(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+int __open64_2(const char *path, int flags)
+{
+	return open64(path, flags);
+}
+
+ssize_t read(int fd, void *buf, size_t len)
+{
+	static ssize_t (*real_read)(int, void *, size_t);
+
+	if (fd == mock_fd && fd != -1) {
+		if (len > sizeof(descriptors) - desc_pos)
+			len = sizeof(descriptors) - desc_pos;
+		memcpy(buf, descriptors + desc_pos, len);
+		desc_pos += len;
+		return len;
+	}
+	if (!real_read)
+		real_read = dlsym(RTLD_NEXT, "read");
+	return real_read(fd, buf, len);
+}
+
+ssize_t __read_chk(int fd, void *buf, size_t len, size_t buflen)
+{
+	return read(fd, buf, len);
+}
+
+int close(int fd)
+{
+	static int (*real_close)(int);
+
+	if (fd == mock_fd && fd != -1)
+		mock_fd = -1;
+	if (!real_close)
+		real_close = dlsym(RTLD_NEXT, "close");
+	return real_close(fd);
+}
+
+static int mock_submit(struct usbdevfs_urb *urb)
+{
+	if (urb->type != USBDEVFS_URB_TYPE_BULK ||
+	    urb->endpoint != MOCK_EP_OUT || done_count == MOCK_URBS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (write_all(mock_fd, urb->buffer, urb->buffer_length)) {
+		errno = ENODEV;
+		return -1;
+	}
+	urb->status = 0;
+	urb->actual_length = urb->buffer_length;
+	done[(done_head + done_count++) % MOCK_URBS] = urb;
+	return 0;
+}
+
+static int mock_reap(struct usbdevfs_urb **urb)
+{
+	if (!done_count) {
+		errno = EAGAIN;
+		return -1;
+	}
+	*urb = done[done_head];
+	done_head = (done_head + 1) % MOCK_URBS;
+	done_count--;
+	return 0;
+}
+
+static int mock_bulk(struct usbdevfs_bulktransfer *bulk)
+{
+	struct pollfd pfd = { .fd = mock_fd, .events = POLLIN };
+	ssize_t n;
+	int ret;
+
+	if (bulk->ep == MOCK_EP_OUT)
+		return write_all(mock_fd, bulk->data, bulk->len) ? -1 :
+		       (int)bulk->len;
+	if (bulk->ep != MOCK_EP_IN) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ret = poll(&pfd, 1, bulk->timeout ? (int)bulk->timeout : -1);
+	if (ret <= 0) {
+		if (ret == 0)
+			errno = ETIMEDOUT;
+		return -1;
+	}
+	n = recv(mock_fd, bulk->data, bulk->len, 0);
+	if (n <= 0) {
+		errno = n ? errno : ENODEV;
+		return -1;
+	}
+	return n;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*real_ioctl)(int, unsigned long, ...);
+	struct usbdevfs_ioctl *cmd;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (fd != mock_fd || fd == -1) {
+		if (!real_ioctl)
+			real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+		return real_ioctl(fd, request, arg);
+	}
+
+	switch (request) {
+	case USBDEVFS_SUBMITURB:
+		return mock_submit(arg);
+	case USBDEVFS_REAPURB:
+	case USBDEVFS_REAPURBNDELAY:
+		return mock_reap(arg);
+	case USBDEVFS_DISCARDURB:
+		errno = EINVAL;		/* they all completed on submit */
+		return -1;
+	case USBDEVFS_BULK:
+		return mock_bulk(arg);
+	case USBDEVFS_CLAIMINTERFACE:
+	case USBDEVFS_RELEASEINTERFACE:
+	case USBDEVFS_CONNECTINFO:
+		return 0;
+	case USBDEVFS_IOCTL:
+		cmd = arg;
+		if (cmd->ioctl_code == USBDEVFS_DISCONNECT) {
+			errno = ENODATA;	/* no driver bound */
+			return -1;
+		}
+		return 0;
+	}
+	errno = ENOTTY;
+	return -1;
+}
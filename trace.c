@@ -0,0 +1,150 @@
+/* QDL session traces for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With -trace file the loader logs every command frame it sends and every
+ * response it gets, unescaped and without the CRC, with the time since
+ * the start of the load. Image data is only logged as the number of bytes
+ * each transfer pushed out, so a trace of a full load stays at a few
+ * hundred bytes. -trace-elide also drops everything but the command code
+ * of each frame, for traces that go out of the building.
+ *
+ * Records are flushed as they are written: a load makes a dozen or so of
+ * them, and a trace should survive the loader being killed by udev.
+ * tools/qdl_replay plays the device side of a trace back on a pty.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "hdlc.h"
+#include "gobi_loader.h"
+
+#define TRACE_FRAME_MAX	512	/* larger frames are logged raw */
+
+static FILE *trace;
+static int trace_elide;
+static long long trace_start;
+
+/**
+ * trace_open - start tracing the load to path
+ * @path: trace file, replaced if it exists
+ * @elide: only keep the command code of each frame
+ *
+ * Returns 0, or -1 with errno set.
+ */
+int trace_open(const char *path, int elide)
+{
+	struct trace_header h;
+
+	trace = fopen(path, "w");
+	if (!trace)
+		return -1;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.version = SWAPL32(TRACE_VERSION);
+	h.flags = SWAPL32(elide ? TRACE_ELIDED : 0);
+	h.wall = SWAPL64((uint64_t)time(NULL));
+	if (fwrite(&h, sizeof(h), 1, trace) != 1 || fflush(trace)) {
+		fclose(trace);
+		trace = NULL;
+		return -1;
+	}
+	trace_elide = elide;
+	trace_start = monotonic_us();
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (trace)
+		fclose(trace);
+	trace = NULL;
+}
+
+static void trace_record(int type, int flags, const void *data, size_t stored,
+			 uint64_t len)
+{
+	struct trace_record r;
+
+	r.time = SWAPL32((uint32_t)(monotonic_us() - trace_start));
+	r.len = SWAPL32((uint32_t)len);
+	r.type = type;
+	r.flags = flags;
+	r.stored = SWAPL16((uint16_t)stored);
+	fwrite(&r, sizeof(r), 1, trace);
+	if (stored)
+		fwrite(data, stored, 1, trace);
+	fflush(trace);
+}
+
+/**
+ * trace_frame - log a decoded frame
+ * @type: TRACE_TX or TRACE_RX
+ * @flags: TRACE_RAW, TRACE_BAD
+ * @frame: frame contents, CRC stripped
+ * @len: length of frame
+ */
+void trace_frame(int type, int flags, const void *frame, size_t len)
+{
+	size_t stored = len;
+
+	if (!trace)
+		return;
+	if (stored > UINT16_MAX)
+		stored = UINT16_MAX;
+	if (trace_elide && stored > 1) {
+		stored = 1;
+		flags |= TRACE_ELIDED;
+	}
+	trace_record(type, flags, frame, stored, len);
+}
+
+/**
+ * trace_tx - log a frame as it was written to the device
+ * @wire: HDLC framed command, or raw bytes such as the image header
+ * @len: bytes written
+ */
+void trace_tx(const void *wire, size_t len)
+{
+	uint8_t frame[TRACE_FRAME_MAX];
+	struct hdlc_decoder dec;
+	size_t used;
+
+	if (!trace)
+		return;
+
+	hdlc_decoder_init(&dec, frame, sizeof(frame));
+	if (len && *(const uint8_t *)wire == HDLC_FLAG &&
+	    hdlc_decode(&dec, wire, len, &used) == HDLC_FRAME && used == len) {
+		trace_frame(TRACE_TX, 0, dec.buf, dec.len);
+		return;
+	}
+	trace_frame(TRACE_TX, TRACE_RAW, wire, len);
+}
+
+/**
+ * trace_data - log that len bytes of image data went out
+ * @len: bytes sent since the last record
+ */
+void trace_data(uint64_t len)
+{
+	if (trace)
+		trace_record(TRACE_DATA, 0, NULL, 0, len);
+}
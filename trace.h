@@ -0,0 +1,47 @@
+/* QDL session traces: every frame on the wire, with timestamps */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC	"GOBITRC\n"
+#define TRACE_VERSION	1
+
+/*
+ * A trace is this header followed by records, each a struct trace_record
+ * and its stored bytes. Little endian on disk.
+ */
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;		/* TRACE_ELIDED if frames were cut short */
+	uint64_t wall;		/* start of the trace, seconds since the epoch */
+} __attribute__((packed));
+
+/* record types */
+#define TRACE_TX	0	/* frame sent to the device */
+#define TRACE_RX	1	/* frame received from it */
+#define TRACE_DATA	2	/* image bytes sent, size only */
+
+/* record flags */
+#define TRACE_RAW	0x01	/* not HDLC framed, stored as written */
+#define TRACE_ELIDED	0x02	/* only the command code is stored */
+#define TRACE_BAD	0x04	/* received frame failed to decode */
+
+struct trace_record {
+	uint32_t time;		/* usec since the start of the trace */
+	uint32_t len;		/* decoded frame, CRC stripped, or data bytes */
+	uint8_t type;
+	uint8_t flags;
+	uint16_t stored;	/* bytes that follow the record */
+} __attribute__((packed));
+
+int trace_open(const char *path, int elide);
+void trace_close(void);
+void trace_frame(int type, int flags, const void *frame, size_t len);
+void trace_tx(const void *wire, size_t len);
+void trace_data(uint64_t len);
+
+#endif
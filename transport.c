@@ -0,0 +1,320 @@
+/* Device links for gobi_loader: tty and socket */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The protocol code talks to the device through a struct transport:
+ *
+ *   tty     the qcserial ttyUSB, in raw mode (the default)
+ *   usbfs   the bulk endpoints of the same USB interface, claimed from
+ *           qcserial through /dev/bus/usb, see usbfs.c
+ *   socket  a unix stream socket with a stand-in device on the other
+ *           end, e.g. "tools/qdl_emu -u"
+ *
+ * tty and socket links are file descriptors that carry a plain byte
+ * stream, so sendfile(), mmap writes and io_uring work on them as they
+ * are. A usbfs link only moves data with its own write().
+ *
+ * A few bytes can be held back with transport_hold() to go out in the
+ * same writev() as the next write, which is how an image's raw header
+ * rides along with the first chunk of its data instead of costing a
+ * write of its own.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "transport.h"
+#include "gobi_loader.h"
+#include "metrics.h"
+#include "trace.h"
+
+static ssize_t fd_write(struct transport *t, const void *buf, size_t len)
+{
+	ssize_t n = write(t->fd, buf, len);
+
+	io_account(1, n > 0 ? n : 0, 0);
+	return n;
+}
+
+static ssize_t fd_writev(struct transport *t, const struct iovec *iov,
+			 int iovcnt)
+{
+	ssize_t n = writev(t->fd, iov, iovcnt);
+
+	io_account(1, n > 0 ? n : 0, 0);
+	return n;
+}
+
+static ssize_t fd_read(struct transport *t, void *buf, size_t len,
+		       int timeout)
+{
+	struct pollfd pfd = { .fd = t->fd, .events = POLLIN };
+	ssize_t n;
+	int ret;
+
+	ret = poll(&pfd, 1, timeout);
+	io_account(1, 0, 0);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	if (ret == 0)
+		return 0;
+
+	n = read(t->fd, buf, len);
+	io_account(1, 0, n > 0 ? n : 0);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (n == 0)
+		errno = ENODEV;
+	return n ? n : -1;
+}
+
+static int fd_gone(struct transport *t)
+{
+	struct pollfd pfd = { .fd = t->fd, .events = 0 };
+
+	io_account(1, 0, 0);
+	return poll(&pfd, 1, 0) == 1 &&
+		(pfd.revents & (POLLHUP | POLLERR | POLLNVAL));
+}
+
+static void fd_close(struct transport *t)
+{
+	close(t->fd);
+}
+
+static int tty_open(struct transport *t, const char *path)
+{
+	struct termios terminal_data;
+
+	t->fd = open(path, O_RDWR);
+	if (t->fd == -1)
+		return -1;
+	tcgetattr(t->fd, &terminal_data);
+	cfmakeraw(&terminal_data);
+	tcsetattr(t->fd, TCSANOW, &terminal_data);
+	t->stream = 1;
+	return 0;
+}
+
+static int tty_drain(struct transport *t)
+{
+	io_account(1, 0, 0);
+	return tcdrain(t->fd);
+}
+
+static void tty_flush(struct transport *t, int queue)
+{
+	tcflush(t->fd, queue);
+}
+
+static const struct transport_ops tty_ops = {
+	.name = "tty",
+	.open = tty_open,
+	.write = fd_write,
+	.writev = fd_writev,
+	.read = fd_read,
+	.drain = tty_drain,
+	.flush = tty_flush,
+	.gone = fd_gone,
+	.close = fd_close,
+};
+
+static int socket_open(struct transport *t, const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	t->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (t->fd == -1)
+		return -1;
+	if (connect(t->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(t->fd);
+		return -1;
+	}
+	t->stream = 1;
+	return 0;
+}
+
+/* the peer has everything once send() returned */
+static int socket_drain(struct transport *t)
+{
+	return 0;
+}
+
+static void socket_flush(struct transport *t, int queue)
+{
+	char buf[256];
+
+	while (recv(t->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		;
+}
+
+static const struct transport_ops socket_ops = {
+	.name = "socket",
+	.open = socket_open,
+	.write = fd_write,
+	.writev = fd_writev,
+	.read = fd_read,
+	.drain = socket_drain,
+	.flush = socket_flush,
+	.gone = fd_gone,
+	.close = fd_close,
+};
+
+const struct transport_ops *transports[TRANSPORTS] = {
+	[TRANSPORT_TTY] = &tty_ops,
+	[TRANSPORT_USBFS] = &usbfs_ops,
+	[TRANSPORT_SOCKET] = &socket_ops,
+};
+
+/* TRANSPORT_* for a -transport argument, or -1 */
+int transport_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < TRANSPORTS; i++)
+		if (!strcmp(name, transports[i]->name))
+			return i;
+	return -1;
+}
+
+/**
+ * transport_open - connect to the device
+ * @t: link to set up
+ * @type: TRANSPORT_TTY, TRANSPORT_USBFS or TRANSPORT_SOCKET
+ * @path: serial device, USB device node or socket
+ *
+ * Returns 0, or -1 with errno set.
+ */
+int transport_open(struct transport *t, int type, const char *path)
+{
+	memset(t, 0, sizeof(*t));
+	t->fd = -1;
+	t->ops = transports[type];
+	return t->ops->open(t, path);
+}
+
+/* a link opened O_NONBLOCK for -write poll is full; wait for room */
+static int transport_wait_writable(struct transport *t)
+{
+	struct pollfd pfd = { .fd = t->fd, .events = POLLOUT };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, TIMEOUT_IMAGE);
+		io_account(1, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret == 0)
+		errno = ETIMEDOUT;
+	return ret > 0 ? 0 : -1;
+}
+
+/* the held bytes are gone once n bytes of a write went out */
+void transport_sent_held(struct transport *t, size_t n)
+{
+	if (n < t->held_len) {
+		t->held += n;
+		t->held_len -= n;
+		return;
+	}
+	trace_tx(t->held + t->held_len - t->held_size, t->held_size);
+	t->held = NULL;
+	t->held_len = t->held_size = 0;
+}
+
+/**
+ * transport_write_all - write all of buf, after any held bytes
+ * @t: link to the device
+ * @buf: data
+ * @len: length of data
+ * @sent: if not NULL, set to the bytes of buf that went out
+ *
+ * Returns 0, or -1 with errno set. On error the held bytes that didn't
+ * go out are still held and *sent tells a caller where to resume.
+ */
+int transport_write_all(struct transport *t, const void *buf, size_t len,
+			size_t *sent)
+{
+	const char *p = buf;
+	struct iovec iov[2];
+	size_t held;
+	ssize_t n;
+
+	if (sent)
+		*sent = 0;
+	while (len || t->held_len) {
+		held = t->held_len;
+		if (held && t->ops->writev) {
+			iov[0].iov_base = (void *)t->held;
+			iov[0].iov_len = held;
+			iov[1].iov_base = (void *)p;
+			iov[1].iov_len = len;
+			n = t->ops->writev(t, iov, len ? 2 : 1);
+		} else if (held) {
+			n = t->ops->write(t, t->held, held);
+		} else {
+			n = t->ops->write(t, p, len);
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && !transport_wait_writable(t))
+				continue;
+			return -1;
+		}
+		if (held) {
+			transport_sent_held(t, n);
+			n = (size_t)n > held ? n - held : 0;
+		}
+		p += n;
+		len -= n;
+		if (sent)
+			*sent += n;
+	}
+	return 0;
+}
+
+/**
+ * transport_hold - send bytes with the next write
+ * @t: link to the device
+ * @buf: data, which must stay valid until it is sent
+ * @len: length of data
+ *
+ * The bytes are logged with trace_tx() once they are out.
+ */
+void transport_hold(struct transport *t, const void *buf, size_t len)
+{
+	t->held = buf;
+	t->held_len = t->held_size = len;
+}
+
+/* send the held bytes on their own */
+int transport_flush_held(struct transport *t)
+{
+	return t->held_len ? transport_write_all(t, NULL, 0, NULL) : 0;
+}
@@ -0,0 +1,67 @@
+/* The link to the device: serial tty, usbfs bulk endpoints or a socket */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TRANSPORT_TTY		0
+#define TRANSPORT_USBFS		1
+#define TRANSPORT_SOCKET	2
+#define TRANSPORTS		3
+
+#define USBFS_RBUF	4096	/* a multiple of any bulk packet size */
+
+struct transport;
+
+/*
+ * read returns the bytes read, 0 if none came within timeout ms, or -1
+ * once the device is gone. flush takes TCIFLUSH or TCIOFLUSH. writev may
+ * be NULL if the link gains nothing from it.
+ */
+struct transport_ops {
+	const char *name;
+	int (*open)(struct transport *t, const char *path);
+	ssize_t (*write)(struct transport *t, const void *buf, size_t len);
+	ssize_t (*writev)(struct transport *t, const struct iovec *iov,
+			  int iovcnt);
+	ssize_t (*read)(struct transport *t, void *buf, size_t len,
+			int timeout);
+	int (*drain)(struct transport *t);
+	void (*flush)(struct transport *t, int queue);
+	int (*gone)(struct transport *t);
+	void (*close)(struct transport *t);
+};
+
+struct transport {
+	const struct transport_ops *ops;
+	int fd;
+	int stream;		/* fd takes write(), sendfile() and io_uring */
+
+	/* see transport_hold() */
+	const uint8_t *held;
+	size_t held_len;	/* still to go out */
+	size_t held_size;
+
+	/* usbfs */
+	unsigned intf;
+	uint8_t ep_in, ep_out;
+	size_t rpos, rlen;	/* unread part of rbuf */
+	uint8_t rbuf[USBFS_RBUF];
+};
+
+extern const struct transport_ops *transports[TRANSPORTS];
+extern const struct transport_ops usbfs_ops;
+
+int transport_find(const char *name);
+int transport_open(struct transport *t, int type, const char *path);
+int transport_write_all(struct transport *t, const void *buf, size_t len,
+			size_t *sent);
+void transport_hold(struct transport *t, const void *buf, size_t len);
+int transport_flush_held(struct transport *t);
+void transport_sent_held(struct transport *t, size_t n);
+
+#endif
@@ -0,0 +1,135 @@
+/* Per-device transfer tuning for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "gobi_loader -tune" times slices of the amss image with different chunk
+ * sizes and write strategies and stores the fastest setting here, one line
+ * per device model:
+ *
+ *   <vid>:<pid> chunk=<bytes> write=<plain|drain|poll> rate=<bytes/s>
+ *
+ * Later loads look the device up and use that setting unless -chunk or
+ * -write is given. Devices without a USB parent (e.g. a pty stand-in)
+ * are stored as 0000:0000.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tune.h"
+
+const char *tune_write_names[TUNE_WRITE_MODES] = { "plain", "drain", "poll" };
+
+int tune_write_mode(const char *name)
+{
+	int i;
+
+	for (i = 0; i < TUNE_WRITE_MODES; i++)
+		if (!strcmp(name, tune_write_names[i]))
+			return i;
+	return -1;
+}
+
+static int parse_line(const char *line, struct tune *t)
+{
+	unsigned vid, pid;
+	unsigned long chunk;
+	char write[16];
+	double rate;
+
+	if (sscanf(line, "%x:%x chunk=%lu write=%15s rate=%lf",
+		   &vid, &pid, &chunk, write, &rate) != 5)
+		return -1;
+	t->vid = vid;
+	t->pid = pid;
+	t->chunk = chunk;
+	t->write = tune_write_mode(write);
+	t->rate = rate;
+	if (t->write < 0 || chunk < TUNE_CHUNK_MIN || chunk > TUNE_CHUNK_MAX)
+		return -1;
+	return 0;
+}
+
+/* fill in the stored setting for t->vid:t->pid; 0 if there is one */
+int tune_load(const char *file, struct tune *t)
+{
+	char line[128];
+	struct tune e;
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(file, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (parse_line(line, &e) || e.vid != t->vid || e.pid != t->pid)
+			continue;
+		*t = e;
+		ret = 0;
+	}
+	fclose(f);
+	return ret;
+}
+
+/* replace the entry for t->vid:t->pid, keeping all other devices */
+int tune_save(const char *file, const struct tune *t)
+{
+	char tmp[PATH_MAX], dir[PATH_MAX], line[128], *slash;
+	struct tune e;
+	FILE *in, *out;
+	int fd;
+
+	snprintf(dir, sizeof(dir), "%s", file);
+	slash = strrchr(dir, '/');
+	if (slash && slash != dir) {
+		*slash = '\0';
+		mkdir(dir, 0755);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	in = fopen(file, "r");
+	if (in) {
+		while (fgets(line, sizeof(line), in))
+			if (!parse_line(line, &e) &&
+			    (e.vid != t->vid || e.pid != t->pid))
+				fputs(line, out);
+		fclose(in);
+	}
+	fprintf(out, "%04x:%04x chunk=%zu write=%s rate=%.0f\n", t->vid, t->pid,
+		t->chunk, tune_write_names[t->write], t->rate);
+
+	fchmod(fd, 0644);
+	if (fclose(out) || rename(tmp, file)) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
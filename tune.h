@@ -0,0 +1,41 @@
+/* Per-device transfer tuning, persisted by USB VID:PID */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TUNE_FILE	"/var/lib/gobi_loader/tune"
+
+/* how image chunks are handed to the serial device */
+#define TUNE_WRITE_PLAIN	0	/* blocking write() */
+#define TUNE_WRITE_DRAIN	1	/* write(), then tcdrain() per chunk */
+#define TUNE_WRITE_POLL		2	/* O_NONBLOCK, wait for POLLOUT */
+#define TUNE_WRITE_MODES	3
+
+#define TUNE_CHUNK_MIN	4096
+#ifdef STATIC_RING
+#define TUNE_CHUNK_MAX	STATIC_RING	/* chunks are read into the ring */
+#if STATIC_RING < TUNE_CHUNK_MIN
+#error RING must be at least 4096 bytes
+#endif
+#else
+#define TUNE_CHUNK_MAX	(1024 * 1024)
+#endif
+
+extern const char *tune_write_names[TUNE_WRITE_MODES];
+
+struct tune {
+	uint16_t vid;
+	uint16_t pid;
+	size_t chunk;
+	int write;
+	double rate;		/* bytes/s measured for this setting */
+};
+
+int tune_write_mode(const char *name);
+int tune_load(const char *file, struct tune *t);
+int tune_save(const char *file, const struct tune *t);
+
+#endif
@@ -0,0 +1,651 @@
+/* Streaming decompression of firmware images for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Images can be stored compressed, as name.mbn.xz or name.mbn.lz4, to fit
+ * small flash. They are recognised by their magic, and the size the device
+ * is told about comes from the container: the index at the end of an xz
+ * stream, the content size field of an LZ4 frame. Nothing is unpacked to
+ * disk; unpack_pread() hands out the image sequentially, and the pipeline
+ * calls it from its reader thread so decoding overlaps with the link.
+ *
+ * xz goes through liblzma (built with XZ=1, the default). LZ4 frames are
+ * decoded here, the format is small enough; only frames written with
+ * --content-size are accepted, and their checksums aren't verified since
+ * the device checks every image it receives anyway.
+ *
+ * A recipe from "gobi_loader import" is handled here as well, by handing
+ * the reads to store.c, which puts the image together from its chunks.
+ *
+ * Reads are expected in order. Reading behind the current position, as a
+ * retried stage does, starts decoding again from the beginning; reading
+ * ahead of it decodes and drops the data in between.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#include "unpack.h"
+#include "store.h"
+#include "metrics.h"
+
+#define UNPACK_IN	(64 * 1024)	/* xz input buffer */
+
+#define LZ4_MAGIC	0x184d2204
+#define LZ4_HISTORY	(64 * 1024)	/* furthest a match can reach back */
+#define LZ4_FLG_BSUM	0x10
+#define LZ4_FLG_SIZE	0x08
+#define LZ4_FLG_DICT	0x01
+#define LZ4_UNCOMPRESSED	0x80000000u
+
+const char *unpack_suffixes[] = { "", ".lz4", ".xz", NULL };
+const char *unpack_names[UNPACK_CODECS] = { "raw", "xz", "lz4", "chunks" };
+
+static const uint8_t xz_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+struct unpack {
+	int fd;
+	off_t base;		/* compressed data in fd */
+	uint64_t stored;
+	int codec;
+	uint64_t in_off;	/* next compressed byte, relative to base */
+	uint64_t pos;		/* uncompressed bytes handed out so far */
+	uint64_t size;		/* uncompressed size */
+#ifdef HAVE_LZMA
+	lzma_stream strm;
+	lzma_action action;
+#endif
+	/* LZ4 */
+	unsigned flags;
+	uint64_t data;		/* first block, relative to base */
+	size_t block_max;
+	uint8_t *win;		/* history, then the block being handed out */
+	size_t win_size;
+	size_t out_pos;		/* next byte of win to hand out */
+	size_t out_end;		/* end of the decoded data in win */
+	int done;		/* end mark seen */
+	struct store_image *store;
+	uint8_t in[];
+};
+
+#ifdef STATIC_RING
+/*
+ * Without a heap one image is unpacked at a time, into buffers sized for
+ * LZ4 blocks of up to 64KB ("lz4 -B4"); larger blocks are turned down.
+ */
+#define UNPACK_STATIC_BLOCK	(64 * 1024)
+
+static uint64_t unpack_mem[(sizeof(struct unpack) + UNPACK_STATIC_BLOCK +
+			    sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+static uint8_t unpack_win[LZ4_HISTORY + UNPACK_STATIC_BLOCK];
+static int unpack_busy;
+#endif
+
+/* state with in bytes of input buffer and a window of win bytes */
+static struct unpack *unpack_alloc(size_t in, size_t win)
+{
+	struct unpack *u;
+
+#ifdef STATIC_RING
+	if (unpack_busy) {
+		errno = EBUSY;
+		return NULL;
+	}
+	if (in > UNPACK_STATIC_BLOCK || win > sizeof(unpack_win)) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+	u = (struct unpack *)unpack_mem;
+	memset(u, 0, sizeof(*u));
+	u->win = win ? unpack_win : NULL;
+	unpack_busy = 1;
+#else
+	u = calloc(1, sizeof(*u) + in);
+	if (!u)
+		return NULL;
+	if (win) {
+		u->win = malloc(win);
+		if (!u->win) {
+			free(u);
+			return NULL;
+		}
+	}
+#endif
+	u->win_size = win;
+	return u;
+}
+
+static void unpack_free(struct unpack *u)
+{
+#ifdef STATIC_RING
+	unpack_busy = 0;
+#else
+	free(u->win);
+	free(u);
+#endif
+}
+
+static int read_at(struct unpack *u, void *buf, size_t len, uint64_t off)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(u->fd, buf, len, u->base + off);
+		io_account(1, 0, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;	/* image shrank */
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * LZ4 frame header: flags, block size and the content size; sets *data to
+ * the first block header. Returns the largest block size, or 0 with errno
+ * set.
+ */
+static size_t lz4_header(const uint8_t *p, size_t len, unsigned *flags,
+			 uint64_t *size, uint64_t *data)
+{
+	static const size_t block_max[8] = {
+		[4] = 64 * 1024, [5] = 256 * 1024, [6] = 1024 * 1024,
+		[7] = 4 * 1024 * 1024
+	};
+	size_t hlen;
+	int i;
+
+	if (len < 7 || (p[4] & 0xc0) != 0x40 || !block_max[p[5] >> 4 & 7]) {
+		errno = EINVAL;
+		return 0;
+	}
+	*flags = p[4];
+	if (!(*flags & LZ4_FLG_SIZE) || *flags & LZ4_FLG_DICT) {
+		errno = ENOTSUP;	/* not written with --content-size */
+		return 0;
+	}
+	hlen = 4 + 2 + 8 + 1;
+	if (len < hlen) {
+		errno = EINVAL;
+		return 0;
+	}
+	*size = 0;
+	for (i = 7; i >= 0; i--)
+		*size = *size << 8 | p[6 + i];
+	*data = hlen;
+	return block_max[p[5] >> 4 & 7];
+}
+
+#ifdef HAVE_LZMA
+/* the uncompressed size, from the index at the end of the stream */
+static int xz_size(struct unpack *u, uint64_t *size)
+{
+	uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+	lzma_stream_flags flags;
+	lzma_index *idx = NULL;
+	uint64_t memlimit = UINT64_MAX;
+	uint8_t *buf;
+	size_t pos = 0;
+	int ret;
+
+	if (u->stored < 2 * LZMA_STREAM_HEADER_SIZE ||
+	    read_at(u, footer, sizeof(footer), u->stored - sizeof(footer)))
+		goto invalid;
+	if (lzma_stream_footer_decode(&flags, footer) != LZMA_OK ||
+	    flags.backward_size > u->stored - 2 * LZMA_STREAM_HEADER_SIZE)
+		goto invalid;
+
+	buf = malloc(flags.backward_size);
+	if (!buf)
+		return -1;
+	ret = read_at(u, buf, flags.backward_size,
+		      u->stored - sizeof(footer) - flags.backward_size);
+	if (!ret && lzma_index_buffer_decode(&idx, &memlimit, NULL, buf, &pos,
+					     flags.backward_size) != LZMA_OK)
+		ret = -1;
+	free(buf);
+	if (ret)
+		goto invalid;
+
+	/* one stream without padding, as xz writes it */
+	if (lzma_index_file_size(idx) != u->stored) {
+		lzma_index_end(idx, NULL);
+		goto invalid;
+	}
+	*size = lzma_index_uncompressed_size(idx);
+	lzma_index_end(idx, NULL);
+	return 0;
+
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+static int xz_start(struct unpack *u)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+
+	lzma_end(&u->strm);
+	u->strm = init;
+	u->action = LZMA_RUN;
+	if (lzma_stream_decoder(&u->strm, UINT64_MAX, 0) != LZMA_OK) {
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t xz_decode(struct unpack *u, uint8_t *out, size_t len)
+{
+	lzma_ret ret;
+	size_t n;
+
+	u->strm.next_out = out;
+	u->strm.avail_out = len;
+	while (u->strm.avail_out) {
+		if (!u->strm.avail_in && u->action == LZMA_RUN) {
+			n = u->stored - u->in_off;
+			if (n > UNPACK_IN)
+				n = UNPACK_IN;
+			if (read_at(u, u->in, n, u->in_off))
+				return -1;
+			u->in_off += n;
+			u->strm.next_in = u->in;
+			u->strm.avail_in = n;
+			if (u->in_off == u->stored)
+				u->action = LZMA_FINISH;
+		}
+		ret = lzma_code(&u->strm, u->action);
+		if (ret == LZMA_STREAM_END)
+			break;
+		if (ret != LZMA_OK) {
+			errno = ret == LZMA_MEM_ERROR ? ENOMEM : EBADMSG;
+			return -1;
+		}
+	}
+	return len - u->strm.avail_out;
+}
+#endif
+
+/*
+ * Decode one LZ4 block from src into win + start, at most cap bytes.
+ * Matches may reach back into earlier blocks kept in win.
+ */
+static ssize_t lz4_block(const uint8_t *src, size_t srclen, uint8_t *win,
+			 size_t start, size_t cap)
+{
+	const uint8_t *ip = src, *iend = src + srclen;
+	uint8_t *op = win + start, *oend = win + start + cap;
+	const uint8_t *match;
+	size_t lit, mlen, moff;
+	unsigned token, b;
+
+	for (;;) {
+		if (ip >= iend)
+			goto corrupt;
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15)
+			do {
+				if (ip >= iend)
+					goto corrupt;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			goto corrupt;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;			/* the last sequence has no match */
+
+		if (iend - ip < 2)
+			goto corrupt;
+		moff = ip[0] | ip[1] << 8;
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15)
+			do {
+				if (ip >= iend)
+					goto corrupt;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		mlen += 4;
+		if (!moff || moff > (size_t)(op - win) ||
+		    mlen > (size_t)(oend - op))
+			goto corrupt;
+		match = op - moff;
+		if (moff >= mlen) {
+			memcpy(op, match, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)		/* overlapping, repeats a pattern */
+				*op++ = *match++;
+		}
+	}
+	return op - (win + start);
+
+corrupt:
+	errno = EBADMSG;
+	return -1;
+}
+
+/* decode the next block into win; 0 at the end of the frame */
+static int lz4_next(struct unpack *u)
+{
+	uint8_t hdr[4];
+	uint32_t bsize;
+	size_t keep;
+	ssize_t n;
+
+	if (u->done)
+		return 0;
+	if (read_at(u, hdr, sizeof(hdr), u->in_off))
+		return -1;
+	u->in_off += sizeof(hdr);
+	bsize = get_le32(hdr);
+	if (!bsize) {
+		u->done = 1;
+		if (u->pos + u->out_end - u->out_pos != u->size) {
+			errno = EBADMSG;
+			return -1;
+		}
+		return 0;
+	}
+	if ((bsize & ~LZ4_UNCOMPRESSED) > u->block_max) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	/* keep the last LZ4_HISTORY bytes in front of the new block */
+	if (u->out_end + u->block_max > u->win_size) {
+		keep = u->out_end < LZ4_HISTORY ? u->out_end : LZ4_HISTORY;
+		memmove(u->win, u->win + u->out_end - keep, keep);
+		u->out_end = keep;
+	}
+	if (bsize & LZ4_UNCOMPRESSED) {
+		bsize &= ~LZ4_UNCOMPRESSED;
+		if (read_at(u, u->win + u->out_end, bsize, u->in_off))
+			return -1;
+		n = bsize;
+	} else {
+		if (read_at(u, u->in, bsize, u->in_off))
+			return -1;
+		n = lz4_block(u->in, bsize, u->win, u->out_end, u->block_max);
+		if (n < 0)
+			return -1;
+	}
+	u->in_off += bsize + (u->flags & LZ4_FLG_BSUM ? 4 : 0);
+	u->out_pos = u->out_end;
+	u->out_end += n;
+	return 1;
+}
+
+static ssize_t lz4_decode(struct unpack *u, uint8_t *out, size_t len)
+{
+	size_t done = 0, n;
+	int ret;
+
+	while (done < len) {
+		if (u->out_pos == u->out_end) {
+			ret = lz4_next(u);
+			if (ret < 0)
+				return -1;
+			if (!ret)
+				break;
+			continue;
+		}
+		n = u->out_end - u->out_pos;
+		if (n > len - done)
+			n = len - done;
+		memcpy(out + done, u->win + u->out_pos, n);
+		u->out_pos += n;
+		done += n;
+	}
+	return done;
+}
+
+/* back to the first byte of the image */
+static int unpack_rewind(struct unpack *u)
+{
+	u->pos = 0;
+	u->in_off = u->data;
+	u->out_pos = u->out_end = 0;
+	u->done = 0;
+#ifdef HAVE_LZMA
+	if (u->codec == UNPACK_XZ)
+		return xz_start(u);
+#endif
+	return 0;
+}
+
+static ssize_t unpack_decode(struct unpack *u, uint8_t *out, size_t len)
+{
+	ssize_t n;
+
+	if (u->pos >= u->size)
+		return 0;
+	if (len > u->size - u->pos)
+		len = u->size - u->pos;
+#ifdef HAVE_LZMA
+	if (u->codec == UNPACK_XZ)
+		n = xz_decode(u, out, len);
+	else
+#endif
+		n = lz4_decode(u, out, len);
+	if (n > 0)
+		u->pos += n;
+	return n;
+}
+
+/**
+ *	unpack_detect - find out how an image is stored
+ *	@fd: file holding the image
+ *	@base: offset of the image in fd
+ *	@stored: bytes the image takes in fd
+ *	@size: set to the size of the image once unpacked
+ *
+ *	Returns one of the UNPACK_* codecs, or -1 with errno set:
+ *	EINVAL for a damaged container, ENOTSUP for one this build or this
+ *	decoder can't read.
+ */
+int unpack_detect(int fd, off_t base, uint64_t stored, uint64_t *size)
+{
+	struct unpack u = { .fd = fd, .base = base, .stored = stored };
+	uint8_t hdr[4 + 2 + 8 + 1];
+	unsigned flags;
+	uint64_t data;
+	size_t n = stored < sizeof(hdr) ? stored : sizeof(hdr);
+
+	if (read_at(&u, hdr, n, 0))
+		return -1;
+
+	if (n >= sizeof(STORE_MAGIC) - 1 &&
+	    !memcmp(hdr, STORE_MAGIC, sizeof(STORE_MAGIC) - 1)) {
+		if (store_size(fd, base, stored, size))
+			return -1;
+		return UNPACK_CHUNKS;
+	}
+
+	if (n >= 4 && get_le32(hdr) == LZ4_MAGIC) {
+		if (!lz4_header(hdr, n, &flags, size, &data))
+			return -1;
+		return UNPACK_LZ4;
+	}
+
+	if (n >= sizeof(xz_magic) && !memcmp(hdr, xz_magic, sizeof(xz_magic))) {
+#ifdef HAVE_LZMA
+		if (xz_size(&u, size))
+			return -1;
+		return UNPACK_XZ;
+#else
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+
+	*size = stored;
+	return UNPACK_RAW;
+}
+
+/**
+ *	unpack_open - start unpacking an image
+ *	@fd: file holding the image, kept open by the caller
+ *	@base: offset of the image in fd
+ *	@stored: bytes the image takes in fd
+ *	@codec: as returned by unpack_detect()
+ *
+ *	Returns the decoder state for unpack_pread(), or NULL with errno set.
+ */
+struct unpack *unpack_open(int fd, off_t base, uint64_t stored, int codec)
+{
+	struct unpack *u, probe = { .fd = fd, .base = base };
+	uint8_t hdr[4 + 2 + 8 + 1];
+	unsigned flags = 0;
+	uint64_t size, data = 0;
+	size_t block_max = 0, in = UNPACK_IN;
+
+	if (codec <= UNPACK_RAW || codec >= UNPACK_CODECS) {
+		errno = EINVAL;
+		return NULL;
+	}
+#ifndef HAVE_LZMA
+	if (codec == UNPACK_XZ) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+#endif
+	if (codec == UNPACK_CHUNKS) {
+		u = unpack_alloc(0, 0);
+		if (!u)
+			return NULL;
+		u->codec = codec;
+		u->store = store_open(fd, base, stored);
+		if (!u->store) {
+			unpack_free(u);
+			return NULL;
+		}
+		return u;
+	}
+	if (codec == UNPACK_LZ4) {
+		if (stored < sizeof(hdr)) {
+			errno = EINVAL;
+			return NULL;
+		}
+		if (read_at(&probe, hdr, sizeof(hdr), 0))
+			return NULL;
+		block_max = lz4_header(hdr, sizeof(hdr), &flags, &size, &data);
+		if (!block_max)
+			return NULL;
+		in = block_max;
+	}
+
+	u = unpack_alloc(in, codec == UNPACK_LZ4 ? LZ4_HISTORY + block_max : 0);
+	if (!u)
+		return NULL;
+	u->fd = fd;
+	u->base = base;
+	u->stored = stored;
+	u->codec = codec;
+	u->flags = flags;
+	u->data = data;
+	u->block_max = block_max;
+
+	if (codec == UNPACK_LZ4)
+		u->size = size;
+#ifdef HAVE_LZMA
+	else {
+		u->strm = (lzma_stream)LZMA_STREAM_INIT;
+		if (xz_size(u, &u->size)) {
+			unpack_free(u);
+			return NULL;
+		}
+	}
+#endif
+
+	if (unpack_rewind(u)) {
+		unpack_close(u);
+		return NULL;
+	}
+	return u;
+}
+
+/**
+ *	unpack_pread - read from the unpacked image
+ *	@arg: state from unpack_open()
+ *	@buf: destination
+ *	@len: bytes wanted
+ *	@off: offset in the unpacked image
+ *
+ *	Same contract as pread(), so it can stand in for it as a pipeline
+ *	source. Returns the number of bytes read, 0 past the end, or -1 with
+ *	errno set; EBADMSG if the compressed data is corrupt.
+ */
+ssize_t unpack_pread(void *arg, void *buf, size_t len, off_t off)
+{
+	struct unpack *u = arg;
+	uint64_t skip;
+	ssize_t n;
+
+	if (off < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (u->store)
+		return store_pread(u->store, buf, len, off);
+	if ((uint64_t)off < u->pos && unpack_rewind(u))
+		return -1;
+
+	/* decode and drop what lies before off, through buf itself */
+	while (u->pos < (uint64_t)off && len) {
+		skip = off - u->pos;
+		n = unpack_decode(u, buf, skip < len ? skip : len);
+		if (n <= 0)
+			return n;
+	}
+	return unpack_decode(u, buf, len);
+}
+
+void unpack_close(struct unpack *u)
+{
+	if (!u)
+		return;
+#ifdef HAVE_LZMA
+	if (u->codec == UNPACK_XZ)
+		lzma_end(&u->strm);
+#endif
+	store_close(u->store);
+	unpack_free(u);
+}
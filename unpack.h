@@ -0,0 +1,26 @@
+/* Streaming decompression of firmware images */
+
+#ifndef UNPACK_H
+#define UNPACK_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define UNPACK_RAW	0
+#define UNPACK_XZ	1
+#define UNPACK_LZ4	2	/* LZ4 frame, written with --content-size */
+#define UNPACK_CHUNKS	3	/* recipe of chunks in the store */
+#define UNPACK_CODECS	4
+
+/* file name suffixes tried for every image, "" first */
+extern const char *unpack_suffixes[];
+extern const char *unpack_names[UNPACK_CODECS];
+
+struct unpack;
+
+int unpack_detect(int fd, off_t base, uint64_t stored, uint64_t *size);
+struct unpack *unpack_open(int fd, off_t base, uint64_t stored, int codec);
+ssize_t unpack_pread(void *arg, void *buf, size_t len, off_t off);
+void unpack_close(struct unpack *u);
+
+#endif
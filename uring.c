@@ -0,0 +1,184 @@
+/* Minimal io_uring wrapper for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Only what the loader needs: set up one ring, hand out SQEs, submit and
+ * reap completions. The syscalls are made directly so the build doesn't
+ * depend on liburing, which most router toolchains lack. Any failure here
+ * is reported with errno and the caller falls back to plain POSIX I/O.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+#include "metrics.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup	425
+#define __NR_io_uring_enter	426
+#define __NR_io_uring_register	427
+#endif
+
+/**
+ *	uring_init - create a ring and map its queues
+ *	@r: ring to set up
+ *	@entries: submission queue size, rounded up to a power of two
+ *
+ *	Returns 0, or -1 with errno set (ENOSYS on kernels before 5.1, EPERM
+ *	when io_uring is disabled by sysctl or a seccomp filter).
+ */
+int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->features = p.features;
+	r->entries = p.sq_entries;
+
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = 0;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto fail;
+	if (r->cq_map_len) {
+		r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto fail;
+	} else {
+		r->cq_map = r->sq_map;
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_map;
+	cq = r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	r->sq_local = *r->sq_tail;
+	return 0;
+
+fail:
+	err = errno;
+	uring_exit(r);
+	errno = err;
+	return -1;
+}
+
+void uring_exit(struct uring *r)
+{
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sq_map && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/* next free SQE, zeroed, or NULL if the submission queue is full */
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (r->sq_local - head >= r->entries)
+		return NULL;
+	idx = r->sq_local & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_local++;
+	return sqe;
+}
+
+/**
+ *	uring_submit - publish prepared SQEs and optionally wait
+ *	@r: ring
+ *	@wait_nr: completions to wait for before returning
+ *
+ *	Returns the number of SQEs consumed, or -1 with errno set.
+ */
+int uring_submit(struct uring *r, unsigned wait_nr)
+{
+	unsigned n = r->sq_local - *r->sq_tail;
+
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+	io_account(1, 0, 0);
+	return syscall(__NR_io_uring_enter, r->fd, n, wait_nr,
+		       wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* copy out and retire the oldest completion; 0, or -1 if there is none */
+int uring_cqe(struct uring *r, struct io_uring_cqe *cqe)
+{
+	unsigned head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return -1;
+	*cqe = r->cqes[head & *r->cq_mask];
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* like uring_cqe(), but blocks until a completion arrives */
+int uring_wait(struct uring *r, struct io_uring_cqe *cqe)
+{
+	while (uring_cqe(r, cqe))
+		if (uring_submit(r, 1) < 0 && errno != EINTR)
+			return -1;
+	return 0;
+}
+
+int uring_register_buffers(struct uring *r, const struct iovec *iov,
+			   unsigned n)
+{
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+		       iov, n);
+}
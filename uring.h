@@ -0,0 +1,33 @@
+/* Minimal io_uring wrapper on raw syscalls (no liburing needed) */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	unsigned features;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned sq_local;		/* prepared but not yet published */
+	void *sq_map, *cq_map;
+	size_t sq_map_len, cq_map_len, sqes_len;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+int uring_submit(struct uring *r, unsigned wait_nr);
+int uring_cqe(struct uring *r, struct io_uring_cqe *cqe);
+int uring_wait(struct uring *r, struct io_uring_cqe *cqe);
+int uring_register_buffers(struct uring *r, const struct iovec *iov,
+			   unsigned n);
+
+#endif
@@ -0,0 +1,350 @@
+/* usbfs bulk transport for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * "-transport usbfs" talks to the bulk endpoints of the device's serial
+ * interface through /dev/bus/usb instead of through qcserial and the tty
+ * layer. Given a ttyUSB, the interface behind it is found in sysfs and
+ * taken over from qcserial; a /dev/bus/usb node is searched for the
+ * first interface with a bulk endpoint each way.
+ *
+ * Writes are split into URBs of USBFS_URB bytes with up to USBFS_URBS of
+ * them in flight, so the host controller always has the next one queued
+ * and no tty buffer or line discipline sits in between. Responses are
+ * read with synchronous bulk transfers of USBFS_RBUF bytes; anything past
+ * what the caller asked for is kept for the next read.
+ *
+ * On close the interface is released and handed back to its driver, so
+ * the ttyUSB reappears if the device didn't reset after the load.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+
+#include "transport.h"
+#include "metrics.h"
+
+#define USBFS_TIMEOUT	30000	/* ms for a URB, as for an image's ack */
+
+#define USBFS_URB	(16 * 1024)	/* the limit of older kernels */
+#define USBFS_URBS	8
+#define USBFS_DESC	4096		/* device and config descriptors */
+#define USBFS_PREFIX	"/dev/bus/usb/"
+
+static int read_attr(const char *dir, const char *attr, const char *fmt,
+		     unsigned *val)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, fmt, val) == 1 ? 0 : -1;
+	fclose(f);
+	return ret;
+}
+
+/* the usbfs node and interface number of the USB interface behind tty */
+static int usbfs_from_tty(const char *tty, char *node, size_t len,
+			  unsigned *intf)
+{
+	char link[64], dir[PATH_MAX], *slash;
+	unsigned bus, dev;
+	int have_intf = 0;
+	struct stat st;
+
+	if (stat(tty, &st) || !S_ISCHR(st.st_mode))
+		return -1;
+	snprintf(link, sizeof(link), "/sys/dev/char/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(link, dir))
+		return -1;
+
+	while ((slash = strrchr(dir, '/')) && slash != dir) {
+		if (!have_intf)
+			have_intf = !read_attr(dir, "bInterfaceNumber", "%x",
+					       intf);
+		else if (!read_attr(dir, "busnum", "%u", &bus) &&
+			 !read_attr(dir, "devnum", "%u", &dev)) {
+			snprintf(node, len, USBFS_PREFIX "%03u/%03u", bus, dev);
+			return 0;
+		}
+		*slash = '\0';
+	}
+	errno = ENODEV;
+	return -1;
+}
+
+/*
+ * Find the bulk endpoints of interface t->intf, or of the first interface
+ * that has both if any is set, in the active configuration.
+ */
+static int usbfs_endpoints(struct transport *t, int any)
+{
+	uint8_t desc[USBFS_DESC];
+	const struct usb_interface_descriptor *id;
+	const struct usb_endpoint_descriptor *ed;
+	unsigned intf = 0, alt = 0, configs = 0;
+	ssize_t n, off;
+
+	n = read(t->fd, desc, sizeof(desc));
+	io_account(1, 0, 0);
+	if (n < USB_DT_DEVICE_SIZE)
+		return -1;
+
+	for (off = 0; off + 2 <= n && desc[off] >= 2; off += desc[off]) {
+		switch (desc[off + 1]) {
+		case USB_DT_CONFIG:
+			/* the first configuration is the one in use */
+			if (configs++)
+				goto done;
+			break;
+		case USB_DT_INTERFACE:
+			id = (const void *)&desc[off];
+			if (t->ep_in && t->ep_out)
+				goto done;
+			intf = id->bInterfaceNumber;
+			alt = id->bAlternateSetting;
+			if (any)
+				t->ep_in = t->ep_out = 0;
+			break;
+		case USB_DT_ENDPOINT:
+			ed = (const void *)&desc[off];
+			if (alt || (!any && intf != t->intf) ||
+			    (ed->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK) !=
+			    USB_ENDPOINT_XFER_BULK)
+				break;
+			if (ed->bEndpointAddress & USB_DIR_IN)
+				t->ep_in = ed->bEndpointAddress;
+			else
+				t->ep_out = ed->bEndpointAddress;
+			t->intf = intf;
+			break;
+		}
+	}
+done:
+	if (!t->ep_in || !t->ep_out) {
+		errno = ENXIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int usbfs_driver(struct transport *t, unsigned long code)
+{
+	struct usbdevfs_ioctl cmd = {
+		.ifno = t->intf,
+		.ioctl_code = code,
+	};
+
+	io_account(1, 0, 0);
+	return ioctl(t->fd, USBDEVFS_IOCTL, &cmd);
+}
+
+static int usbfs_open(struct transport *t, const char *path)
+{
+	char node[PATH_MAX];
+	int any = 0;
+
+	if (!strncmp(path, USBFS_PREFIX, strlen(USBFS_PREFIX))) {
+		snprintf(node, sizeof(node), "%s", path);
+		any = 1;
+	} else if (usbfs_from_tty(path, node, sizeof(node), &t->intf)) {
+		return -1;
+	}
+
+	t->fd = open(node, O_RDWR | O_CLOEXEC);
+	if (t->fd == -1)
+		return -1;
+	if (usbfs_endpoints(t, any))
+		goto fail;
+
+	/* ENODATA if no driver is bound, which is fine */
+	usbfs_driver(t, USBDEVFS_DISCONNECT);
+	io_account(1, 0, 0);
+	if (ioctl(t->fd, USBDEVFS_CLAIMINTERFACE, &t->intf))
+		goto fail;
+	return 0;
+
+fail:
+	close(t->fd);
+	return -1;
+}
+
+/* the next finished URB, waiting at most timeout ms for one */
+static struct usbdevfs_urb *usbfs_reap(struct transport *t, int timeout)
+{
+	struct pollfd pfd = { .fd = t->fd, .events = POLLOUT };
+	struct usbdevfs_urb *urb;
+	int ret;
+
+	for (;;) {
+		io_account(1, 0, 0);
+		if (!ioctl(t->fd, USBDEVFS_REAPURBNDELAY, &urb))
+			return urb;
+		if (errno != EAGAIN && errno != EINTR)
+			return NULL;
+
+		ret = poll(&pfd, 1, timeout);
+		io_account(1, 0, 0);
+		if (ret == 0) {
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+		if (ret < 0 && errno != EINTR)
+			return NULL;
+	}
+}
+
+/*
+ * All of buf goes out before this returns, so the whole write is one
+ * stretch of back to back URBs; on error nothing is said about how much
+ * of it the device got.
+ */
+static ssize_t usbfs_write(struct transport *t, const void *buf, size_t len)
+{
+	struct usbdevfs_urb urbs[USBFS_URBS], *urb;
+	size_t off = 0, done = 0;
+	unsigned head = 0, inflight = 0, i;
+	int err = 0;
+
+	while (done < len && !err) {
+		while (off < len && inflight < USBFS_URBS) {
+			urb = &urbs[head];
+			memset(urb, 0, sizeof(*urb));
+			urb->type = USBDEVFS_URB_TYPE_BULK;
+			urb->endpoint = t->ep_out;
+			urb->buffer = (char *)buf + off;
+			urb->buffer_length = len - off < USBFS_URB ?
+					     len - off : USBFS_URB;
+			io_account(1, 0, 0);
+			if (ioctl(t->fd, USBDEVFS_SUBMITURB, urb)) {
+				err = errno;
+				break;
+			}
+			off += urb->buffer_length;
+			head = (head + 1) % USBFS_URBS;
+			inflight++;
+		}
+		if (!inflight)
+			break;
+
+		urb = usbfs_reap(t, USBFS_TIMEOUT);
+		if (!urb) {
+			err = errno;
+			break;
+		}
+		inflight--;
+		if (urb->status) {
+			err = -urb->status;
+			break;
+		}
+		done += urb->actual_length;
+		io_account(0, urb->actual_length, 0);
+	}
+
+	if (inflight) {
+		for (i = 0; i < USBFS_URBS; i++)
+			ioctl(t->fd, USBDEVFS_DISCARDURB, &urbs[i]);
+		while (inflight-- && usbfs_reap(t, USBFS_TIMEOUT))
+			;
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return done;
+}
+
+static ssize_t usbfs_read(struct transport *t, void *buf, size_t len,
+			  int timeout)
+{
+	struct usbdevfs_bulktransfer bulk = {
+		.ep = t->ep_in,
+		.len = sizeof(t->rbuf),
+		.timeout = timeout > 0 ? timeout : 1,	/* 0 waits forever */
+		.data = t->rbuf,
+	};
+	int n;
+
+	if (t->rpos == t->rlen) {
+		n = ioctl(t->fd, USBDEVFS_BULK, &bulk);
+		io_account(1, 0, n > 0 ? n : 0);
+		if (n < 0)
+			return errno == ETIMEDOUT || errno == EINTR ? 0 : -1;
+		t->rpos = 0;
+		t->rlen = n;
+	}
+	if (len > t->rlen - t->rpos)
+		len = t->rlen - t->rpos;
+	memcpy(buf, t->rbuf + t->rpos, len);
+	t->rpos += len;
+	return len;
+}
+
+/* a finished URB has been acknowledged by the device */
+static int usbfs_drain(struct transport *t)
+{
+	return 0;
+}
+
+static void usbfs_flush(struct transport *t, int queue)
+{
+	t->rpos = t->rlen = 0;
+}
+
+static int usbfs_gone(struct transport *t)
+{
+	struct usbdevfs_connectinfo ci;
+
+	io_account(1, 0, 0);
+	return ioctl(t->fd, USBDEVFS_CONNECTINFO, &ci) && errno == ENODEV;
+}
+
+static void usbfs_close(struct transport *t)
+{
+	io_account(1, 0, 0);
+	ioctl(t->fd, USBDEVFS_RELEASEINTERFACE, &t->intf);
+	usbfs_driver(t, USBDEVFS_CONNECT);
+	close(t->fd);
+}
+
+const struct transport_ops usbfs_ops = {
+	.name = "usbfs",
+	.open = usbfs_open,
+	.write = usbfs_write,
+	/* no writev: a held header is one more URB queued ahead of the data */
+	.read = usbfs_read,
+	.drain = usbfs_drain,
+	.flush = usbfs_flush,
+	.gone = usbfs_gone,
+	.close = usbfs_close,
+};
@@ -0,0 +1,74 @@
+/* Chip variant tables for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every chip variant is loaded the same way: hello, then open, header and
+ * data for each of its stages in order, then reset. What differs is data:
+ * the hello frame, which images are sent and under which type, and what
+ * the device answers. Supporting another variant means adding an entry to
+ * qdl_variants[] and bumping QDL_VARIANTS; the loader, daemon and bundle
+ * code only walk the table.
+ *
+ * Frames that don't depend on the firmware are kept here in wire form,
+ * flags and CRC included, so they are never rebuilt at run time. None of
+ * their bytes needs HDLC escaping.
+ */
+
+#include <string.h>
+
+#include "variant.h"
+
+/* "QCOM high speed protocol hst", then the host's protocol versions */
+#define HELLO_FRAME(ver, crc_lo, crc_hi)				\
+	{ 0x7e, 0x01, 'Q', 'C', 'O', 'M', ' ', 'h', 'i', 'g', 'h', ' ',	\
+	  's', 'p', 'e', 'e', 'd', ' ', 'p', 'r', 'o', 't', 'o', 'c',	\
+	  'o', 'l', ' ', 'h', 's', 't', 0x00, 0x00, 0x00, 0x00,		\
+	  (ver), (ver), 0x30, (crc_lo), (crc_hi), 0x7e }
+
+static const uint8_t hello_gobi1000[] = HELLO_FRAME(0x04, 0x03, 0x0b);
+static const uint8_t hello_gobi2000[] = HELLO_FRAME(0x05, 0x07, 0x48);
+
+const uint8_t qdl_reset_frame[QDL_RESET_LEN] = { 0x7e, 0x29, 0xbb, 0x4c, 0x7e };
+
+/* the trailing 8 bytes of amss.mbn are not sent to the device */
+#define STAGE_AMSS	{ 0x05, { "amss.mbn" }, 8, 0x26, 0x28 }
+#define STAGE_APPS	{ 0x06, { "apps.mbn" }, 0, 0x26, 0x28 }
+#define STAGE_UQCN	{ 0x0d, { "UQCN.mbn", "uqcn.mbn" }, 0, 0x26, 0x28 }
+
+static const struct qdl_stage stages_gobi1000[] = { STAGE_AMSS, STAGE_APPS };
+static const struct qdl_stage stages_gobi2000[] = {
+	STAGE_AMSS, STAGE_APPS, STAGE_UQCN
+};
+
+#define VARIANT(n, hello, stages) \
+	{ n, hello, sizeof(hello), 0x02, \
+	  sizeof(stages) / sizeof(stages[0]), stages }
+
+const struct qdl_variant qdl_variants[QDL_VARIANTS] = {
+	[QDL_GOBI1000] = VARIANT("gobi1000", hello_gobi1000, stages_gobi1000),
+	[QDL_GOBI2000] = VARIANT("gobi2000", hello_gobi2000, stages_gobi2000),
+};
+
+/* index of the variant called name, or -1 */
+int qdl_variant_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < QDL_VARIANTS; i++)
+		if (!strcmp(name, qdl_variants[i].name))
+			return i;
+	return -1;
+}
@@ -0,0 +1,40 @@
+/* Chip variants and the QDL stages each one is loaded with */
+
+#ifndef VARIANT_H
+#define VARIANT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define QDL_GOBI1000	0
+#define QDL_GOBI2000	1
+#define QDL_VARIANTS	2
+
+#define QDL_MAX_NAMES	2	/* file name candidates per image */
+
+/* one image: open request, raw header and data, then the device's check */
+struct qdl_stage {
+	uint8_t type;			/* image type in the open request */
+	const char *names[QDL_MAX_NAMES + 1];	/* NULL terminated */
+	unsigned trim;			/* trailing bytes not sent */
+	char open_ack;			/* response to the open request */
+	char done_ack;			/* response once the image is checked */
+};
+
+struct qdl_variant {
+	const char *name;
+	const uint8_t *hello;		/* wire form, CRC included */
+	size_t hello_len;
+	char hello_ack;
+	unsigned nstages;
+	const struct qdl_stage *stages;
+};
+
+extern const struct qdl_variant qdl_variants[QDL_VARIANTS];
+
+#define QDL_RESET_LEN	5
+extern const uint8_t qdl_reset_frame[QDL_RESET_LEN];
+
+int qdl_variant_find(const char *name);
+
+#endif
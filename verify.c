@@ -0,0 +1,546 @@
+/* Firmware manifests and image verification for gobi_loader */
+
+/*
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of version 2 of the GNU General Public
+ * License as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A firmware directory may carry a SHA256SUMS manifest in sha256sum's
+ * format, "<hex>  <name>" per line, with the hash of every image file as
+ * it is unpacked; for plain images that is what sha256sum prints, so
+ * "sha256sum -c" checks the manifest "gobi_loader manifest dir" writes.
+ * The bytes a stage trims (the 8 byte trailer of amss.mbn) are hashed
+ * but never sent. As the hash doesn't depend on how an image is stored,
+ * the manifest stays valid when the directory is compressed or imported
+ * into the store.
+ *
+ * While loading, an image listed in the manifest is hashed by the
+ * pipeline's reader thread as it reads ahead of the link. The read that
+ * would hand over the last chunk fails if the hash doesn't match, so a
+ * damaged image never reaches the device in full and the stage stops
+ * there instead of waiting for the device to judge it.
+ *
+ * "gobi_loader verify tree" checks every manifest below tree ahead of
+ * time: the directory walk feeds the images to one thread per CPU.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "verify.h"
+#include "bundle.h"
+#include "gobi_loader.h"
+#include "unpack.h"
+
+#define VERIFY_BUF	(64 * 1024)
+#define VERIFY_QUEUE	16	/* images between the walk and the workers */
+#ifdef STATIC_RING
+#define VERIFY_THREADS	1	/* there is one unpacker */
+#else
+#define VERIFY_THREADS	64
+#endif
+
+static int manifest_read(const char *dir, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" VERIFY_MANIFEST, dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	n = read(fd, buf, len);
+	close(fd);
+	if (n < 0)
+		return -1;
+	if ((size_t)n == len) {
+		errno = EFBIG;
+		return -1;
+	}
+	buf[n] = '\0';
+	return 0;
+}
+
+static int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* the next entry of a manifest read into *p: 1, 0 at its end, -1 if bad */
+static int manifest_next(char **p, uint8_t digest[SHA256_DIGEST_LEN],
+			 const char **name)
+{
+	char *line, *end;
+	int i, hi, lo;
+
+	do {
+		line = *p;
+		if (!*line)
+			return 0;
+		end = line + strcspn(line, "\n");
+		*p = *end ? end + 1 : end;
+		*end = '\0';
+		if (end > line && end[-1] == '\r')
+			end[-1] = '\0';
+	} while (!*line || *line == '#');
+
+	for (i = 0; i < SHA256_DIGEST_LEN; i++) {
+		hi = hex_nibble(line[2 * i]);
+		lo = hi < 0 ? -1 : hex_nibble(line[2 * i + 1]);
+		if (lo < 0)
+			return -1;
+		digest[i] = hi << 4 | lo;
+	}
+	line += 2 * SHA256_DIGEST_LEN;
+	/* "  name", or " *name" from sha256sum -b */
+	if (line[0] != ' ' || (line[1] != ' ' && line[1] != '*') || !line[2])
+		return -1;
+	*name = line + 2;
+	return 1;
+}
+
+/**
+ *	verify_lookup - expected hash of a stage's image
+ *	@fwdir: firmware directory
+ *	@stage: stage whose image is wanted
+ *	@want: set to the hash from the manifest
+ *
+ *	Returns 1 if the image is listed, 0 if fwdir has no manifest, or -1
+ *	after printing why the manifest can't be used; once there is one,
+ *	every image has to be in it.
+ */
+int verify_lookup(const char *fwdir, const struct qdl_stage *stage,
+		  uint8_t want[SHA256_DIGEST_LEN])
+{
+	char buf[VERIFY_MANIFEST_MAX], *p = buf;
+	const char *name;
+	const char *const *n;
+	int ret;
+
+	if (manifest_read(fwdir, buf, sizeof(buf))) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n", fwdir,
+			VERIFY_MANIFEST, strerror(errno));
+		return -1;
+	}
+	while ((ret = manifest_next(&p, want, &name)) > 0)
+		for (n = stage->names; *n; n++)
+			if (!strcmp(name, *n))
+				return 1;
+	fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n", fwdir, VERIFY_MANIFEST,
+		ret ? "malformed line" : "image not listed");
+	return -1;
+}
+
+/* hash the trimmed bytes after the sent ones, then judge the image */
+static void verify_finish(struct verify *v)
+{
+	uint8_t digest[SHA256_DIGEST_LEN];
+	char buf[64];
+	off_t off = v->size;
+	ssize_t n;
+
+	while (off < v->size + v->trim) {
+		n = v->size + v->trim - off;
+		n = v->read(v->arg, buf, n < (ssize_t)sizeof(buf) ?
+			    n : (ssize_t)sizeof(buf), v->start + off);
+		if (n <= 0) {
+			v->state = VERIFY_BAD;
+			return;
+		}
+		sha256_update(&v->c, buf, n);
+		off += n;
+	}
+	sha256_final(&v->c, digest);
+	v->state = memcmp(digest, v->want, sizeof(digest)) ?
+		   VERIFY_BAD : VERIFY_OK;
+}
+
+/**
+ *	verify_start - hash an image while it is read for the device
+ *	@v: want filled in by verify_lookup()
+ *	@read: source of the image, pread() shaped
+ *	@arg: passed to read
+ *	@start: offset of the image's first byte in the source
+ *	@size: bytes sent to the device
+ *	@trim: bytes the source holds after those, which the manifest covers
+ *
+ *	Reads go through verify_pread(v, ...) from then on.
+ */
+void verify_start(struct verify *v, pipeline_read_fn read, void *arg,
+		  off_t start, off_t size, off_t trim)
+{
+	v->read = read;
+	v->arg = arg;
+	v->start = start;
+	v->size = size;
+	v->trim = trim;
+	v->hashed = 0;
+	v->state = VERIFY_PENDING;
+	sha256_init(&v->c);
+	if (!size)
+		verify_finish(v);
+}
+
+/**
+ *	verify_pread - read from an image being verified
+ *	@arg: the struct verify
+ *	@buf: as for pread()
+ *	@len: as for pread()
+ *	@off: as for pread()
+ *
+ *	Bytes are hashed the first time they are read, so ranges that are
+ *	sent again after a retry don't count twice. Fails with EBADMSG
+ *	instead of returning the image's last byte if the hash is wrong.
+ */
+ssize_t verify_pread(void *arg, void *buf, size_t len, off_t off)
+{
+	struct verify *v = arg;
+	off_t pos = off - v->start;
+	ssize_t n, skip;
+
+	n = v->read(v->arg, buf, len, off);
+	if (n <= 0)
+		return n;
+
+	if (pos <= v->hashed && pos + n > v->hashed) {
+		skip = v->hashed - pos;
+		sha256_update(&v->c, (char *)buf + skip, n - skip);
+		v->hashed = pos + n;
+		if (v->hashed == v->size)
+			verify_finish(v);
+	}
+	if (pos + n == v->size && v->state != VERIFY_OK) {
+		v->state = VERIFY_BAD;
+		errno = EBADMSG;
+		return -1;
+	}
+	return n;
+}
+
+/* sha256 of the first size bytes fd holds, unpacked with codec */
+static int hash_image(int fd, uint64_t stored, int codec, uint64_t size,
+		      uint8_t digest[SHA256_DIGEST_LEN])
+{
+	struct unpack *z = NULL;
+	struct sha256 c;
+	char buf[VERIFY_BUF];
+	uint64_t off = 0;
+	ssize_t n = 0;
+	size_t want;
+
+	if (codec != UNPACK_RAW) {
+		z = unpack_open(fd, 0, stored, codec);
+		if (!z)
+			return -1;
+	} else {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	sha256_init(&c);
+	while (off < size) {
+		want = size - off < sizeof(buf) ? size - off : sizeof(buf);
+		n = z ? unpack_pread(z, buf, want, off) :
+			pread(fd, buf, want, off);
+		if (n <= 0)
+			break;
+		sha256_update(&c, buf, n);
+		off += n;
+	}
+	unpack_close(z);
+	if (off < size) {
+		if (!n)
+			errno = EIO;	/* shrank */
+		return -1;
+	}
+	sha256_final(&c, digest);
+	return 0;
+}
+
+/**
+ *	verify_write_manifest - write the manifest of a firmware directory
+ *	@fwdir: firmware directory
+ *	@variant: variant whose images are listed
+ *
+ *	Returns 0, or -1 with errno set.
+ */
+int verify_write_manifest(const char *fwdir, int variant)
+{
+	const struct qdl_variant *v = &qdl_variants[variant];
+	struct bundle_header h;
+	int fds[QDL_MAX_IMAGES];
+	uint8_t digest[SHA256_DIGEST_LEN];
+	char hex[SHA256_HEX_LEN];
+	char out[VERIFY_MANIFEST_MAX];
+	char path[PATH_MAX], tmp[PATH_MAX];
+	const char *const *n;
+	size_t len = 0;
+	int i, fd, err = 0;
+
+	if (bundle_build(fwdir, variant, &h, fds))
+		return -1;
+	for (i = 0; i < h.nimages; i++) {
+		if (!err && hash_image(fds[i], h.img[i].stored, h.img[i].codec,
+				       h.img[i].size + v->stages[i].trim,
+				       digest))
+			err = errno;
+		close(fds[i]);
+		if (err)
+			continue;
+		/* listed under the stage's name, without a codec suffix */
+		for (n = v->stages[i].names; n[1]; n++)
+			if (!strncmp(h.img[i].name, *n, strlen(*n)))
+				break;
+		sha256_hex(digest, hex);
+		len += snprintf(out + len, sizeof(out) - len, "%s  %s\n", hex,
+				*n);
+	}
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/" VERIFY_MANIFEST, fwdir);
+	snprintf(tmp, sizeof(tmp), "%s/" VERIFY_MANIFEST ".XXXXXX", fwdir);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		return -1;
+	if (write_all(fd, out, len) || fchmod(fd, 0644) || fsync(fd))
+		err = errno;
+	if (close(fd) && !err)
+		err = errno;
+	if (!err && rename(tmp, path))
+		err = errno;
+	if (err) {
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+struct verify_job {
+	char path[PATH_MAX];	/* image as named in the manifest */
+	uint8_t want[SHA256_DIGEST_LEN];
+};
+
+static struct verify_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;		/* walk -> workers */
+	pthread_cond_t room;		/* workers -> walk */
+	struct verify_job jobs[VERIFY_QUEUE];
+	unsigned head;
+	unsigned count;
+	int done;			/* the walk is over */
+	unsigned dirs;
+	unsigned images;
+	unsigned bad;			/* images, or manifests that failed */
+} queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+};
+
+/* 0 if the image matches, or -1 after printing what is wrong with it */
+static int verify_check(const struct verify_job *j)
+{
+	char file[PATH_MAX];
+	uint8_t digest[SHA256_DIGEST_LEN];
+	const char **suffix;
+	struct stat st;
+	uint64_t size = 0;
+	int fd = -1, codec = -1;
+
+	for (suffix = unpack_suffixes; *suffix; suffix++) {
+		snprintf(file, sizeof(file), "%s%s", j->path, *suffix);
+		fd = open(file, O_RDONLY | O_CLOEXEC);
+		if (fd != -1 || errno != ENOENT)
+			break;
+	}
+	if (fd == -1) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", j->path,
+			strerror(errno));
+		return -1;
+	}
+	if (!fstat(fd, &st))
+		codec = unpack_detect(fd, 0, st.st_size, &size);
+	if (codec < 0 || hash_image(fd, st.st_size, codec, size, digest)) {
+		fprintf(stderr, "[QDL ERROR]: %s: %s\n", file,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	if (memcmp(digest, j->want, sizeof(digest))) {
+		fprintf(stderr, "[QDL ERROR]: %s: does not match %s\n", file,
+			VERIFY_MANIFEST);
+		return -1;
+	}
+	printf("QDL verify %s ok\n", file);
+	return 0;
+}
+
+static void *verify_worker(void *arg)
+{
+	struct verify_queue *q = arg;
+	struct verify_job job;
+	int ret;
+
+	pthread_mutex_lock(&q->lock);
+	for (;;) {
+		while (!q->count && !q->done)
+			pthread_cond_wait(&q->ready, &q->lock);
+		if (!q->count)
+			break;
+		job = q->jobs[q->head];
+		q->head = (q->head + 1) % VERIFY_QUEUE;
+		q->count--;
+		pthread_cond_signal(&q->room);
+		pthread_mutex_unlock(&q->lock);
+
+		ret = verify_check(&job);
+
+		pthread_mutex_lock(&q->lock);
+		q->images++;
+		if (ret)
+			q->bad++;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+static void verify_push(struct verify_queue *q, const struct verify_job *j)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == VERIFY_QUEUE)
+		pthread_cond_wait(&q->room, &q->lock);
+	q->jobs[(q->head + q->count) % VERIFY_QUEUE] = *j;
+	q->count++;
+	pthread_cond_signal(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void verify_walk(struct verify_queue *q, const char *dir)
+{
+	char buf[VERIFY_MANIFEST_MAX], *p = buf;
+	char sub[PATH_MAX];
+	struct verify_job job;
+	const char *name;
+	struct dirent *e;
+	struct stat st;
+	DIR *d;
+	int ret;
+
+	if (!manifest_read(dir, buf, sizeof(buf))) {
+		while ((ret = manifest_next(&p, job.want, &name)) > 0) {
+			snprintf(job.path, sizeof(job.path), "%s/%s", dir,
+				 name);
+			verify_push(q, &job);
+		}
+		pthread_mutex_lock(&q->lock);
+		q->dirs++;
+		if (ret)
+			q->bad++;
+		pthread_mutex_unlock(&q->lock);
+		if (ret)
+			fprintf(stderr, "[QDL ERROR]: %s/%s: malformed line\n",
+				dir, VERIFY_MANIFEST);
+	} else if (errno != ENOENT && errno != ENOTDIR) {
+		fprintf(stderr, "[QDL ERROR]: %s/%s: %s\n", dir,
+			VERIFY_MANIFEST, strerror(errno));
+		pthread_mutex_lock(&q->lock);
+		q->bad++;
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	d = opendir(dir);
+	if (!d)
+		return;
+	/* dot entries are skipped, and symlinks aren't followed */
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", dir, e->d_name);
+		if (e->d_type == DT_DIR ||
+		    (e->d_type == DT_UNKNOWN && !lstat(sub, &st) &&
+		     S_ISDIR(st.st_mode)))
+			verify_walk(q, sub);
+	}
+	closedir(d);
+}
+
+/**
+ *	verify_tree - check every manifest below a directory
+ *	@root: firmware directory or tree of them
+ *
+ *	Images are hashed in parallel, one thread per CPU. Returns 0 if
+ *	there was at least one manifest and everything matched, or -1 after
+ *	printing what didn't.
+ */
+int verify_tree(const char *root)
+{
+	struct verify_queue *q = &queue;
+	pthread_t tids[VERIFY_THREADS];
+	long long t = monotonic_ms();
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i, threads = 0;
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > VERIFY_THREADS)
+		cpus = VERIFY_THREADS;
+	for (i = 0; i < cpus; i++) {
+		if (pthread_create(&tids[i], NULL, verify_worker, q))
+			break;
+		threads++;
+	}
+	if (!threads) {
+		perror("Failed to start verification: ");
+		return -1;
+	}
+
+	verify_walk(q, root);
+
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	pthread_cond_broadcast(&q->ready);
+	pthread_mutex_unlock(&q->lock);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	if (!q->dirs) {
+		fprintf(stderr, "[QDL ERROR]: no %s below %s\n",
+			VERIFY_MANIFEST, root);
+		return -1;
+	}
+	printf("QDL verified %u images in %u directories, %u bad, "
+	       "%u threads, %lld ms\n", q->images, q->dirs, q->bad, threads,
+	       monotonic_ms() - t);
+	return q->bad ? -1 : 0;
+}
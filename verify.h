@@ -0,0 +1,41 @@
+/* Image hashes from a firmware manifest, checked while loading */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pipeline.h"
+#include "sha256.h"
+#include "variant.h"
+
+#define VERIFY_MANIFEST	"SHA256SUMS"	/* in the firmware directory */
+#define VERIFY_MANIFEST_MAX	4096	/* a few lines per directory */
+
+#define VERIFY_PENDING	0
+#define VERIFY_OK	1
+#define VERIFY_BAD	2
+
+/* an image being hashed as the pipeline reads it */
+struct verify {
+	int state;
+	uint8_t want[SHA256_DIGEST_LEN];
+	struct sha256 c;
+	off_t start;		/* image offset 0 in the source */
+	off_t size;		/* bytes sent to the device */
+	off_t trim;		/* bytes after those, hashed but not sent */
+	off_t hashed;		/* image bytes hashed so far */
+	pipeline_read_fn read;	/* the source */
+	void *arg;
+};
+
+int verify_lookup(const char *fwdir, const struct qdl_stage *stage,
+		  uint8_t want[SHA256_DIGEST_LEN]);
+void verify_start(struct verify *v, pipeline_read_fn read, void *arg,
+		  off_t start, off_t size, off_t trim);
+ssize_t verify_pread(void *arg, void *buf, size_t len, off_t off);
+int verify_write_manifest(const char *fwdir, int variant);
+int verify_tree(const char *root);
+
+#endif